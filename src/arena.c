@@ -0,0 +1,179 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * Copyright (C) 2015 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "config.h"
+
+#include <stdarg.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "arena.h"
+
+/* A bump allocator for data that lives exactly as long as one load
+ * of the users: memory is taken from large blocks and only given back
+ * all at once, by arena_free().  It is not thread-safe; each thread
+ * that reads a source has its own.
+ */
+
+#define ALIGNMENT (2 * sizeof (gpointer))
+
+typedef struct Block Block;
+
+struct Block {
+        Block  *next;
+        gsize   size;
+        gsize   used;
+};
+
+struct Arena {
+        Block  *blocks;         /* the current block comes first */
+        gsize   block_size;
+};
+
+#define BLOCK_HEADER_SIZE ((sizeof (Block) + ALIGNMENT - 1) & ~(ALIGNMENT - 1))
+
+Arena *
+arena_new (gsize block_size)
+{
+        Arena *arena;
+
+        arena = g_new0 (Arena, 1);
+        arena->block_size = MAX (block_size, 1024);
+
+        return arena;
+}
+
+void
+arena_free (Arena *arena)
+{
+        Block *block;
+        Block *next;
+
+        for (block = arena->blocks; block != NULL; block = next) {
+                next = block->next;
+                g_free (block);
+        }
+
+        g_free (arena);
+}
+
+static Block *
+add_block (Arena *arena,
+           gsize  size,
+           gboolean current)
+{
+        Block *block;
+
+        block = g_malloc (BLOCK_HEADER_SIZE + size);
+        block->size = size;
+        block->used = 0;
+
+        /* Oversized allocations get a block of their own, which is
+         * put behind the current one so that its space is not lost.
+         */
+        if (current || arena->blocks == NULL) {
+                block->next = arena->blocks;
+                arena->blocks = block;
+        }
+        else {
+                block->next = arena->blocks->next;
+                arena->blocks->next = block;
+        }
+
+        return block;
+}
+
+gpointer
+arena_alloc (Arena *arena,
+             gsize  size)
+{
+        Block *block;
+        gpointer mem;
+
+        size = (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+
+        if (size > arena->block_size / 4) {
+                block = add_block (arena, size, FALSE);
+        }
+        else {
+                block = arena->blocks;
+                if (block == NULL || block->size - block->used < size)
+                        block = add_block (arena, arena->block_size, TRUE);
+        }
+
+        mem = (guint8 *) block + BLOCK_HEADER_SIZE + block->used;
+        block->used += size;
+
+        return mem;
+}
+
+gchar *
+arena_strndup (Arena       *arena,
+               const gchar *str,
+               gsize        n)
+{
+        gchar *copy;
+        gsize length;
+
+        if (str == NULL)
+                return NULL;
+
+        length = strnlen (str, n);
+        copy = arena_alloc (arena, length + 1);
+        memcpy (copy, str, length);
+        copy[length] = '\0';
+
+        return copy;
+}
+
+gchar *
+arena_strdup (Arena       *arena,
+              const gchar *str)
+{
+        return arena_strndup (arena, str, G_MAXSIZE);
+}
+
+gchar *
+arena_strconcat (Arena       *arena,
+                 const gchar *first,
+                 ...)
+{
+        const gchar *s;
+        gchar *result;
+        gchar *p;
+        gsize length;
+        va_list args;
+
+        length = 1;
+        va_start (args, first);
+        for (s = first; s != NULL; s = va_arg (args, const gchar *))
+                length += strlen (s);
+        va_end (args);
+
+        result = arena_alloc (arena, length);
+
+        p = result;
+        va_start (args, first);
+        for (s = first; s != NULL; s = va_arg (args, const gchar *))
+                p = g_stpcpy (p, s);
+        va_end (args);
+
+        return result;
+}
@@ -0,0 +1,45 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * Copyright (C) 2015 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct Arena Arena;
+
+Arena *         arena_new               (gsize           block_size);
+void            arena_free              (Arena          *arena);
+
+gpointer        arena_alloc             (Arena          *arena,
+                                         gsize           size);
+gchar *         arena_strdup            (Arena          *arena,
+                                         const gchar    *str);
+gchar *         arena_strndup           (Arena          *arena,
+                                         const gchar    *str,
+                                         gsize           n);
+gchar *         arena_strconcat         (Arena          *arena,
+                                         const gchar    *first,
+                                         ...) G_GNUC_NULL_TERMINATED;
+
+G_END_DECLS
+
+#endif /* __ARENA_H__ */
@@ -0,0 +1,352 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * Copyright (C) 2015 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <glib.h>
+#include <glib-unix.h>
+#include <gio/gio.h>
+
+#include "change-journal.h"
+
+#define MAX_SUBSCRIBERS 32
+#define MAX_SUBSCRIBERS_PER_OWNER 4
+
+/* Records that a subscriber has not read yet are buffered up to this
+ * size; past that, the subscriber is dropped rather than letting it
+ * hold on to daemon memory.
+ */
+#define MAX_PENDING (1024 * 1024)
+
+/* The bus name that opened subscribers, if they came over the bus */
+typedef struct {
+        ChangeJournal *journal;
+        gchar         *name;
+        guint          n_subscribers;
+        guint          watch_id;
+} Owner;
+
+typedef struct {
+        ChangeJournal *journal;
+        Owner         *owner;
+        gint           fd;
+        guint          hangup_id;
+        guint          write_id;
+        GByteArray    *pending;
+} Subscriber;
+
+struct ChangeJournal {
+        GList      *subscribers;
+        guint       n_subscribers;
+        GHashTable *owners;     /* name -> Owner */
+};
+
+static void
+owner_free (Owner *owner)
+{
+        g_bus_unwatch_name (owner->watch_id);
+        g_free (owner->name);
+        g_free (owner);
+}
+
+static void
+subscriber_free (Subscriber *subscriber)
+{
+        if (subscriber->hangup_id > 0)
+                g_source_remove (subscriber->hangup_id);
+        if (subscriber->write_id > 0)
+                g_source_remove (subscriber->write_id);
+        close (subscriber->fd);
+        g_byte_array_unref (subscriber->pending);
+        g_free (subscriber);
+}
+
+static void
+remove_subscriber (Subscriber *subscriber)
+{
+        ChangeJournal *journal = subscriber->journal;
+
+        journal->subscribers = g_list_remove (journal->subscribers, subscriber);
+        journal->n_subscribers--;
+
+        if (subscriber->owner != NULL && --subscriber->owner->n_subscribers == 0)
+                g_hash_table_remove (journal->owners, subscriber->owner->name);
+
+        subscriber_free (subscriber);
+}
+
+ChangeJournal *
+change_journal_new (void)
+{
+        ChangeJournal *journal;
+
+        journal = g_new0 (ChangeJournal, 1);
+        journal->owners = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                 NULL, (GDestroyNotify) owner_free);
+
+        return journal;
+}
+
+void
+change_journal_free (ChangeJournal *journal)
+{
+        g_list_free_full (journal->subscribers, (GDestroyNotify) subscriber_free);
+        g_hash_table_destroy (journal->owners);
+        g_free (journal);
+}
+
+static void
+on_owner_vanished (GDBusConnection *connection,
+                   const gchar     *name,
+                   gpointer         user_data)
+{
+        Owner *owner = user_data;
+        ChangeJournal *journal = owner->journal;
+        GList *l, *next;
+        guint n;
+
+        g_debug ("change journal owner %s went away", name);
+
+        /* The last subscriber takes the owner with it */
+        n = owner->n_subscribers;
+        for (l = journal->subscribers; l != NULL && n > 0; l = next) {
+                Subscriber *subscriber = l->data;
+
+                next = l->next;
+
+                if (subscriber->owner == owner) {
+                        n--;
+                        remove_subscriber (subscriber);
+                }
+        }
+}
+
+static Owner *
+get_owner (ChangeJournal   *journal,
+           GDBusConnection *connection,
+           const gchar     *name)
+{
+        Owner *owner;
+
+        owner = g_hash_table_lookup (journal->owners, name);
+        if (owner != NULL)
+                return owner;
+
+        owner = g_new0 (Owner, 1);
+        owner->journal = journal;
+        owner->name = g_strdup (name);
+
+        /* Fires right away if the name is already gone */
+        owner->watch_id = g_bus_watch_name_on_connection (connection,
+                                                          name,
+                                                          G_BUS_NAME_WATCHER_FLAGS_NONE,
+                                                          NULL,
+                                                          on_owner_vanished,
+                                                          owner,
+                                                          NULL);
+        g_hash_table_insert (journal->owners, owner->name, owner);
+
+        return owner;
+}
+
+static gboolean on_subscriber_writable (gint         fd,
+                                        GIOCondition condition,
+                                        gpointer     user_data);
+
+/* Writes as much of the pending data as the socket takes, and waits
+ * for it to drain if that is not all of it.  Returns FALSE if the
+ * subscriber is gone.
+ */
+static gboolean
+flush_subscriber (Subscriber *subscriber)
+{
+        gssize written;
+
+        while (subscriber->pending->len > 0) {
+                written = send (subscriber->fd,
+                                subscriber->pending->data,
+                                subscriber->pending->len,
+                                MSG_DONTWAIT | MSG_NOSIGNAL);
+                if (written < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        if (errno == EAGAIN || errno == EWOULDBLOCK)
+                                break;
+                        return FALSE;
+                }
+
+                g_byte_array_remove_range (subscriber->pending, 0, written);
+        }
+
+        if (subscriber->pending->len > 0 && subscriber->write_id == 0)
+                subscriber->write_id = g_unix_fd_add (subscriber->fd, G_IO_OUT,
+                                                      on_subscriber_writable,
+                                                      subscriber);
+
+        return TRUE;
+}
+
+static gboolean
+on_subscriber_writable (gint         fd,
+                        GIOCondition condition,
+                        gpointer     user_data)
+{
+        Subscriber *subscriber = user_data;
+
+        subscriber->write_id = 0;
+
+        if ((condition & (G_IO_HUP | G_IO_ERR)) != 0 || !flush_subscriber (subscriber))
+                remove_subscriber (subscriber);
+
+        return FALSE;
+}
+
+static gboolean
+on_subscriber_hangup (gint         fd,
+                      GIOCondition condition,
+                      gpointer     user_data)
+{
+        Subscriber *subscriber = user_data;
+
+        g_debug ("change journal subscriber on fd %d went away", fd);
+
+        subscriber->hangup_id = 0;
+        remove_subscriber (subscriber);
+
+        return FALSE;
+}
+
+/* Returns the subscriber's end of a new socket, which the caller owns.
+ * @owner is the unique bus name of the caller on @connection, or NULL
+ * on a peer connection.
+ */
+gint
+change_journal_subscribe (ChangeJournal    *journal,
+                          GDBusConnection  *connection,
+                          const gchar      *owner,
+                          GError          **error)
+{
+        Subscriber *subscriber;
+        Owner *existing = NULL;
+        gint fds[2];
+
+        if (journal->n_subscribers >= MAX_SUBSCRIBERS) {
+                g_set_error (error, G_IO_ERROR, G_IO_ERROR_TOO_MANY_OPEN_FILES,
+                             "Too many change journal subscribers");
+                return -1;
+        }
+
+        if (owner != NULL)
+                existing = g_hash_table_lookup (journal->owners, owner);
+        if (existing != NULL && existing->n_subscribers >= MAX_SUBSCRIBERS_PER_OWNER) {
+                g_set_error (error, G_IO_ERROR, G_IO_ERROR_TOO_MANY_OPEN_FILES,
+                             "Too many change journal subscribers for %s", owner);
+                return -1;
+        }
+
+        if (socketpair (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0) {
+                g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+                             "Failed to create socket: %s", g_strerror (errno));
+                return -1;
+        }
+
+        /* Nothing is read from subscribers */
+        shutdown (fds[0], SHUT_RD);
+        shutdown (fds[1], SHUT_WR);
+
+        if (!g_unix_set_fd_nonblocking (fds[0], TRUE, error)) {
+                close (fds[0]);
+                close (fds[1]);
+                return -1;
+        }
+
+        subscriber = g_new0 (Subscriber, 1);
+        subscriber->journal = journal;
+        subscriber->fd = fds[0];
+        subscriber->pending = g_byte_array_new ();
+        if (owner != NULL) {
+                subscriber->owner = get_owner (journal, connection, owner);
+                subscriber->owner->n_subscribers++;
+        }
+        subscriber->hangup_id = g_unix_fd_add (subscriber->fd, G_IO_HUP | G_IO_ERR,
+                                               on_subscriber_hangup,
+                                               subscriber);
+
+        journal->subscribers = g_list_prepend (journal->subscribers, subscriber);
+        journal->n_subscribers++;
+
+        return fds[1];
+}
+
+void
+change_journal_append (ChangeJournal *journal,
+                       guint64        generation,
+                       ChangeLogType  type,
+                       const gchar   *object_path,
+                       const gchar   *property)
+{
+        const gchar *properties[] = { property, NULL };
+        GVariant *record;
+        guint32 length;
+        GList *l, *next;
+
+        if (journal->subscribers == NULL)
+                return;
+
+        record = g_variant_new ("(tuo^as)", generation, type, object_path, properties);
+        g_variant_ref_sink (record);
+
+        if (G_BYTE_ORDER != G_LITTLE_ENDIAN) {
+                GVariant *swapped;
+
+                swapped = g_variant_byteswap (record);
+                g_variant_unref (record);
+                record = swapped;
+        }
+
+        length = GUINT32_TO_LE (g_variant_get_size (record));
+
+        for (l = journal->subscribers; l != NULL; l = next) {
+                Subscriber *subscriber = l->data;
+
+                next = l->next;
+
+                if (subscriber->pending->len + sizeof (length) + g_variant_get_size (record) > MAX_PENDING) {
+                        g_debug ("change journal subscriber on fd %d is too slow, dropping it",
+                                 subscriber->fd);
+                        remove_subscriber (subscriber);
+                        continue;
+                }
+
+                g_byte_array_append (subscriber->pending, (const guint8 *) &length, sizeof (length));
+                g_byte_array_append (subscriber->pending, g_variant_get_data (record), g_variant_get_size (record));
+
+                /* Only try to write right away if nothing is queued */
+                if (subscriber->write_id == 0 && !flush_subscriber (subscriber))
+                        remove_subscriber (subscriber);
+        }
+
+        g_variant_unref (record);
+}
@@ -0,0 +1,64 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * Copyright (C) 2015 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __CHANGE_JOURNAL_H__
+#define __CHANGE_JOURNAL_H__
+
+#include <glib.h>
+#include <gio/gio.h>
+
+#include "change-log.h"
+
+G_BEGIN_DECLS
+
+/* Subscribers of the change journal read a stream of records from a
+ * socket, each of them a 32-bit little-endian length followed by that
+ * many bytes of a little-endian serialized GVariant of
+ * CHANGE_JOURNAL_RECORD_TYPE:
+ *
+ *   generation   as in GetChangesSince()
+ *   type         a ChangeLogType
+ *   object path  of the user
+ *   properties   the changed property, or empty if not known
+ *
+ * A subscriber that falls too far behind is disconnected and has to
+ * catch up with GetChangesSince().  So is one whose bus name goes
+ * away.
+ */
+#define CHANGE_JOURNAL_RECORD_TYPE "(tuoas)"
+
+typedef struct ChangeJournal ChangeJournal;
+
+ChangeJournal * change_journal_new              (void);
+void            change_journal_free             (ChangeJournal  *journal);
+
+gint            change_journal_subscribe        (ChangeJournal   *journal,
+                                                 GDBusConnection *connection,
+                                                 const gchar     *owner,
+                                                 GError         **error);
+
+void            change_journal_append           (ChangeJournal  *journal,
+                                                 guint64         generation,
+                                                 ChangeLogType   type,
+                                                 const gchar    *object_path,
+                                                 const gchar    *property);
+
+G_END_DECLS
+
+#endif /* __CHANGE_JOURNAL_H__ */
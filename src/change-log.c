@@ -0,0 +1,202 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * Copyright (C) 2015 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include <glib.h>
+
+#include "change-log.h"
+
+/* A bounded record of what happened to the user objects, so that
+ * clients can catch up with GetChangesSince() instead of reloading
+ * every user.  Each entry carries the generation it was made at;
+ * entries are kept in generation order, oldest first.
+ *
+ * Consecutive changes of one object are folded into a single entry
+ * that moves to the newest generation, so a burst of property
+ * notifications only takes one slot.
+ */
+
+typedef struct {
+        guint64        generation;
+        ChangeLogType  type;
+        gchar         *object_path;
+        GPtrArray     *properties;  /* NULL if unknown */
+} ChangeLogEntry;
+
+struct ChangeLog {
+        GQueue  entries;
+        guint   max_entries;
+        guint64 generation;
+        guint64 complete_since;     /* oldest generation the log can answer for */
+};
+
+static void
+change_log_entry_free (ChangeLogEntry *entry)
+{
+        g_free (entry->object_path);
+        if (entry->properties != NULL)
+                g_ptr_array_unref (entry->properties);
+        g_free (entry);
+}
+
+/* Generations start at @generation rather than at zero, so that ones
+ * handed out by an earlier instance of the daemon are not mistaken
+ * for current ones.
+ */
+ChangeLog *
+change_log_new (guint   max_entries,
+                guint64 generation)
+{
+        ChangeLog *log;
+
+        log = g_new0 (ChangeLog, 1);
+        g_queue_init (&log->entries);
+        log->max_entries = MAX (max_entries, 1);
+        log->generation = generation;
+        log->complete_since = generation;
+
+        return log;
+}
+
+void
+change_log_free (ChangeLog *log)
+{
+        g_queue_free_full (&log->entries, (GDestroyNotify) change_log_entry_free);
+        g_free (log);
+}
+
+static void
+add_property (ChangeLogEntry *entry,
+              const gchar    *property)
+{
+        guint i;
+
+        if (entry->properties == NULL)
+                return;
+
+        /* Without a name, any property may have changed */
+        if (property == NULL) {
+                g_ptr_array_unref (entry->properties);
+                entry->properties = NULL;
+                return;
+        }
+
+        for (i = 0; i < entry->properties->len; i++) {
+                if (strcmp (g_ptr_array_index (entry->properties, i), property) == 0)
+                        return;
+        }
+
+        g_ptr_array_add (entry->properties, g_strdup (property));
+}
+
+/* @property is only used for CHANGE_LOG_USER_CHANGED; pass NULL if
+ * it is not known which properties changed.
+ */
+void
+change_log_add (ChangeLog     *log,
+                ChangeLogType  type,
+                const gchar   *object_path,
+                const gchar   *property)
+{
+        ChangeLogEntry *entry;
+
+        entry = g_queue_peek_tail (&log->entries);
+
+        if (type == CHANGE_LOG_USER_CHANGED &&
+            entry != NULL &&
+            entry->type != CHANGE_LOG_USER_REMOVED &&
+            strcmp (entry->object_path, object_path) == 0) {
+                /* A client that saw the addition has not seen this */
+                entry->generation = ++log->generation;
+                if (entry->type == CHANGE_LOG_USER_CHANGED)
+                        add_property (entry, property);
+                return;
+        }
+
+        entry = g_new0 (ChangeLogEntry, 1);
+        entry->generation = ++log->generation;
+        entry->type = type;
+        entry->object_path = g_strdup (object_path);
+        if (type == CHANGE_LOG_USER_CHANGED && property != NULL) {
+                entry->properties = g_ptr_array_new_with_free_func (g_free);
+                g_ptr_array_add (entry->properties, g_strdup (property));
+        }
+        g_queue_push_tail (&log->entries, entry);
+
+        while (g_queue_get_length (&log->entries) > log->max_entries) {
+                entry = g_queue_pop_head (&log->entries);
+                log->complete_since = entry->generation;
+                change_log_entry_free (entry);
+        }
+}
+
+guint64
+change_log_get_generation (ChangeLog *log)
+{
+        return log->generation;
+}
+
+/* Returns the changes made after @generation as an a(uoas) of type,
+ * object path and changed properties, where an empty list of
+ * properties means that all of them should be fetched again.
+ *
+ * Returns NULL if @generation is older than the log or was never
+ * handed out; the caller then has to start over from a full list.
+ */
+GVariant *
+change_log_get_since (ChangeLog *log,
+                      guint64    generation)
+{
+        GVariantBuilder builder;
+        ChangeLogEntry *entry;
+        GList *l;
+        guint i;
+
+        if (generation < log->complete_since || generation > log->generation)
+                return NULL;
+
+        /* Find the oldest entry the caller has not seen */
+        for (l = log->entries.tail; l != NULL; l = l->prev) {
+                entry = l->data;
+                if (entry->generation <= generation)
+                        break;
+        }
+        l = (l != NULL) ? l->next : log->entries.head;
+
+        g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(uoas)"));
+        for (; l != NULL; l = l->next) {
+                entry = l->data;
+
+                g_variant_builder_open (&builder, G_VARIANT_TYPE ("(uoas)"));
+                g_variant_builder_add (&builder, "u", entry->type);
+                g_variant_builder_add (&builder, "o", entry->object_path);
+                g_variant_builder_open (&builder, G_VARIANT_TYPE ("as"));
+                if (entry->properties != NULL) {
+                        for (i = 0; i < entry->properties->len; i++)
+                                g_variant_builder_add (&builder, "s", g_ptr_array_index (entry->properties, i));
+                }
+                g_variant_builder_close (&builder);
+                g_variant_builder_close (&builder);
+        }
+
+        return g_variant_builder_end (&builder);
+}
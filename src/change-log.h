@@ -0,0 +1,51 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * Copyright (C) 2015 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __CHANGE_LOG_H__
+#define __CHANGE_LOG_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct ChangeLog ChangeLog;
+
+/* Sent over the bus, do not reorder */
+typedef enum {
+        CHANGE_LOG_USER_ADDED,
+        CHANGE_LOG_USER_REMOVED,
+        CHANGE_LOG_USER_CHANGED
+} ChangeLogType;
+
+ChangeLog *     change_log_new                  (guint           max_entries,
+                                                 guint64         generation);
+void            change_log_free                 (ChangeLog      *log);
+
+void            change_log_add                  (ChangeLog      *log,
+                                                 ChangeLogType   type,
+                                                 const gchar    *object_path,
+                                                 const gchar    *property);
+
+guint64         change_log_get_generation       (ChangeLog      *log);
+GVariant *      change_log_get_since            (ChangeLog      *log,
+                                                 guint64         generation);
+
+G_END_DECLS
+
+#endif /* __CHANGE_LOG_H__ */
@@ -24,6 +24,7 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -32,16 +33,31 @@
 #include <unistd.h>
 #include <errno.h>
 #include <sys/types.h>
+#ifdef HAVE_MALLOC_TRIM
+#include <malloc.h>
+#endif
 
 #include <glib.h>
 #include <glib/gi18n.h>
 #include <glib-object.h>
 #include <glib/gstdio.h>
 #include <gio/gio.h>
+#include <gio/gunixfdlist.h>
 #include <polkit/polkit.h>
 
 #include "user-classify.h"
 #include "wtmp-helper.h"
+#include "user-db.h"
+#include "user-index.h"
+#include "change-log.h"
+#include "change-journal.h"
+#include "request-scheduler.h"
+#include "pwent-cache.h"
+#include "arena.h"
+#include "shared-snapshot.h"
+#include "memory-stats.h"
+#include "latency-stats.h"
+#include "accounts-debug-generated.h"
 #include "daemon.h"
 #include "util.h"
 
@@ -49,16 +65,85 @@
 #define PATH_SHADOW "/etc/shadow"
 #define PATH_GROUP "/etc/group"
 #define PATH_GDM_CUSTOM "/etc/gdm/custom.conf"
+#define PATH_SHELLS "/etc/shells"
+
+/* Enumeration of directory users runs on a worker thread, which hands
+ * the entries to the main loop ENUMERATE_BATCH at a time.  It is
+ * repeated every ENUMERATE_INTERVAL.
+ */
+#define ENUMERATE_BATCH 64
+#define ENUMERATE_INTERVAL (60 * 60)
+
+/* Changes older than the last CHANGE_LOG_SIZE ones can only be caught
+ * up with by a full reload on the client side.
+ */
+#define CHANGE_LOG_SIZE 1024
+
+/* The snapshot is written in host byte order; the leading byte says
+ * which one, like the endianness flag of a D-Bus message.
+ */
+#define SNAPSHOT_VERSION 3
+#define SNAPSHOT_TYPE "(yua{sx}aa{sv})"
+#define SNAPSHOT_LITTLE_ENDIAN 'l'
+#define SNAPSHOT_BIG_ENDIAN 'B'
+#define SNAPSHOT_HOST_ENDIAN (G_BYTE_ORDER == G_LITTLE_ENDIAN ? SNAPSHOT_LITTLE_ENDIAN : SNAPSHOT_BIG_ENDIAN)
 
 enum {
         PROP_0,
         PROP_DAEMON_VERSION
 };
 
+typedef enum {
+        LOAD_STAGE_NONE,
+        LOAD_STAGE_LOCAL,       /* users from /etc/passwd are published */
+        LOAD_STAGE_HISTORY,     /* login accounting from wtmp is merged */
+        LOAD_STAGE_COMPLETE     /* cached users and their data are merged */
+} LoadStage;
+
+/* ListCachedUsers calls are held back until this stage is reached */
+#define LOAD_STAGE_READY LOAD_STAGE_LOCAL
+
+/* The sources are read concurrently on worker threads; the stage of
+ * the same index merges each of them on the main thread, in order.
+ */
+typedef enum {
+        SOURCE_PASSWD,
+        SOURCE_WTMP,
+        SOURCE_CACHE,
+        N_SOURCES
+} Source;
+
+static const gchar * const source_names[N_SOURCES] = { "passwd", "wtmp", "cache" };
+
+#define SOURCE_ARENA_BLOCK_SIZE (64 * 1024)
+
+typedef struct {
+        Source      source;
+        UserDb     *user_db;     /* SOURCE_CACHE, if the store is in use */
+
+        /* Everything that is only needed until the source has been
+         * merged is allocated from here, and freed in one go.
+         */
+        Arena      *arena;
+
+        GPtrArray  *pwents;      /* struct passwd copies */
+        GPtrArray  *abandoned;   /* names whose lookup was given up on */
+        GHashTable *accounting;  /* SOURCE_WTMP: name -> WTmpHelperAccounting */
+        GHashTable *keyfiles;    /* SOURCE_CACHE: name -> GKeyFile */
+
+        gint64      elapsed;
+} SourceData;
+
 struct DaemonPrivate {
         GDBusConnection *bus_connection;
 
-        GHashTable *users;
+        GDBusServer *private_server;
+        GList *peer_connections;
+
+        RequestScheduler *request_scheduler;
+        PropertyCache *property_cache;
+
+        UserIndex *users;
 
         User *autologin;
 
@@ -67,16 +152,57 @@ struct DaemonPrivate {
         GFileMonitor *group_monitor;
         GFileMonitor *gdm_monitor;
         GFileMonitor *wtmp_monitor;
+        GFileMonitor *shells_monitor;
 
         guint reload_id;
         guint autologin_id;
+        guint compact_id;
+        guint shared_snapshot_id;
+
+        ChangeLog *change_log;
+        ChangeJournal *change_journal;
+
+        LoadStage load_stage;
+        UserIndex *loading_users;
+        gboolean reload_again;
+        gint64 load_start_time;
+        GVariant *load_stamps;
+        SourceData *sources[N_SOURCES];
+
+        gboolean ready;
+        GSList *pending_list_requests;
+        GVariant *list_reply;
+        guint64 list_reply_generation;
+        guint list_reply_classify_generation;
+
+        gboolean enumerate;
+        uid_t enumerate_uid_min;
+        uid_t enumerate_uid_max;
+        guint enumerate_max_users;
+        GCancellable *enumerate_cancellable;
+        guint enumerate_timer_id;
+        gint64 enumerate_start_time;
+        GPtrArray *enumerating;
+        GPtrArray *enumerated;
+
+        UserDb *user_db;
+
+#if GLIB_CHECK_VERSION (2, 64, 0)
+        GMemoryMonitor *memory_monitor;
+#endif
+        gint64 memory_warning_time;
+        gboolean history_trimmed;
+        gint64 history_restore_time;
+        guint history_restore_id;
+        MemoryUsage memory_peaks[N_MEMORY_CATEGORIES];
+
+        AccountsDebugStats *debug_stats;
 
         PolkitAuthority *authority;
         GHashTable *extension_ifaces;
+        GThread *extension_thread;
 };
 
-typedef struct passwd * (* EntryGeneratorFunc) (GHashTable *, gpointer *);
-
 static void daemon_accounts_accounts_iface_init (AccountsAccountsIface *iface);
 
 G_DEFINE_TYPE_WITH_CODE (Daemon, daemon, ACCOUNTS_TYPE_ACCOUNTS_SKELETON, G_IMPLEMENT_INTERFACE (ACCOUNTS_TYPE_ACCOUNTS, daemon_accounts_accounts_iface_init));
@@ -132,132 +258,222 @@ error_get_type (void)
 #include "fgetpwent.c"
 #endif
 
-static struct passwd *
-entry_generator_fgetpwent (GHashTable *users,
-                           gpointer   *state)
+static void
+read_passwd (SourceData *data)
 {
         struct passwd *pwent;
         FILE *fp;
 
-        /* First iteration */
-        if (*state == NULL) {
-                *state = fp = fopen (PATH_PASSWD, "r");
-                if (fp == NULL) {
-                        g_warning ("Unable to open %s: %s", PATH_PASSWD, g_strerror (errno));
-                        return NULL;
-                }
+        fp = fopen (PATH_PASSWD, "r");
+        if (fp == NULL) {
+                g_warning ("Unable to open %s: %s", PATH_PASSWD, g_strerror (errno));
+                return;
         }
 
-        /* Every iteration */
-        fp = *state;
-        pwent = fgetpwent (fp);
-        if (pwent != NULL) {
-                return pwent;
-        }
+        /* The entries come from the file, not from lookups that
+         * other sources share, so they can all live in the arena.
+         */
+        g_ptr_array_set_free_func (data->pwents, NULL);
+
+        /* Nothing else calls fgetpwent(), so its buffer is ours */
+        while ((pwent = fgetpwent (fp)) != NULL)
+                g_ptr_array_add (data->pwents, copy_pwent_to_arena (pwent, data->arena));
 
-        /* Last iteration */
         fclose (fp);
-        *state = NULL;
-        return NULL;
 }
 
-static struct passwd *
-entry_generator_cachedir (GHashTable *users,
-                          gpointer   *state)
+/* Looks up @names for the source.  Names that could not be looked up
+ * in time are kept, so that the users are not dropped for it.
+ */
+static void
+lookup_names (SourceData *data,
+              GPtrArray  *names)
 {
-        struct passwd *pwent;
+        GPtrArray *abandoned;
+        guint i;
+
+        abandoned = g_ptr_array_new ();
+        pwent_cache_lookup_names (names, data->pwents, abandoned);
+        for (i = 0; i < abandoned->len; i++)
+                g_ptr_array_add (data->abandoned,
+                                 arena_strdup (data->arena, g_ptr_array_index (abandoned, i)));
+        g_ptr_array_unref (abandoned);
+}
+
+static void
+read_wtmp (SourceData *data)
+{
+        GHashTableIter iter;
+        const gchar *name;
+        GPtrArray *names;
+
+        data->accounting = wtmp_helper_read_accounting (data->arena);
+
+        names = g_ptr_array_new ();
+        g_hash_table_iter_init (&iter, data->accounting);
+        while (g_hash_table_iter_next (&iter, (gpointer *)&name, NULL))
+                g_ptr_array_add (names, (gpointer) name);
+
+        lookup_names (data, names);
+        g_ptr_array_unref (names);
+}
+
+static void
+read_cachedir (SourceData *data)
+{
+        GPtrArray *names;
         const gchar *name;
         GError *error = NULL;
         gchar *filename;
-        gboolean regular;
-        GHashTableIter iter;
         GKeyFile *key_file;
-        User *user;
         GDir *dir;
 
-        /* First iteration */
-        if (*state == NULL) {
-                *state = g_dir_open (USERDIR, 0, &error);
-                if (error != NULL) {
-                        if (!g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
-                                g_warning ("couldn't list user cache directory: %s", USERDIR);
-                        g_error_free (error);
-                        return NULL;
-                }
+        dir = g_dir_open (USERDIR, 0, &error);
+        if (dir == NULL) {
+                if (!g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+                        g_warning ("couldn't list user cache directory: %s", USERDIR);
+                g_error_free (error);
+                return;
         }
 
-        /* Every iteration */
-
         /*
          * Use names of files of regular type to lookup information
-         * about each user. Loop until we find something valid.
+         * about each user.
          */
-        dir = *state;
-        while (TRUE) {
-                name = g_dir_read_name (dir);
-                if (name == NULL)
-                        break;
-
+        names = g_ptr_array_new ();
+        while ((name = g_dir_read_name (dir)) != NULL) {
                 /* Only load files in this directory */
-                filename = g_build_filename (USERDIR, name, NULL);
-                regular = g_file_test (filename, G_FILE_TEST_IS_REGULAR);
-                g_free (filename);
+                filename = arena_strconcat (data->arena, USERDIR "/", name, NULL);
+                if (!g_file_test (filename, G_FILE_TEST_IS_REGULAR))
+                        continue;
 
-                if (regular) {
-                        pwent = getpwnam (name);
-                        if (pwent == NULL)
-                                g_debug ("user '%s' in cache dir but not present on system", name);
-                        else
-                                return pwent;
-                }
+                /* The file name already holds a copy of the user name */
+                name = filename + strlen (USERDIR "/");
+                g_ptr_array_add (names, (gpointer) name);
+
+                key_file = g_key_file_new ();
+                if (g_key_file_load_from_file (key_file, filename, 0, NULL))
+                        g_hash_table_insert (data->keyfiles, (gpointer) name, key_file);
+                else
+                        g_key_file_unref (key_file);
         }
 
-        /* Last iteration */
         g_dir_close (dir);
 
-        /* Update all the users from the files in the cache dir */
-        g_hash_table_iter_init (&iter, users);
-        while (g_hash_table_iter_next (&iter, (gpointer *)&name, (gpointer *)&user)) {
-                filename = g_build_filename (USERDIR, name, NULL);
-                key_file = g_key_file_new ();
-                if (g_key_file_load_from_file (key_file, filename, 0, NULL))
-                        user_update_from_keyfile (user, key_file);
-                g_key_file_unref (key_file);
-                g_free (filename);
+        lookup_names (data, names);
+        if (data->pwents->len + data->abandoned->len < names->len)
+                g_debug ("%u users in cache dir but not present on system",
+                         names->len - data->pwents->len - data->abandoned->len);
+        g_ptr_array_unref (names);
+}
+
+static void
+read_user_db (SourceData *data)
+{
+        GKeyFile *key_file;
+        GPtrArray *lookups;
+        gchar **names;
+        guint i;
+
+        names = user_db_list_names (data->user_db);
+        lookups = g_ptr_array_new ();
+        for (i = 0; names[i] != NULL; i++) {
+                g_ptr_array_add (lookups, names[i]);
+
+                key_file = user_db_get_key_file (data->user_db, names[i]);
+                if (key_file != NULL)
+                        g_hash_table_insert (data->keyfiles, arena_strdup (data->arena, names[i]), key_file);
         }
 
-        *state = NULL;
-        return NULL;
+        lookup_names (data, lookups);
+        if (data->pwents->len + data->abandoned->len < lookups->len)
+                g_debug ("%u users in user database but not present on system",
+                         lookups->len - data->pwents->len - data->abandoned->len);
+        g_ptr_array_unref (lookups);
+        g_strfreev (names);
+}
+
+static void
+source_data_free (SourceData *data)
+{
+        g_ptr_array_unref (data->pwents);
+        g_ptr_array_unref (data->abandoned);
+        if (data->accounting != NULL)
+                g_hash_table_unref (data->accounting);
+        g_hash_table_unref (data->keyfiles);
+        arena_free (data->arena);
+        g_free (data);
+}
+
+static void
+read_source_thread (GTask        *task,
+                    gpointer      source_object,
+                    gpointer      task_data,
+                    GCancellable *cancellable)
+{
+        SourceData *data = task_data;
+        gint64 start_time;
+
+        start_time = g_get_monotonic_time ();
+
+        switch (data->source) {
+        case SOURCE_PASSWD:
+                read_passwd (data);
+                break;
+        case SOURCE_WTMP:
+                read_wtmp (data);
+                break;
+        case SOURCE_CACHE:
+                if (data->user_db != NULL)
+                        read_user_db (data);
+                else
+                        read_cachedir (data);
+                break;
+        default:
+                g_assert_not_reached ();
+        }
+
+        data->elapsed = g_get_monotonic_time () - start_time;
+
+        g_task_return_boolean (task, TRUE);
 }
 
 static void
-load_entries (Daemon             *daemon,
-              GHashTable         *users,
-              EntryGeneratorFunc  entry_generator)
+load_entries (Daemon     *daemon,
+              UserIndex  *users,
+              GPtrArray  *pwents,
+              GPtrArray  *added)
 {
-        gpointer generator_state = NULL;
         struct passwd *pwent;
         User *user = NULL;
+        gboolean human;
+        guint i;
 
-        g_assert (entry_generator != NULL);
-
-        for (;;) {
-                pwent = entry_generator (users, &generator_state);
-                if (pwent == NULL)
-                        break;
+        for (i = 0; i < pwents->len; i++) {
+                pwent = g_ptr_array_index (pwents, i);
 
-                /* Skip system users... */
-                if (!user_classify_is_human (pwent->pw_uid, pwent->pw_name, pwent->pw_shell, NULL)) {
-                        g_debug ("skipping user: %s", pwent->pw_name);
+                /* ignore duplicate entries */
+                if (user_index_lookup_name (users, pwent->pw_name)) {
                         continue;
                 }
 
-                /* ignore duplicate entries */
-                if (g_hash_table_lookup (users, pwent->pw_name)) {
+                user = user_index_lookup_name (daemon->priv->users, pwent->pw_name);
+
+                /* Skip system users, reusing the classification of
+                 * known users whose entry is unchanged...
+                 */
+                if (user != NULL &&
+                    user_get_uid (user) == pwent->pw_uid &&
+                    g_strcmp0 (user_get_shell (user), pwent->pw_shell) == 0)
+                        human = user_is_human (user);
+                else
+                        human = user_classify_is_human (pwent->pw_uid, pwent->pw_name, pwent->pw_shell, NULL);
+
+                if (!human) {
+                        g_debug ("skipping user: %s", pwent->pw_name);
                         continue;
                 }
 
-                user = g_hash_table_lookup (daemon->priv->users, pwent->pw_name);
                 if (user == NULL) {
                         user = user_new (daemon, pwent->pw_uid);
                 } else {
@@ -268,208 +484,806 @@ load_entries (Daemon             *daemon,
                 g_object_freeze_notify (G_OBJECT (user));
                 user_update_from_pwent (user, pwent);
 
-                g_hash_table_insert (users, g_strdup (user_get_user_name (user)), user);
+                user_index_add (users, user);
+                g_object_unref (user);
+                g_ptr_array_add (added, user);
                 g_debug ("loaded user: %s", user_get_user_name (user));
         }
-
-        /* Generator should have cleaned up */
-        g_assert (generator_state == NULL);
 }
 
-static GHashTable *
-create_users_hash_table (void)
+/* Records the modification times of everything the users are
+ * loaded from, so that a snapshot can tell whether it is still
+ * current.
+ */
+static GVariant *
+get_source_stamps (void)
 {
-        return g_hash_table_new_full (g_str_hash,
-                                      g_str_equal,
-                                      g_free,
-                                      g_object_unref);
+        const gchar *paths[] = {
+                PATH_PASSWD,
+                PATH_SHADOW,
+                PATH_GROUP,
+                USERDIR,
+                USERDB,
+                wtmp_helper_get_path_for_monitor ()
+        };
+        GVariantBuilder builder;
+        struct stat st;
+        gint64 mtime;
+        guint i;
+
+        g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{sx}"));
+        for (i = 0; i < G_N_ELEMENTS (paths); i++) {
+                if (paths[i] == NULL)
+                        continue;
+
+                if (stat (paths[i], &st) < 0)
+                        mtime = -1;
+                else
+                        mtime = (gint64) st.st_mtim.tv_sec * G_USEC_PER_SEC + st.st_mtim.tv_nsec / 1000;
+
+                g_variant_builder_add (&builder, "{sx}", paths[i], mtime);
+        }
+
+        return g_variant_ref_sink (g_variant_builder_end (&builder));
 }
 
 static void
-reload_users (Daemon *daemon)
+save_snapshot (Daemon   *daemon,
+               GVariant *stamps)
 {
-        GHashTable *users;
-        GHashTable *old_users;
-        GHashTable *local;
+        GVariantBuilder builder;
         GHashTableIter iter;
-        gpointer name;
+        GVariant *snapshot;
+        GError *error = NULL;
         User *user;
 
-        /* Track the users that we saw during our (re)load */
-        users = create_users_hash_table ();
+        g_variant_builder_init (&builder, G_VARIANT_TYPE ("aa{sv}"));
+        user_index_iter_init (daemon->priv->users, &iter);
+        while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&user))
+                g_variant_builder_add_value (&builder, user_to_snapshot (user));
 
-        /*
-         * NOTE: As we load data from all the sources, notifies are
-         * frozen in load_entries() and then thawed as we process
-         * them below.
-         */
+        snapshot = g_variant_new ("(yu@a{sx}@aa{sv})", SNAPSHOT_HOST_ENDIAN, SNAPSHOT_VERSION, stamps, g_variant_builder_end (&builder));
+        g_variant_ref_sink (snapshot);
 
-        /* Load the local users into our hash table */
-        load_entries (daemon, users, entry_generator_fgetpwent);
-        local = g_hash_table_new (g_str_hash, g_str_equal);
-        g_hash_table_iter_init (&iter, users);
-        while (g_hash_table_iter_next (&iter, &name, NULL))
-                g_hash_table_add (local, name);
+        if (!g_file_set_contents (USERSNAPSHOT,
+                                  g_variant_get_data (snapshot),
+                                  g_variant_get_size (snapshot),
+                                  &error)) {
+                g_warning ("Unable to save user snapshot: %s", error->message);
+                g_error_free (error);
+        }
+
+        g_variant_unref (snapshot);
+}
 
-        /* Now add/update users from other sources, possibly non-local */
-        load_entries (daemon, users, wtmp_helper_entry_generator);
-        load_entries (daemon, users, entry_generator_cachedir);
+static GVariant *
+map_snapshot (void)
+{
+        GMappedFile *mapped;
+        GBytes *bytes;
+        GVariant *snapshot;
+        GVariant *swapped;
+        GError *error = NULL;
+        guint32 version;
+        guchar byte_order;
 
-        /* Mark which users are local, which are not */
-        g_hash_table_iter_init (&iter, users);
-        while (g_hash_table_iter_next (&iter, &name, (gpointer *)&user))
-                user_update_local_account_property (user, g_hash_table_lookup (local, name) != NULL);
+        mapped = g_mapped_file_new (USERSNAPSHOT, FALSE, &error);
+        if (mapped == NULL) {
+                if (!g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+                        g_warning ("Unable to read user snapshot: %s", error->message);
+                g_error_free (error);
+                return NULL;
+        }
 
-        g_hash_table_destroy (local);
+        bytes = g_mapped_file_get_bytes (mapped);
+        g_mapped_file_unref (mapped);
 
-        /* Swap out the users */
-        old_users = daemon->priv->users;
-        daemon->priv->users = users;
+        snapshot = g_variant_new_from_bytes (G_VARIANT_TYPE (SNAPSHOT_TYPE), bytes, FALSE);
+        g_variant_ref_sink (snapshot);
+        g_bytes_unref (bytes);
 
-        /* Remove all the old users */
-        g_hash_table_iter_init (&iter, old_users);
-        while (g_hash_table_iter_next (&iter, &name, (gpointer *)&user)) {
-                if (!g_hash_table_lookup (users, name)) {
-                        user_unregister (user);
-                        accounts_accounts_emit_user_deleted (ACCOUNTS_ACCOUNTS (daemon),
-                                                             user_get_object_path (user));
+        g_variant_get_child (snapshot, 0, "y", &byte_order);
+        if (byte_order != SNAPSHOT_HOST_ENDIAN) {
+                if (byte_order != SNAPSHOT_LITTLE_ENDIAN && byte_order != SNAPSHOT_BIG_ENDIAN) {
+                        g_debug ("ignoring user snapshot with byte order 0x%02x", byte_order);
+                        g_variant_unref (snapshot);
+                        return NULL;
                 }
+
+                /* Written on a machine of the other byte order; /var
+                 * can be shared or copied between machines.
+                 */
+                swapped = g_variant_byteswap (snapshot);
+                g_variant_unref (snapshot);
+                snapshot = g_variant_ref_sink (swapped);
         }
 
-        /* Register all the new users */
-        g_hash_table_iter_init (&iter, users);
-        while (g_hash_table_iter_next (&iter, &name, (gpointer *)&user)) {
-                if (!g_hash_table_lookup (old_users, name)) {
-                        user_register (user);
-                        accounts_accounts_emit_user_added (ACCOUNTS_ACCOUNTS (daemon),
-                                                           user_get_object_path (user));
-                }
-                g_object_thaw_notify (G_OBJECT (user));
+        g_variant_get_child (snapshot, 1, "u", &version);
+        if (version != SNAPSHOT_VERSION) {
+                g_debug ("ignoring user snapshot with version %u", version);
+                g_variant_unref (snapshot);
+                return NULL;
         }
 
-        g_hash_table_destroy (old_users);
+        return snapshot;
 }
 
 static gboolean
-reload_users_timeout (Daemon *daemon)
+snapshot_is_current (GVariant *snapshot)
 {
-        reload_users (daemon);
-        daemon->priv->reload_id = 0;
+        GVariant *saved;
+        GVariant *stamps;
+        gboolean current;
 
-        return FALSE;
-}
+        saved = g_variant_get_child_value (snapshot, 2);
+        stamps = get_source_stamps ();
+        current = g_variant_equal (saved, stamps);
+        g_variant_unref (stamps);
+        g_variant_unref (saved);
 
-static gboolean load_autologin (Daemon    *daemon,
-                                gchar    **name,
-                                gboolean  *enabled,
-                                GError   **error);
+        return current;
+}
 
-static gboolean
-reload_autologin_timeout (Daemon *daemon)
+/* Populates the user table from the snapshot written by the last
+ * reload or before the last idle exit, so that requests can be
+ * answered before the real sources have been read.  Unless the
+ * sources are unchanged, the next reload then reconciles the two.
+ */
+static void
+load_snapshot (Daemon   *daemon,
+               GVariant *snapshot)
 {
-        gboolean enabled;
-        gchar *name = NULL;
-        GError *error = NULL;
-        User *user = NULL;
+        GVariant *users;
+        GVariant *data;
+        GVariantIter iter;
+        User *user;
 
-        daemon->priv->autologin_id = 0;
+        users = g_variant_get_child_value (snapshot, 3);
 
-        if (!load_autologin (daemon, &name, &enabled, &error)) {
-                g_debug ("failed to load gdms custom.conf: %s", error->message);
-                g_error_free (error);
-                g_free (name);
+        g_variant_iter_init (&iter, users);
+        while ((data = g_variant_iter_next_value (&iter)) != NULL) {
+                user = user_new_from_snapshot (daemon, data);
+                g_variant_unref (data);
 
-                return FALSE;
+                if (user == NULL)
+                        continue;
+
+                if (user_index_lookup_name (daemon->priv->users, user_get_user_name (user)) == NULL) {
+                        user_register (user);
+                        user_index_add (daemon->priv->users, user);
+                }
+                g_object_unref (user);
         }
 
-        if (enabled && name)
-                user = daemon_local_find_user_by_name (daemon, name);
+        g_debug ("loaded %u users from snapshot", user_index_size (daemon->priv->users));
 
-        if (daemon->priv->autologin != NULL && daemon->priv->autologin != user) {
-                g_object_set (daemon->priv->autologin, "automatic-login", FALSE, NULL);
-                g_signal_emit_by_name (daemon->priv->autologin, "changed", 0);
-                g_object_unref (daemon->priv->autologin);
-                daemon->priv->autologin = NULL;
+        g_variant_unref (users);
+}
+
+static void
+save_shared_snapshot (Daemon *daemon)
+{
+        GVariantBuilder builder;
+        GHashTableIter iter;
+        GVariant *snapshot;
+        GError *error = NULL;
+        const gchar *object_path;
+        User *user;
+
+        if (g_mkdir_with_parents (SHARED_SNAPSHOT_DIR, 0755) < 0) {
+                g_warning ("Failed to create directory %s: %s",
+                           SHARED_SNAPSHOT_DIR, g_strerror (errno));
+                return;
         }
 
-        if (enabled) {
-                g_debug ("automatic login is enabled for '%s'", name);
-                if (daemon->priv->autologin != user) {
-                        g_object_set (user, "automatic-login", TRUE, NULL);
-                        daemon->priv->autologin = g_object_ref (user);
-                        g_signal_emit_by_name (daemon->priv->autologin, "changed", 0);
-                }
+        g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{oa{sv}}"));
+        user_index_iter_init (daemon->priv->users, &iter);
+        while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&user)) {
+                object_path = user_get_object_path (user);
+                if (object_path == NULL)
+                        continue;
+
+                g_variant_builder_add (&builder, "{o@a{sv}}", object_path,
+                                       g_dbus_interface_skeleton_get_properties (G_DBUS_INTERFACE_SKELETON (user)));
         }
-        else {
-                g_debug ("automatic login is disabled");
+
+        /* Clients catch up from here with GetChangesSince() */
+        snapshot = g_variant_new ("(ut@a{oa{sv}})",
+                                  SHARED_SNAPSHOT_VERSION,
+                                  change_log_get_generation (daemon->priv->change_log),
+                                  g_variant_builder_end (&builder));
+        g_variant_ref_sink (snapshot);
+
+        /* Replaced atomically, so clients that still have the old
+         * file mapped keep seeing a consistent copy.
+         */
+        if (!g_file_set_contents (SHARED_SNAPSHOT_PATH,
+                                  g_variant_get_data (snapshot),
+                                  g_variant_get_size (snapshot),
+                                  &error)) {
+                g_warning ("Unable to save shared user snapshot: %s", error->message);
+                g_error_free (error);
         }
 
-        g_free (name);
+        g_variant_unref (snapshot);
+}
+
+static gboolean
+shared_snapshot_timeout (Daemon *daemon)
+{
+        daemon->priv->shared_snapshot_id = 0;
+
+        save_shared_snapshot (daemon);
 
         return FALSE;
 }
 
+void
+daemon_local_queue_shared_snapshot (Daemon *daemon)
+{
+        /* Changes tend to come in bursts, e.g. while loading */
+        if (daemon->priv->shared_snapshot_id == 0)
+                daemon->priv->shared_snapshot_id = g_timeout_add (250,
+                                                                  (GSourceFunc) shared_snapshot_timeout,
+                                                                  daemon);
+}
+
+/* Writes a queued shared snapshot right away */
 static void
-queue_reload_users_soon (Daemon *daemon)
+flush_shared_snapshot (Daemon *daemon)
 {
-        if (daemon->priv->reload_id > 0) {
+        if (daemon->priv->shared_snapshot_id == 0)
                 return;
-        }
 
-        /* we wait half a second or so in case /etc/passwd and
-         * /etc/shadow are changed at the same time, or repeatedly.
-         */
-        daemon->priv->reload_id = g_timeout_add (500, (GSourceFunc)reload_users_timeout, daemon);
+        g_source_remove (daemon->priv->shared_snapshot_id);
+        daemon->priv->shared_snapshot_id = 0;
+
+        save_shared_snapshot (daemon);
 }
 
-static void
-queue_reload_users (Daemon *daemon)
+/* Writes out everything needed to start up again quickly, before
+ * the daemon exits.
+ */
+void
+daemon_save_state (Daemon *daemon)
 {
-        if (daemon->priv->reload_id > 0) {
+        GVariant *stamps;
+
+        flush_shared_snapshot (daemon);
+
+        /* A pending or running reload means the users are out of date,
+         * and so does login history that was trimmed to save memory.
+         */
+        if (daemon->priv->load_start_time != 0 || daemon->priv->reload_id != 0 ||
+            daemon->priv->history_trimmed)
                 return;
-        }
 
-        daemon->priv->reload_id = g_idle_add ((GSourceFunc)reload_users_timeout, daemon);
+        stamps = get_source_stamps ();
+        save_snapshot (daemon, stamps);
+        g_variant_unref (stamps);
 }
 
 static void
-queue_reload_autologin (Daemon *daemon)
+record_change (Daemon        *daemon,
+               ChangeLogType  type,
+               User          *user,
+               const gchar   *property)
 {
-        if (daemon->priv->autologin_id > 0) {
-                return;
-        }
+        change_log_add (daemon->priv->change_log,
+                        type,
+                        user_get_object_path (user),
+                        property);
+        change_journal_append (daemon->priv->change_journal,
+                               change_log_get_generation (daemon->priv->change_log),
+                               type,
+                               user_get_object_path (user),
+                               property);
+}
 
-        daemon->priv->autologin_id = g_idle_add ((GSourceFunc)reload_autologin_timeout, daemon);
+/* Called by users for every change of their properties; @property is
+ * the D-Bus name of the property, or NULL if it is not known.
+ */
+void
+daemon_local_user_changed (Daemon      *daemon,
+                           User        *user,
+                           const gchar *property)
+{
+        record_change (daemon, CHANGE_LOG_USER_CHANGED, user, property);
+
+        daemon_local_queue_shared_snapshot (daemon);
+}
+
+/* Called by users whose name or uid changed, so that they can still
+ * be found under the new ones.
+ */
+void
+daemon_local_user_rekeyed (Daemon      *daemon,
+                           User        *user,
+                           const gchar *old_name,
+                           uid_t        old_uid)
+{
+        user_index_rekey (daemon->priv->users, user, old_name, old_uid);
+        if (daemon->priv->loading_users != NULL)
+                user_index_rekey (daemon->priv->loading_users, user, old_name, old_uid);
 }
 
 static void
-on_users_monitor_changed (GFileMonitor      *monitor,
-                          GFile             *file,
-                          GFile             *other_file,
-                          GFileMonitorEvent  event_type,
-                          Daemon            *daemon)
+emit_user_added (Daemon *daemon,
+                 User   *user)
 {
-        if (event_type != G_FILE_MONITOR_EVENT_CHANGED &&
-            event_type != G_FILE_MONITOR_EVENT_CREATED) {
-                return;
-        }
+        record_change (daemon, CHANGE_LOG_USER_ADDED, user, NULL);
 
-        queue_reload_users_soon (daemon);
+        accounts_accounts_emit_user_added (ACCOUNTS_ACCOUNTS (daemon),
+                                           user_get_object_path (user));
 }
 
 static void
-on_gdm_monitor_changed (GFileMonitor      *monitor,
-                        GFile             *file,
-                        GFile             *other_file,
-                        GFileMonitorEvent  event_type,
-                        Daemon            *daemon)
+emit_user_deleted (Daemon *daemon,
+                   User   *user)
 {
-        if (event_type != G_FILE_MONITOR_EVENT_CHANGED &&
-            event_type != G_FILE_MONITOR_EVENT_CREATED) {
-                return;
-        }
+        record_change (daemon, CHANGE_LOG_USER_REMOVED, user, NULL);
 
-        queue_reload_autologin (daemon);
+        accounts_accounts_emit_user_deleted (ACCOUNTS_ACCOUNTS (daemon),
+                                             user_get_object_path (user));
+}
+
+static gboolean finish_list_cached_users (gpointer user_data);
+
+static void
+set_ready (Daemon *daemon)
+{
+        GSList *requests;
+        GSList *l;
+
+        if (daemon->priv->ready)
+                return;
+
+        daemon->priv->ready = TRUE;
+
+        requests = g_slist_reverse (daemon->priv->pending_list_requests);
+        daemon->priv->pending_list_requests = NULL;
+
+        for (l = requests; l != NULL; l = l->next)
+                finish_list_cached_users (l->data);
+        g_slist_free (requests);
+}
+
+/* Makes the users loaded by one stage visible on the bus.  Users
+ * that are new to the daemon are announced right away, instead of
+ * after all sources have been read.
+ */
+static void
+publish_users (Daemon    *daemon,
+               GPtrArray *added,
+               gboolean   local)
+{
+        const gchar *name;
+        User *user;
+        guint i;
+
+        for (i = 0; i < added->len; i++) {
+                user = g_ptr_array_index (added, i);
+                name = user_get_user_name (user);
+
+                user_update_local_account_property (user, local);
+
+                if (user_index_lookup_name (daemon->priv->users, name) == NULL) {
+                        user_index_add (daemon->priv->users, user);
+                        user_register (user);
+                        emit_user_added (daemon, user);
+                }
+
+                /* Frozen in load_entries() */
+                g_object_thaw_notify (G_OBJECT (user));
+        }
+}
+
+static void update_memory_usage (Daemon      *daemon,
+                                 MemoryUsage *usage);
+
+static void
+finish_loading_users (Daemon *daemon)
+{
+        MemoryUsage usage[N_MEMORY_CATEGORIES];
+        GHashTableIter iter;
+        gpointer name;
+        User *user;
+
+        /* Both the old and the new users are around, which is when
+         * the daemon uses the most memory.
+         */
+        update_memory_usage (daemon, usage);
+
+        /* Users are only dropped once every source has been read */
+        user_index_iter_init (daemon->priv->users, &iter);
+        while (g_hash_table_iter_next (&iter, &name, (gpointer *)&user)) {
+                if (user_index_lookup_name (daemon->priv->loading_users, name) == NULL) {
+                        user_unregister (user);
+                        emit_user_deleted (daemon, user);
+                }
+        }
+
+        user_index_free (daemon->priv->users);
+        daemon->priv->users = daemon->priv->loading_users;
+        daemon->priv->loading_users = NULL;
+
+        save_snapshot (daemon, daemon->priv->load_stamps);
+}
+
+/* A lookup that timed out says nothing about whether the user still
+ * exists, so users known from before are kept as they are until a
+ * later reload can tell.
+ */
+static void
+keep_abandoned_users (Daemon    *daemon,
+                      GPtrArray *abandoned)
+{
+        const gchar *name;
+        User *user;
+        guint i;
+
+        for (i = 0; i < abandoned->len; i++) {
+                name = g_ptr_array_index (abandoned, i);
+                if (user_index_lookup_name (daemon->priv->loading_users, name) != NULL)
+                        continue;
+
+                user = user_index_lookup_name (daemon->priv->users, name);
+                if (user == NULL)
+                        continue;
+
+                g_debug ("keeping user %s, the lookup timed out", name);
+                user_index_add (daemon->priv->loading_users, user);
+        }
+}
+
+static void
+update_users_from_accounting (UserIndex  *users,
+                              GHashTable *accounting)
+{
+        GHashTableIter iter;
+        const gchar *name;
+        WTmpHelperAccounting *entry;
+        User *user;
+
+        g_hash_table_iter_init (&iter, accounting);
+        while (g_hash_table_iter_next (&iter, (gpointer *)&name, (gpointer *)&entry)) {
+                user = user_index_lookup_name (users, name);
+                if (user != NULL)
+                        wtmp_helper_update_user (user, entry);
+        }
+}
+
+static void
+update_users_from_keyfiles (UserIndex  *users,
+                            GHashTable *keyfiles)
+{
+        GHashTableIter iter;
+        const gchar *name;
+        GKeyFile *key_file;
+        User *user;
+
+        g_hash_table_iter_init (&iter, keyfiles);
+        while (g_hash_table_iter_next (&iter, (gpointer *)&name, (gpointer *)&key_file)) {
+                user = user_index_lookup_name (users, name);
+                if (user != NULL)
+                        user_update_from_keyfile (user, key_file);
+        }
+}
+
+/* Merges the source belonging to the next stage of a (re)load.
+ * Returns FALSE if that source has not been read yet.
+ */
+static gboolean
+load_users_stage (Daemon *daemon)
+{
+        SourceData *data;
+        GPtrArray *added;
+        gint64 start_time;
+        Source source;
+
+        switch (daemon->priv->load_stage) {
+        case LOAD_STAGE_NONE:
+        case LOAD_STAGE_COMPLETE:
+                source = SOURCE_PASSWD;
+                break;
+        case LOAD_STAGE_LOCAL:
+                source = SOURCE_WTMP;
+                break;
+        case LOAD_STAGE_HISTORY:
+        default:
+                source = SOURCE_CACHE;
+                break;
+        }
+
+        data = daemon->priv->sources[source];
+        if (data == NULL)
+                return FALSE;
+
+        start_time = g_get_monotonic_time ();
+        added = g_ptr_array_new ();
+
+        switch (source) {
+        case SOURCE_PASSWD:
+                daemon->priv->loading_users = user_index_new ();
+                load_entries (daemon, daemon->priv->loading_users, data->pwents, added);
+                publish_users (daemon, added, TRUE);
+                daemon->priv->load_stage = LOAD_STAGE_LOCAL;
+                break;
+
+        case SOURCE_WTMP:
+                load_entries (daemon, daemon->priv->loading_users, data->pwents, added);
+                keep_abandoned_users (daemon, data->abandoned);
+                update_users_from_accounting (daemon->priv->loading_users, data->accounting);
+                publish_users (daemon, added, FALSE);
+                daemon->priv->load_stage = LOAD_STAGE_HISTORY;
+                break;
+
+        case SOURCE_CACHE:
+        default:
+                load_entries (daemon, daemon->priv->loading_users, data->pwents, added);
+                if (daemon->priv->enumerated != NULL)
+                        load_entries (daemon, daemon->priv->loading_users, daemon->priv->enumerated, added);
+                keep_abandoned_users (daemon, data->abandoned);
+                update_users_from_keyfiles (daemon->priv->loading_users, data->keyfiles);
+                publish_users (daemon, added, FALSE);
+                finish_loading_users (daemon);
+                daemon->priv->load_stage = LOAD_STAGE_COMPLETE;
+                break;
+        }
+
+        g_debug ("merging %s took %" G_GINT64_FORMAT " ms (%u new users)",
+                 source_names[source],
+                 (g_get_monotonic_time () - start_time) / 1000,
+                 added->len);
+        g_ptr_array_unref (added);
+
+        if (daemon->priv->load_stage >= LOAD_STAGE_READY)
+                set_ready (daemon);
+
+        return TRUE;
+}
+
+static void queue_reload_users_soon (Daemon *daemon);
+static void start_enumerating_users (Daemon *daemon);
+
+static void
+advance_loading (Daemon *daemon)
+{
+        guint i;
+
+        /* Stages run in order, each as soon as its source has been read */
+        do {
+                if (!load_users_stage (daemon))
+                        return;
+        } while (daemon->priv->load_stage != LOAD_STAGE_COMPLETE);
+
+        g_debug ("loading users took %" G_GINT64_FORMAT " ms",
+                 (g_get_monotonic_time () - daemon->priv->load_start_time) / 1000);
+        daemon->priv->load_start_time = 0;
+        g_clear_pointer (&daemon->priv->load_stamps, g_variant_unref);
+
+        for (i = 0; i < N_SOURCES; i++)
+                g_clear_pointer (&daemon->priv->sources[i], source_data_free);
+
+        if (daemon->priv->reload_again) {
+                daemon->priv->reload_again = FALSE;
+                queue_reload_users_soon (daemon);
+        }
+        else if (daemon->priv->enumerate && daemon->priv->enumerated == NULL) {
+                start_enumerating_users (daemon);
+        }
+}
+
+static void
+on_source_read (GObject      *object,
+                GAsyncResult *result,
+                gpointer      user_data)
+{
+        Daemon *daemon = DAEMON (object);
+        SourceData *data;
+
+        data = g_task_get_task_data (G_TASK (result));
+        g_debug ("reading %s took %" G_GINT64_FORMAT " ms (%u entries)",
+                 source_names[data->source], data->elapsed / 1000, data->pwents->len);
+
+        daemon->priv->sources[data->source] = data;
+
+        advance_loading (daemon);
+}
+
+static void
+read_source (Daemon *daemon,
+             Source  source)
+{
+        SourceData *data;
+        GTask *task;
+
+        data = g_new0 (SourceData, 1);
+        data->source = source;
+        data->arena = arena_new (SOURCE_ARENA_BLOCK_SIZE);
+        data->pwents = g_ptr_array_new_with_free_func (g_free);
+        data->abandoned = g_ptr_array_new ();
+        data->keyfiles = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, (GDestroyNotify) g_key_file_unref);
+        if (source == SOURCE_CACHE)
+                data->user_db = daemon->priv->user_db;
+
+        /* The data is handed over to the daemon in on_source_read() */
+        task = g_task_new (daemon, NULL, on_source_read, NULL);
+        g_task_set_task_data (task, data, NULL);
+        g_task_run_in_thread (task, read_source_thread);
+        g_object_unref (task);
+}
+
+static void
+start_loading_users (Daemon *daemon)
+{
+        Source source;
+
+        daemon->priv->load_start_time = g_get_monotonic_time ();
+
+        /* Taken before reading, so that changes made while the
+         * sources are read invalidate the snapshot.
+         */
+        g_clear_pointer (&daemon->priv->load_stamps, g_variant_unref);
+        daemon->priv->load_stamps = get_source_stamps ();
+
+        for (source = 0; source < N_SOURCES; source++)
+                read_source (daemon, source);
+}
+
+static gboolean
+reload_users_timeout (Daemon *daemon)
+{
+        daemon->priv->reload_id = 0;
+
+        start_loading_users (daemon);
+
+        return FALSE;
+}
+
+static gboolean load_autologin (Daemon    *daemon,
+                                gchar    **name,
+                                gboolean  *enabled,
+                                GError   **error);
+
+static gboolean
+reload_autologin_timeout (Daemon *daemon)
+{
+        gboolean enabled;
+        gchar *name = NULL;
+        GError *error = NULL;
+        User *user = NULL;
+
+        daemon->priv->autologin_id = 0;
+
+        if (!load_autologin (daemon, &name, &enabled, &error)) {
+                g_debug ("failed to load gdms custom.conf: %s", error->message);
+                g_error_free (error);
+                g_free (name);
+
+                return FALSE;
+        }
+
+        if (enabled && name)
+                user = daemon_local_find_user_by_name (daemon, name);
+
+        if (daemon->priv->autologin != NULL && daemon->priv->autologin != user) {
+                g_object_set (daemon->priv->autologin, "automatic-login", FALSE, NULL);
+                g_signal_emit_by_name (daemon->priv->autologin, "changed", 0);
+                g_object_unref (daemon->priv->autologin);
+                daemon->priv->autologin = NULL;
+        }
+
+        if (enabled) {
+                g_debug ("automatic login is enabled for '%s'", name);
+                if (daemon->priv->autologin != user) {
+                        g_object_set (user, "automatic-login", TRUE, NULL);
+                        daemon->priv->autologin = g_object_ref (user);
+                        g_signal_emit_by_name (daemon->priv->autologin, "changed", 0);
+                }
+        }
+        else {
+                g_debug ("automatic login is disabled");
+        }
+
+        g_free (name);
+
+        return FALSE;
+}
+
+static void
+queue_reload_users_soon (Daemon *daemon)
+{
+        /* sources that were already read may have missed the change */
+        if (daemon->priv->load_start_time != 0) {
+                daemon->priv->reload_again = TRUE;
+                return;
+        }
+
+        if (daemon->priv->reload_id > 0) {
+                return;
+        }
+
+        /* we wait half a second or so in case /etc/passwd and
+         * /etc/shadow are changed at the same time, or repeatedly.
+         */
+        daemon->priv->reload_id = g_timeout_add (500, (GSourceFunc)reload_users_timeout, daemon);
+}
+
+static void
+queue_reload_users (Daemon *daemon)
+{
+        if (daemon->priv->load_start_time != 0) {
+                daemon->priv->reload_again = TRUE;
+                return;
+        }
+
+        if (daemon->priv->reload_id > 0) {
+                return;
+        }
+
+        daemon->priv->reload_id = g_idle_add ((GSourceFunc)reload_users_timeout, daemon);
+}
+
+static void
+queue_reload_autologin (Daemon *daemon)
+{
+        if (daemon->priv->autologin_id > 0) {
+                return;
+        }
+
+        daemon->priv->autologin_id = g_idle_add ((GSourceFunc)reload_autologin_timeout, daemon);
+}
+
+static void
+on_users_monitor_changed (GFileMonitor      *monitor,
+                          GFile             *file,
+                          GFile             *other_file,
+                          GFileMonitorEvent  event_type,
+                          Daemon            *daemon)
+{
+        if (event_type != G_FILE_MONITOR_EVENT_CHANGED &&
+            event_type != G_FILE_MONITOR_EVENT_CREATED) {
+                return;
+        }
+
+        /* wtmp only changes login accounting */
+        if (monitor != daemon->priv->wtmp_monitor)
+                pwent_cache_invalidate ();
+
+        queue_reload_users_soon (daemon);
+}
+
+static void
+on_shells_monitor_changed (GFileMonitor      *monitor,
+                           GFile             *file,
+                           GFile             *other_file,
+                           GFileMonitorEvent  event_type,
+                           Daemon            *daemon)
+{
+        if (event_type != G_FILE_MONITOR_EVENT_CHANGED &&
+            event_type != G_FILE_MONITOR_EVENT_CREATED) {
+                return;
+        }
+
+        /* Which users count as human depends on the valid shells */
+        user_classify_invalidate ();
+        queue_reload_users_soon (daemon);
+}
+
+static void
+on_gdm_monitor_changed (GFileMonitor      *monitor,
+                        GFile             *file,
+                        GFile             *other_file,
+                        GFileMonitorEvent  event_type,
+                        Daemon            *daemon)
+{
+        if (event_type != G_FILE_MONITOR_EVENT_CHANGED &&
+            event_type != G_FILE_MONITOR_EVENT_CREATED) {
+                return;
+        }
+
+        queue_reload_autologin (daemon);
 }
 
 typedef void FileChangeCallback (GFileMonitor      *monitor,
@@ -478,46 +1292,214 @@ typedef void FileChangeCallback (GFileMonitor      *monitor,
                                  GFileMonitorEvent  event_type,
                                  Daemon            *daemon);
 
-static GFileMonitor *
-setup_monitor (Daemon             *daemon,
-               const gchar        *path,
-               FileChangeCallback *callback)
-{
-        GError *error = NULL;
-        GFile *file;
-        GFileMonitor *monitor;
+static GFileMonitor *
+setup_monitor (Daemon             *daemon,
+               const gchar        *path,
+               FileChangeCallback *callback)
+{
+        GError *error = NULL;
+        GFile *file;
+        GFileMonitor *monitor;
+
+        if (!path) {
+                return NULL;
+        }
+
+        file = g_file_new_for_path (path);
+        monitor = g_file_monitor_file (file,
+                                       G_FILE_MONITOR_NONE,
+                                       NULL,
+                                       &error);
+        if (monitor != NULL) {
+                g_signal_connect (monitor,
+                                  "changed",
+                                  G_CALLBACK (callback),
+                                  daemon);
+        } else {
+                g_warning ("Unable to monitor %s: %s", path, error->message);
+                g_error_free (error);
+        }
+        g_object_unref (file);
+
+        return monitor;
+}
+
+static gboolean
+compact_user_db_timeout (Daemon *daemon)
+{
+        GError *error = NULL;
+
+        if (!user_db_maybe_compact (daemon->priv->user_db, &error)) {
+                g_warning ("Failed to compact user database: %s", error->message);
+                g_error_free (error);
+        }
+
+        return TRUE;
+}
+
+static void
+open_user_db (Daemon *daemon)
+{
+        GError *error = NULL;
+
+        /* The single-file store is used instead of USERDIR only
+         * once accounts-user-db-migrate has created it.
+         */
+        if (!g_file_test (USERDB, G_FILE_TEST_EXISTS))
+                return;
+
+        daemon->priv->user_db = user_db_open (USERDB, USER_DB_FLAGS_NONE, &error);
+        if (daemon->priv->user_db == NULL) {
+                g_warning ("Unable to open user database, falling back to %s: %s",
+                           USERDIR, error->message);
+                g_error_free (error);
+                return;
+        }
+
+        daemon->priv->compact_id = g_timeout_add_seconds (60 * 60,
+                                                          (GSourceFunc) compact_user_db_timeout,
+                                                          daemon);
+}
+
+static gpointer
+read_extension_ifaces_thread (gpointer data)
+{
+        GHashTable *ifaces;
+        gint64 start_time;
+
+        start_time = g_get_monotonic_time ();
+        ifaces = daemon_read_extension_ifaces ();
+        g_debug ("reading extension interfaces took %" G_GINT64_FORMAT " ms",
+                 (g_get_monotonic_time () - start_time) / 1000);
+
+        return ifaces;
+}
+
+#if GLIB_CHECK_VERSION (2, 64, 0)
+/* Gives back what can be rebuilt when it is next needed, more of it
+ * the more pressing the warning: the property snapshots and passwd
+ * lookups first, then the indexes of the extension values, and when
+ * memory is critical all but the latest logins.
+ */
+static void
+on_low_memory_warning (GMemoryMonitor             *monitor,
+                       GMemoryMonitorWarningLevel  level,
+                       Daemon                     *daemon)
+{
+        GHashTableIter iter;
+        User *user;
+        gboolean trim_history;
+
+        g_debug ("memory is low (level %d), dropping caches", level);
+
+        daemon->priv->memory_warning_time = g_get_monotonic_time ();
+
+        property_cache_clear (daemon->priv->property_cache);
+        pwent_cache_invalidate ();
+
+        if (level >= G_MEMORY_MONITOR_WARNING_LEVEL_MEDIUM) {
+                trim_history = level >= G_MEMORY_MONITOR_WARNING_LEVEL_CRITICAL;
 
-        if (!path) {
-                return NULL;
+                user_index_iter_init (daemon->priv->users, &iter);
+                while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&user)) {
+                        if (user_release_memory (user, trim_history))
+                                daemon->priv->history_trimmed = TRUE;
+                }
         }
 
-        file = g_file_new_for_path (path);
-        monitor = g_file_monitor_file (file,
-                                       G_FILE_MONITOR_NONE,
-                                       NULL,
-                                       &error);
-        if (monitor != NULL) {
-                g_signal_connect (monitor,
-                                  "changed",
-                                  G_CALLBACK (callback),
-                                  daemon);
-        } else {
-                g_warning ("Unable to monitor %s: %s", path, error->message);
-                g_error_free (error);
+#ifdef HAVE_MALLOC_TRIM
+        malloc_trim (0);
+#endif
+}
+#endif
+
+static void
+on_login_history_read (const gchar *object_path,
+                       gpointer     user_data)
+{
+        Daemon *daemon = user_data;
+
+        daemon_local_restore_login_history (daemon);
+}
+
+static void
+build_property_cache (const gchar *object_path,
+                      gpointer     user_data)
+{
+        Daemon *daemon = user_data;
+        GVariantBuilder builder;
+        User *user;
+
+        if (strcmp (object_path, "/org/freedesktop/Accounts") == 0) {
+                g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{sa{sv}}"));
+                g_variant_builder_add (&builder, "{s@a{sv}}",
+                                       "org.freedesktop.Accounts",
+                                       g_dbus_interface_skeleton_get_properties (G_DBUS_INTERFACE_SKELETON (daemon)));
+                property_cache_set (daemon->priv->property_cache, object_path,
+                                    g_variant_builder_end (&builder));
+                return;
         }
-        g_object_unref (file);
 
-        return monitor;
+        user = user_index_lookup_object_path (daemon->priv->users, object_path);
+        if (user != NULL)
+                user_build_property_cache (user);
 }
 
 static void
 daemon_init (Daemon *daemon)
 {
+        GVariant *snapshot;
+
         daemon->priv = DAEMON_GET_PRIVATE (daemon);
 
-        daemon->priv->extension_ifaces = daemon_read_extension_ifaces ();
+        /* Based on the clock, so generations keep increasing across
+         * restarts of the daemon.
+         */
+        daemon->priv->change_log = change_log_new (CHANGE_LOG_SIZE, g_get_real_time ());
+        daemon->priv->change_journal = change_journal_new ();
+
+        daemon->priv->request_scheduler = request_scheduler_new ();
+        request_scheduler_attach (daemon->priv->request_scheduler,
+                                  G_DBUS_INTERFACE_SKELETON (daemon));
+
+        daemon->priv->property_cache = property_cache_new (daemon->priv->request_scheduler);
+        property_cache_set_build_func (daemon->priv->property_cache,
+                                       build_property_cache, daemon);
+        property_cache_set_read_func (daemon->priv->property_cache,
+                                      on_login_history_read, daemon);
+
+#if GLIB_CHECK_VERSION (2, 64, 0)
+        daemon->priv->memory_monitor = g_memory_monitor_dup_default ();
+        g_signal_connect (daemon->priv->memory_monitor, "low-memory-warning",
+                          G_CALLBACK (on_low_memory_warning), daemon);
+#endif
+
+        open_user_db (daemon);
 
-        daemon->priv->users = create_users_hash_table ();
+        /* Read the extension interfaces and the user sources in the
+         * background; they are only needed once users get exported.
+         */
+        daemon->priv->extension_thread = g_thread_new ("extensions",
+                                                       read_extension_ifaces_thread,
+                                                       NULL);
+
+        daemon->priv->users = user_index_new ();
+
+        /* After an idle exit, nothing has usually changed and the
+         * snapshot can be used as is.
+         */
+        snapshot = map_snapshot ();
+        if (snapshot != NULL && snapshot_is_current (snapshot)) {
+                g_debug ("user snapshot is current, not reloading users");
+                daemon->priv->load_stage = LOAD_STAGE_COMPLETE;
+
+                /* Loading would have started it once done */
+                if (daemon->priv->enumerate)
+                        start_enumerating_users (daemon);
+        }
+        else {
+                start_loading_users (daemon);
+        }
 
         daemon->priv->passwd_monitor = setup_monitor (daemon,
                                                       PATH_PASSWD,
@@ -536,7 +1518,19 @@ daemon_init (Daemon *daemon)
         daemon->priv->gdm_monitor = setup_monitor (daemon,
                                                    PATH_GDM_CUSTOM,
                                                    on_gdm_monitor_changed);
-        reload_users_timeout (daemon);
+
+        daemon->priv->shells_monitor = setup_monitor (daemon,
+                                                      PATH_SHELLS,
+                                                      on_shells_monitor_changed);
+
+        /* The users are merged in stages as their sources come in, so
+         * the bus name can be taken before any of them are read.
+         */
+        if (snapshot != NULL) {
+                load_snapshot (daemon, snapshot);
+                g_variant_unref (snapshot);
+                set_ready (daemon);
+        }
         queue_reload_autologin (daemon);
 }
 
@@ -552,52 +1546,543 @@ daemon_finalize (GObject *object)
         if (daemon->priv->bus_connection != NULL)
                 g_object_unref (daemon->priv->bus_connection);
 
-        g_hash_table_destroy (daemon->priv->users);
+        if (daemon->priv->private_server != NULL) {
+                g_dbus_server_stop (daemon->priv->private_server);
+                g_object_unref (daemon->priv->private_server);
+        }
+        g_list_free_full (daemon->priv->peer_connections, g_object_unref);
+
+        user_index_free (daemon->priv->users);
+
+        if (daemon->priv->loading_users != NULL)
+                user_index_free (daemon->priv->loading_users);
+
+        g_hash_table_unref (daemon_get_extension_ifaces (daemon));
+
+        if (daemon->priv->compact_id > 0)
+                g_source_remove (daemon->priv->compact_id);
+
+        if (daemon->priv->shared_snapshot_id > 0)
+                g_source_remove (daemon->priv->shared_snapshot_id);
+
+        if (daemon->priv->history_restore_id > 0)
+                g_source_remove (daemon->priv->history_restore_id);
+
+#if GLIB_CHECK_VERSION (2, 64, 0)
+        g_signal_handlers_disconnect_by_data (daemon->priv->memory_monitor, daemon);
+        g_object_unref (daemon->priv->memory_monitor);
+#endif
+
+        change_log_free (daemon->priv->change_log);
+        change_journal_free (daemon->priv->change_journal);
+        request_scheduler_free (daemon->priv->request_scheduler);
+        property_cache_free (daemon->priv->property_cache);
+
+        if (daemon->priv->load_stamps != NULL)
+                g_variant_unref (daemon->priv->load_stamps);
+
+        if (daemon->priv->enumerate_cancellable != NULL) {
+                g_cancellable_cancel (daemon->priv->enumerate_cancellable);
+                g_object_unref (daemon->priv->enumerate_cancellable);
+                g_ptr_array_unref (daemon->priv->enumerating);
+        }
+
+        if (daemon->priv->enumerate_timer_id > 0)
+                g_source_remove (daemon->priv->enumerate_timer_id);
+
+        if (daemon->priv->enumerated != NULL)
+                g_ptr_array_unref (daemon->priv->enumerated);
+
+        if (daemon->priv->list_reply != NULL)
+                g_variant_unref (daemon->priv->list_reply);
+
+        if (daemon->priv->user_db != NULL)
+                user_db_free (daemon->priv->user_db);
+
+        if (daemon->priv->debug_stats != NULL) {
+                g_dbus_interface_skeleton_unexport (G_DBUS_INTERFACE_SKELETON (daemon->priv->debug_stats));
+                g_object_unref (daemon->priv->debug_stats);
+        }
+
+        G_OBJECT_CLASS (daemon_parent_class)->finalize (object);
+}
+
+static gboolean debug_stats_get_latencies (AccountsDebugStats    *stats,
+                                           GDBusMethodInvocation *context,
+                                           Daemon                *daemon);
+static gboolean debug_stats_reset         (AccountsDebugStats    *stats,
+                                           GDBusMethodInvocation *context,
+                                           Daemon                *daemon);
+
+/* User objects are only exported on a connection once something
+ * there calls them.  Until then, the subtree below the daemon's
+ * object answers for them, and exports the user on the first call.
+ */
+static gchar **
+user_subtree_enumerate (GDBusConnection *connection,
+                        const gchar     *sender,
+                        const gchar     *object_path,
+                        gpointer         user_data)
+{
+        /* Listing every user here would defeat the purpose;
+         * ListCachedUsers and FindUserBy* return their paths.
+         */
+        return g_new0 (gchar *, 1);
+}
+
+static User *
+lookup_subtree_user (Daemon      *daemon,
+                     const gchar *object_path,
+                     const gchar *node)
+{
+        gchar *path;
+        User *user;
+
+        if (node == NULL)
+                return NULL;
+
+        path = g_strconcat (object_path, "/", node, NULL);
+        user = user_index_lookup_object_path (daemon->priv->users, path);
+        g_free (path);
+
+        return user;
+}
+
+static GDBusInterfaceInfo **
+user_subtree_introspect (GDBusConnection *connection,
+                         const gchar     *sender,
+                         const gchar     *object_path,
+                         const gchar     *node,
+                         gpointer         user_data)
+{
+        Daemon *daemon = user_data;
+        User *user;
+
+        user = lookup_subtree_user (daemon, object_path, node);
+        if (user == NULL)
+                return NULL;
+
+        return user_get_interface_infos (user, connection);
+}
+
+static const GDBusInterfaceVTable *
+user_subtree_dispatch (GDBusConnection *connection,
+                       const gchar     *sender,
+                       const gchar     *object_path,
+                       const gchar     *interface_name,
+                       const gchar     *node,
+                       gpointer        *out_user_data,
+                       gpointer         user_data)
+{
+        Daemon *daemon = user_data;
+        User *user;
+
+        user = lookup_subtree_user (daemon, object_path, node);
+        if (user == NULL)
+                return NULL;
+
+        /* Later calls go to the exported object, which takes
+         * precedence over the subtree.
+         */
+        user_export (user, connection);
+
+        return user_get_interface_vtable (user, connection, interface_name, out_user_data);
+}
+
+static const GDBusSubtreeVTable user_subtree_vtable = {
+        user_subtree_enumerate,
+        user_subtree_introspect,
+        user_subtree_dispatch
+};
+
+static gboolean
+register_user_subtree (Daemon           *daemon,
+                       GDBusConnection  *connection,
+                       GError          **error)
+{
+        return g_dbus_connection_register_subtree (connection,
+                                                   "/org/freedesktop/Accounts",
+                                                   &user_subtree_vtable,
+                                                   G_DBUS_SUBTREE_FLAGS_DISPATCH_TO_UNENUMERATED_NODES,
+                                                   daemon,
+                                                   NULL,
+                                                   error) != 0;
+}
+
+static gboolean
+register_accounts_daemon (Daemon *daemon)
+{
+        GError *error = NULL;
+
+        daemon->priv->authority = polkit_authority_get_sync (NULL, &error);
+
+        if (daemon->priv->authority == NULL) {
+                if (error != NULL) {
+                        g_critical ("error getting polkit authority: %s", error->message);
+                        g_error_free (error);
+                }
+                goto error;
+        }
+
+        daemon->priv->bus_connection = g_bus_get_sync (G_BUS_TYPE_SYSTEM, NULL, &error);
+        if (daemon->priv->bus_connection == NULL) {
+                if (error != NULL) {
+                        g_critical ("error getting system bus: %s", error->message);
+                        g_error_free (error);
+                }
+                goto error;
+        }
+
+        latency_stats_attach (daemon->priv->bus_connection);
+        property_cache_attach (daemon->priv->property_cache, daemon->priv->bus_connection);
+
+        if (!g_dbus_interface_skeleton_export (G_DBUS_INTERFACE_SKELETON (daemon),
+                                               daemon->priv->bus_connection,
+                                               "/org/freedesktop/Accounts",
+                                               &error)) {
+                if (error != NULL) {
+                        g_critical ("error exporting interface: %s", error->message);
+                        g_error_free (error);
+                }
+                goto error;     
+        }
+
+        if (!register_user_subtree (daemon, daemon->priv->bus_connection, &error)) {
+                g_critical ("error registering user objects: %s", error->message);
+                g_error_free (error);
+                goto error;
+        }
+
+        /* The daemon's properties never change */
+        property_cache_add_interface (daemon->priv->property_cache, "org.freedesktop.Accounts");
+        property_cache_add (daemon->priv->property_cache,
+                            daemon->priv->bus_connection,
+                            "/org/freedesktop/Accounts");
+
+        /* Timing the calls is cheap enough to always do */
+        daemon->priv->debug_stats = accounts_debug_stats_skeleton_new ();
+        g_signal_connect (daemon->priv->debug_stats, "handle-get-latencies",
+                          G_CALLBACK (debug_stats_get_latencies), daemon);
+        g_signal_connect (daemon->priv->debug_stats, "handle-reset",
+                          G_CALLBACK (debug_stats_reset), daemon);
+        if (!g_dbus_interface_skeleton_export (G_DBUS_INTERFACE_SKELETON (daemon->priv->debug_stats),
+                                               daemon->priv->bus_connection,
+                                               "/org/freedesktop/Accounts",
+                                               &error)) {
+                g_warning ("error exporting debug interface: %s", error->message);
+                g_clear_error (&error);
+        }
+
+        return TRUE;
+
+ error:
+        return FALSE;
+}
+
+/* Only root may use the private socket.  Everything else about the
+ * calls made on it, including authorization, works as on the bus.
+ */
+static gboolean
+on_authorize_peer (GDBusAuthObserver *observer,
+                   GIOStream         *stream,
+                   GCredentials      *credentials,
+                   gpointer           user_data)
+{
+        if (credentials == NULL)
+                return FALSE;
+
+        return g_credentials_get_unix_user (credentials, NULL) == 0;
+}
+
+static void
+on_peer_closed (GDBusConnection *connection,
+                gboolean         remote_peer_vanished,
+                GError          *error,
+                Daemon          *daemon)
+{
+        GHashTableIter iter;
+        User *user;
+
+        g_debug ("peer connection closed");
+
+        g_dbus_interface_skeleton_unexport_from_connection (G_DBUS_INTERFACE_SKELETON (daemon),
+                                                            connection);
+
+        user_index_iter_init (daemon->priv->users, &iter);
+        while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&user))
+                user_unexport (user, connection);
+
+        property_cache_detach (daemon->priv->property_cache, connection);
+
+        g_signal_handlers_disconnect_by_func (connection, on_peer_closed, daemon);
+        daemon->priv->peer_connections = g_list_remove (daemon->priv->peer_connections, connection);
+        g_object_unref (connection);
+}
+
+static gboolean
+on_new_peer_connection (GDBusServer     *server,
+                        GDBusConnection *connection,
+                        Daemon          *daemon)
+{
+        GError *error = NULL;
+
+        if (!g_dbus_interface_skeleton_export (G_DBUS_INTERFACE_SKELETON (daemon),
+                                               connection,
+                                               "/org/freedesktop/Accounts",
+                                               &error)) {
+                g_warning ("error exporting interface on peer connection: %s", error->message);
+                g_error_free (error);
+                return FALSE;
+        }
+
+        if (!register_user_subtree (daemon, connection, &error)) {
+                g_warning ("error registering user objects on peer connection: %s", error->message);
+                g_error_free (error);
+                g_dbus_interface_skeleton_unexport_from_connection (G_DBUS_INTERFACE_SKELETON (daemon),
+                                                                    connection);
+                return FALSE;
+        }
+
+        latency_stats_attach (connection);
+        property_cache_attach (daemon->priv->property_cache, connection);
+        property_cache_add (daemon->priv->property_cache,
+                            connection,
+                            "/org/freedesktop/Accounts");
+
+        g_signal_connect (connection, "closed", G_CALLBACK (on_peer_closed), daemon);
+        daemon->priv->peer_connections = g_list_prepend (daemon->priv->peer_connections,
+                                                         g_object_ref (connection));
+
+        return TRUE;
+}
+
+/* Serves the same objects as on the system bus on a unix socket at
+ * @path, for local clients that make many calls and do not want
+ * every one of them to go through the bus daemon.
+ */
+gboolean
+daemon_listen_private (Daemon       *daemon,
+                       const gchar  *path,
+                       GError      **error)
+{
+        GDBusAuthObserver *observer;
+        gchar *escaped;
+        gchar *address;
+        gchar *guid;
+
+        g_return_val_if_fail (daemon->priv->private_server == NULL, FALSE);
+
+        /* Left behind by an earlier instance */
+        g_unlink (path);
+
+        escaped = g_dbus_address_escape_value (path);
+        address = g_strdup_printf ("unix:path=%s", escaped);
+        guid = g_dbus_generate_guid ();
+
+        observer = g_dbus_auth_observer_new ();
+        g_signal_connect (observer, "authorize-authenticated-peer",
+                          G_CALLBACK (on_authorize_peer), NULL);
+
+        daemon->priv->private_server = g_dbus_server_new_sync (address,
+                                                               G_DBUS_SERVER_FLAGS_NONE,
+                                                               guid,
+                                                               observer,
+                                                               NULL,
+                                                               error);
+
+        g_object_unref (observer);
+        g_free (guid);
+        g_free (address);
+        g_free (escaped);
+
+        if (daemon->priv->private_server == NULL)
+                return FALSE;
+
+        if (g_chmod (path, 0600) < 0)
+                g_warning ("Failed to change permissions of %s: %s", path, g_strerror (errno));
+
+        g_signal_connect (daemon->priv->private_server, "new-connection",
+                          G_CALLBACK (on_new_peer_connection), daemon);
+        g_dbus_server_start (daemon->priv->private_server);
+
+        g_debug ("listening on %s", path);
+
+        return TRUE;
+}
+
+GList *
+daemon_local_get_peer_connections (Daemon *daemon)
+{
+        return daemon->priv->peer_connections;
+}
+
+RequestScheduler *
+daemon_local_get_request_scheduler (Daemon *daemon)
+{
+        return daemon->priv->request_scheduler;
+}
+
+PropertyCache *
+daemon_local_get_property_cache (Daemon *daemon)
+{
+        return daemon->priv->property_cache;
+}
+
+static const gchar * const memory_category_names[N_MEMORY_CATEGORIES] = {
+        "user objects",
+        "strings",
+        "keyfiles",
+        "login history",
+        "exported skeletons",
+        "extension registrations",
+        "property snapshots",
+        "hash tables"
+};
+
+static const gchar * const request_priority_names[N_REQUEST_PRIORITIES] = {
+        "interactive",
+        "normal",
+        "background"
+};
+
+/* Roughly what a hash table spends on each entry */
+#define HASH_ENTRY_SIZE (2 * sizeof (gpointer) + sizeof (guint))
+
+/* Fills in @usage, indexed by MemoryCategory, and raises the high
+ * water marks to it.
+ */
+static void
+update_memory_usage (Daemon      *daemon,
+                     MemoryUsage *usage)
+{
+        GHashTableIter iter;
+        guint n_snapshots;
+        guint64 n_entries;
+        gpointer name;
+        User *user;
+        guint i;
+
+        memset (usage, 0, N_MEMORY_CATEGORIES * sizeof (MemoryUsage));
+
+        user_index_iter_init (daemon->priv->users, &iter);
+        while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&user))
+                user_add_memory_usage (user, usage);
+
+        /* While loading, users that were kept are in both indexes */
+        if (daemon->priv->loading_users != NULL) {
+                user_index_iter_init (daemon->priv->loading_users, &iter);
+                while (g_hash_table_iter_next (&iter, &name, (gpointer *)&user)) {
+                        if (user_index_lookup_name (daemon->priv->users, name) != user)
+                                user_add_memory_usage (user, usage);
+                }
+        }
+
+        property_cache_get_stats (daemon->priv->property_cache,
+                                  &n_snapshots,
+                                  &usage[MEMORY_PROPERTY_SNAPSHOTS].size);
+        usage[MEMORY_PROPERTY_SNAPSHOTS].count = n_snapshots;
+
+        /* The user indexes are by name, uid and object path */
+        n_entries = 3 * user_index_size (daemon->priv->users);
+        if (daemon->priv->loading_users != NULL)
+                n_entries += 3 * user_index_size (daemon->priv->loading_users);
+        n_entries += pwent_cache_get_size ();
+        usage[MEMORY_HASH_TABLES].count = n_entries;
+        usage[MEMORY_HASH_TABLES].size = n_entries * HASH_ENTRY_SIZE;
+
+        for (i = 0; i < N_MEMORY_CATEGORIES; i++) {
+                daemon->priv->memory_peaks[i].count = MAX (daemon->priv->memory_peaks[i].count, usage[i].count);
+                daemon->priv->memory_peaks[i].size = MAX (daemon->priv->memory_peaks[i].size, usage[i].size);
+        }
+}
 
-        g_hash_table_unref (daemon->priv->extension_ifaces);
+/* Logs what the daemon is holding on to, for sizing it for large
+ * sites; main() calls this on SIGUSR1.
+ */
+void
+daemon_dump_stats (Daemon *daemon)
+{
+        MemoryUsage usage[N_MEMORY_CATEGORIES];
+        RequestStats stats;
+        guint64 hits;
+        guint64 misses;
+        guint i;
+
+        update_memory_usage (daemon, usage);
+
+        g_message ("memory use: count, bytes (high water marks)");
+        for (i = 0; i < N_MEMORY_CATEGORIES; i++) {
+                g_message ("  %-24s %8" G_GUINT64_FORMAT " %10" G_GUINT64_FORMAT
+                           " (%" G_GUINT64_FORMAT ", %" G_GUINT64_FORMAT ")",
+                           memory_category_names[i],
+                           usage[i].count,
+                           usage[i].size,
+                           daemon->priv->memory_peaks[i].count,
+                           daemon->priv->memory_peaks[i].size);
+        }
 
-        G_OBJECT_CLASS (daemon_parent_class)->finalize (object);
+        pwent_cache_get_stats (&hits, &misses);
+        g_message ("passwd cache: %" G_GUINT64_FORMAT " hits, %" G_GUINT64_FORMAT " misses",
+                   hits, misses);
+
+        for (i = 0; i < N_REQUEST_PRIORITIES; i++) {
+                request_scheduler_get_stats (daemon->priv->request_scheduler, i, &stats);
+                g_message ("%s requests: %" G_GUINT64_FORMAT " dispatched, %" G_GUINT64_FORMAT
+                           " throttled, %" G_GUINT64_FORMAT " rejected",
+                           request_priority_names[i],
+                           stats.dispatched,
+                           stats.throttled,
+                           stats.rejected);
+        }
 }
 
+/* Login history is only read back from wtmp once memory has not been
+ * low for a while, and not more often than every so often, since it
+ * can be trimmed again right away.
+ */
+#define HISTORY_RESTORE_QUIET_TIME (60 * G_USEC_PER_SEC)
+#define HISTORY_RESTORE_INTERVAL (10 * 60 * G_USEC_PER_SEC)
+
 static gboolean
-register_accounts_daemon (Daemon *daemon)
+restore_login_history_cb (gpointer data)
 {
-        GError *error = NULL;
+        Daemon *daemon = data;
 
-        daemon->priv->authority = polkit_authority_get_sync (NULL, &error);
+        daemon->priv->history_restore_id = 0;
+        daemon_local_restore_login_history (daemon);
 
-        if (daemon->priv->authority == NULL) {
-                if (error != NULL) {
-                        g_critical ("error getting polkit authority: %s", error->message);
-                        g_error_free (error);
-                }
-                goto error;
-        }
+        return FALSE;
+}
 
-        daemon->priv->bus_connection = g_bus_get_sync (G_BUS_TYPE_SYSTEM, NULL, &error);
-        if (daemon->priv->bus_connection == NULL) {
-                if (error != NULL) {
-                        g_critical ("error getting system bus: %s", error->message);
-                        g_error_free (error);
-                }
-                goto error;
-        }
+/* Called when a client reads a login history that was trimmed;
+ * reading wtmp again brings back the history of all users.
+ */
+void
+daemon_local_restore_login_history (Daemon *daemon)
+{
+        gint64 now;
+        gint64 wait;
 
-        if (!g_dbus_interface_skeleton_export (G_DBUS_INTERFACE_SKELETON (daemon),
-                                               daemon->priv->bus_connection,
-                                               "/org/freedesktop/Accounts",
-                                               &error)) {
-                if (error != NULL) {
-                        g_critical ("error exporting interface: %s", error->message);
-                        g_error_free (error);
-                }
-                goto error;     
-        }
+        if (!daemon->priv->history_trimmed || daemon->priv->history_restore_id != 0)
+                return;
 
-        return TRUE;
+        now = g_get_monotonic_time ();
+        wait = 0;
+        if (daemon->priv->memory_warning_time != 0)
+                wait = MAX (wait, daemon->priv->memory_warning_time + HISTORY_RESTORE_QUIET_TIME - now);
+        if (daemon->priv->history_restore_time != 0)
+                wait = MAX (wait, daemon->priv->history_restore_time + HISTORY_RESTORE_INTERVAL - now);
+
+        if (wait > 0) {
+                daemon->priv->history_restore_id = g_timeout_add_seconds (wait / G_USEC_PER_SEC + 1,
+                                                                          restore_login_history_cb,
+                                                                          daemon);
+                return;
+        }
 
- error:
-        return FALSE;
+        daemon->priv->history_trimmed = FALSE;
+        daemon->priv->history_restore_time = now;
+        queue_reload_users_soon (daemon);
 }
 
 Daemon *
@@ -646,15 +2131,239 @@ add_new_user_for_pwent (Daemon        *daemon,
         user_update_from_pwent (user, pwent);
         user_register (user);
 
-        g_hash_table_insert (daemon->priv->users,
-                             g_strdup (user_get_user_name (user)),
-                             user);
+        user_index_add (daemon->priv->users, user);
+
+        /* Don't let a load that is in progress drop the user again */
+        if (daemon->priv->loading_users != NULL)
+                user_index_add (daemon->priv->loading_users, user);
 
-        accounts_accounts_emit_user_added (ACCOUNTS_ACCOUNTS (daemon), user_get_object_path (user));
+        emit_user_added (daemon, user);
+
+        /* Owned by the index */
+        g_object_unref (user);
 
         return user;
 }
 
+static gboolean
+enumerate_users_timeout (Daemon *daemon)
+{
+        daemon->priv->enumerate_timer_id = 0;
+
+        start_enumerating_users (daemon);
+
+        return FALSE;
+}
+
+static void
+finish_enumerating_users (Daemon *daemon)
+{
+        /* Stops the thread if it is still running */
+        g_cancellable_cancel (daemon->priv->enumerate_cancellable);
+        g_clear_object (&daemon->priv->enumerate_cancellable);
+
+        g_debug ("enumerating users took %" G_GINT64_FORMAT " ms (%u users)",
+                 (g_get_monotonic_time () - daemon->priv->enumerate_start_time) / 1000,
+                 daemon->priv->enumerating->len);
+
+        /* Keeps the users around across reloads, see load_users_stage() */
+        g_clear_pointer (&daemon->priv->enumerated, g_ptr_array_unref);
+        daemon->priv->enumerated = daemon->priv->enumerating;
+        daemon->priv->enumerating = NULL;
+
+        daemon->priv->enumerate_timer_id = g_timeout_add_seconds (ENUMERATE_INTERVAL,
+                                                                  (GSourceFunc) enumerate_users_timeout,
+                                                                  daemon);
+}
+
+typedef struct {
+        uid_t         uid_min;
+        uid_t         uid_max;
+        GMainContext *context;
+} EnumerateData;
+
+typedef struct {
+        Daemon       *daemon;
+        GCancellable *cancellable;
+        GPtrArray    *pwents;
+        gboolean      done;
+} EnumerateBatch;
+
+static void
+enumerate_data_free (EnumerateData *data)
+{
+        g_main_context_unref (data->context);
+        g_free (data);
+}
+
+static EnumerateBatch *
+enumerate_batch_new (Daemon       *daemon,
+                     GCancellable *cancellable)
+{
+        EnumerateBatch *batch;
+
+        batch = g_new0 (EnumerateBatch, 1);
+        batch->daemon = g_object_ref (daemon);
+        batch->cancellable = g_object_ref (cancellable);
+        batch->pwents = g_ptr_array_new_with_free_func (g_free);
+
+        return batch;
+}
+
+static void
+enumerate_batch_free (EnumerateBatch *batch)
+{
+        g_ptr_array_unref (batch->pwents);
+        g_object_unref (batch->cancellable);
+        g_object_unref (batch->daemon);
+        g_free (batch);
+}
+
+/* Runs on the main thread, since classifying users and adding them
+ * touches state that is not shared with other threads.
+ */
+static gboolean
+enumerate_users_batch (EnumerateBatch *batch)
+{
+        Daemon *daemon = batch->daemon;
+        struct passwd *pwent;
+        guint i;
+
+        /* Left over from an enumeration that was stopped */
+        if (batch->cancellable != daemon->priv->enumerate_cancellable)
+                return FALSE;
+
+        for (i = 0; i < batch->pwents->len; i++) {
+                pwent = g_ptr_array_index (batch->pwents, i);
+
+                if (!user_classify_is_human (pwent->pw_uid, pwent->pw_name, pwent->pw_shell, NULL))
+                        continue;
+
+                if (user_index_lookup_name (daemon->priv->users, pwent->pw_name) == NULL)
+                        add_new_user_for_pwent (daemon, pwent);
+
+                /* Moves the entry over */
+                g_ptr_array_add (daemon->priv->enumerating, pwent);
+                batch->pwents->pdata[i] = NULL;
+
+                if (daemon->priv->enumerating->len >= daemon->priv->enumerate_max_users) {
+                        g_debug ("stopped enumerating users after %u", daemon->priv->enumerate_max_users);
+                        finish_enumerating_users (daemon);
+                        return FALSE;
+                }
+        }
+
+        if (batch->done)
+                finish_enumerating_users (daemon);
+
+        return FALSE;
+}
+
+static void
+enumerate_users_send_batch (EnumerateData  *data,
+                            EnumerateBatch *batch)
+{
+        g_main_context_invoke_full (data->context,
+                                    G_PRIORITY_LOW,
+                                    (GSourceFunc) enumerate_users_batch,
+                                    batch,
+                                    (GDestroyNotify) enumerate_batch_free);
+}
+
+/* getpwent() keeps its position in global state */
+static GMutex enumerate_lock;
+
+static void
+enumerate_users_thread (GTask        *task,
+                        gpointer      source_object,
+                        gpointer      task_data,
+                        GCancellable *cancellable)
+{
+        Daemon *daemon = source_object;
+        EnumerateData *data = task_data;
+        EnumerateBatch *batch = NULL;
+        struct passwd *pwent;
+
+        g_mutex_lock (&enumerate_lock);
+        setpwent ();
+
+        while (!g_cancellable_is_cancelled (cancellable)) {
+                pwent = getpwent ();
+                if (pwent == NULL)
+                        break;
+
+                if (pwent->pw_uid < data->uid_min ||
+                    pwent->pw_uid > data->uid_max)
+                        continue;
+
+                if (batch == NULL)
+                        batch = enumerate_batch_new (daemon, cancellable);
+                g_ptr_array_add (batch->pwents, copy_pwent (pwent));
+
+                if (batch->pwents->len >= ENUMERATE_BATCH) {
+                        enumerate_users_send_batch (data, batch);
+                        batch = NULL;
+                }
+        }
+
+        endpwent ();
+        g_mutex_unlock (&enumerate_lock);
+
+        /* Batches arrive in order, so the last one ends the enumeration */
+        if (batch == NULL)
+                batch = enumerate_batch_new (daemon, cancellable);
+        batch->done = TRUE;
+        enumerate_users_send_batch (data, batch);
+
+        g_task_return_boolean (task, TRUE);
+}
+
+/* Adds the users that NSS can enumerate, e.g. from sssd or LDAP.  A
+ * large or slow directory would block the main loop in getpwent(), so
+ * that runs on a worker thread.
+ */
+static void
+start_enumerating_users (Daemon *daemon)
+{
+        EnumerateData *data;
+        GTask *task;
+
+        if (daemon->priv->enumerate_cancellable != NULL)
+                return;
+
+        daemon->priv->enumerate_start_time = g_get_monotonic_time ();
+        daemon->priv->enumerating = g_ptr_array_new_with_free_func (g_free);
+        daemon->priv->enumerate_cancellable = g_cancellable_new ();
+
+        data = g_new0 (EnumerateData, 1);
+        data->uid_min = daemon->priv->enumerate_uid_min;
+        data->uid_max = daemon->priv->enumerate_uid_max;
+        data->context = g_main_context_ref_thread_default ();
+
+        task = g_task_new (daemon, daemon->priv->enumerate_cancellable, NULL, NULL);
+        g_task_set_task_data (task, data, (GDestroyNotify) enumerate_data_free);
+        g_task_run_in_thread (task, enumerate_users_thread);
+        g_object_unref (task);
+}
+
+void
+daemon_enable_enumeration (Daemon *daemon,
+                           uid_t   uid_min,
+                           uid_t   uid_max,
+                           guint   max_users)
+{
+        daemon->priv->enumerate = TRUE;
+        daemon->priv->enumerate_uid_min = uid_min;
+        daemon->priv->enumerate_uid_max = uid_max;
+        daemon->priv->enumerate_max_users = max_users;
+
+        /* Otherwise this happens once the users are loaded; with a
+         * current snapshot, they already are.
+         */
+        if (daemon->priv->load_start_time == 0)
+                start_enumerating_users (daemon);
+}
+
 User *
 daemon_local_find_user_by_id (Daemon *daemon,
                               uid_t   uid)
@@ -662,17 +2371,26 @@ daemon_local_find_user_by_id (Daemon *daemon,
         User *user;
         struct passwd *pwent;
 
-        pwent = getpwuid (uid);
+        /* Known users are found without going through NSS; the
+         * passwd monitors take care of them going away.
+         */
+        user = user_index_lookup_uid (daemon->priv->users, uid);
+        if (user != NULL)
+                return user;
+
+        pwent = pwent_cache_lookup_uid (uid);
         if (pwent == NULL) {
                 g_debug ("unable to lookup uid %d", (int)uid);
                 return NULL;
         }
 
-        user = g_hash_table_lookup (daemon->priv->users, pwent->pw_name);
+        user = user_index_lookup_name (daemon->priv->users, pwent->pw_name);
 
         if (user == NULL)
                 user = add_new_user_for_pwent (daemon, pwent);
 
+        g_free (pwent);
+
         return user;
 }
 
@@ -683,17 +2401,23 @@ daemon_local_find_user_by_name (Daemon      *daemon,
         User *user;
         struct passwd *pwent;
 
-        pwent = getpwnam (name);
+        user = user_index_lookup_name (daemon->priv->users, name);
+        if (user != NULL)
+                return user;
+
+        pwent = pwent_cache_lookup_name (name);
         if (pwent == NULL) {
-                g_debug ("unable to lookup name %s: %s", name, g_strerror (errno));
+                g_debug ("unable to lookup name %s", name);
                 return NULL;
         }
 
-        user = g_hash_table_lookup (daemon->priv->users, pwent->pw_name);
+        user = user_index_lookup_name (daemon->priv->users, pwent->pw_name);
 
         if (user == NULL)
                 user = add_new_user_for_pwent (daemon, pwent);
 
+        g_free (pwent);
+
         return user;
 }
 
@@ -710,8 +2434,11 @@ daemon_find_user_by_id (AccountsAccounts      *accounts,
 {
         Daemon *daemon = (Daemon*)accounts;
         User *user;
+        gint64 start_time;
 
+        start_time = g_get_monotonic_time ();
         user = daemon_local_find_user_by_id (daemon, uid);
+        latency_stats_add (context, LATENCY_PHASE_IO, g_get_monotonic_time () - start_time);
 
         if (user) {
                 accounts_accounts_complete_find_user_by_id (NULL, context, user_get_object_path (user));
@@ -730,8 +2457,11 @@ daemon_find_user_by_name (AccountsAccounts      *accounts,
 {
         Daemon *daemon = (Daemon*)accounts;
         User *user;
+        gint64 start_time;
 
+        start_time = g_get_monotonic_time ();
         user = daemon_local_find_user_by_name (daemon, name);
+        latency_stats_add (context, LATENCY_PHASE_IO, g_get_monotonic_time () - start_time);
 
         if (user) {
                 accounts_accounts_complete_find_user_by_name (NULL, context, user_get_object_path (user));
@@ -770,37 +2500,56 @@ list_user_data_free (ListUserData *data)
         g_free (data);
 }
 
-static gboolean
-finish_list_cached_users (gpointer user_data)
+/* The reply to ListCachedUsers only changes with the set of users
+ * or their classification, so it is built once for all callers.
+ */
+static GVariant *
+get_list_cached_users_reply (Daemon *daemon)
 {
-        ListUserData *data = user_data;
-        GPtrArray *object_paths;
+        GVariantBuilder builder;
         GHashTableIter iter;
         const gchar *name;
+        guint64 generation;
+        guint classify_generation;
         User *user;
-        uid_t uid;
-        const gchar *shell;
 
-        object_paths = g_ptr_array_new ();
+        generation = user_index_get_generation (daemon->priv->users);
+        classify_generation = user_classify_get_generation ();
 
-        g_hash_table_iter_init (&iter, data->daemon->priv->users);
-        while (g_hash_table_iter_next (&iter, (gpointer *)&name, (gpointer *)&user)) {
-                uid = user_get_uid (user);
-                shell = user_get_shell (user);
+        if (daemon->priv->list_reply != NULL &&
+            daemon->priv->list_reply_generation == generation &&
+            daemon->priv->list_reply_classify_generation == classify_generation)
+                return daemon->priv->list_reply;
+
+        g_variant_builder_init (&builder, G_VARIANT_TYPE ("ao"));
 
-                if (!user_classify_is_human (uid, name, shell, NULL)) {
-                        g_debug ("user %s %ld excluded", name, (long) uid);
+        user_index_iter_init (daemon->priv->users, &iter);
+        while (g_hash_table_iter_next (&iter, (gpointer *)&name, (gpointer *)&user)) {
+                if (!user_is_human (user)) {
+                        g_debug ("user %s %ld excluded", name, (long) user_get_uid (user));
                         continue;
                 }
 
-                g_debug ("user %s %ld not excluded", name, (long) uid);
-                g_ptr_array_add (object_paths, (gpointer) user_get_object_path (user));
+                g_debug ("user %s %ld not excluded", name, (long) user_get_uid (user));
+                g_variant_builder_add (&builder, "o", user_get_object_path (user));
         }
-        g_ptr_array_add (object_paths, NULL);
 
-        accounts_accounts_complete_list_cached_users (NULL, data->context, (const gchar * const *) object_paths->pdata);
+        if (daemon->priv->list_reply != NULL)
+                g_variant_unref (daemon->priv->list_reply);
+        daemon->priv->list_reply = g_variant_ref_sink (g_variant_new ("(ao)", &builder));
+        daemon->priv->list_reply_generation = generation;
+        daemon->priv->list_reply_classify_generation = classify_generation;
+
+        return daemon->priv->list_reply;
+}
+
+static gboolean
+finish_list_cached_users (gpointer user_data)
+{
+        ListUserData *data = user_data;
 
-        g_ptr_array_free (object_paths, TRUE);
+        g_dbus_method_invocation_return_value (data->context,
+                                               get_list_cached_users_reply (data->daemon));
 
         list_user_data_free (data);
 
@@ -816,9 +2565,9 @@ daemon_list_cached_users (AccountsAccounts      *accounts,
 
         data = list_user_data_new (daemon, context);
 
-        if (daemon->priv->reload_id > 0) {
-                /* reload in progress, wait a bit */
-                g_idle_add (finish_list_cached_users, data);
+        if (!daemon->priv->ready) {
+                /* initial load in progress, answer once the local users are known */
+                daemon->priv->pending_list_requests = g_slist_prepend (daemon->priv->pending_list_requests, data);
         }
         else {
                 finish_list_cached_users (data);
@@ -827,6 +2576,122 @@ daemon_list_cached_users (AccountsAccounts      *accounts,
         return TRUE;
 }
 
+static gboolean
+daemon_get_changes_since (AccountsAccounts      *accounts,
+                          GDBusMethodInvocation *context,
+                          guint64                generation)
+{
+        Daemon *daemon = (Daemon*)accounts;
+        GVariant *changes;
+        gboolean resync;
+
+        changes = change_log_get_since (daemon->priv->change_log, generation);
+        resync = (changes == NULL);
+        if (resync)
+                changes = g_variant_new_array (G_VARIANT_TYPE ("(uoas)"), NULL, 0);
+
+        accounts_accounts_complete_get_changes_since (accounts, context,
+                                                      change_log_get_generation (daemon->priv->change_log),
+                                                      resync,
+                                                      changes);
+
+        return TRUE;
+}
+
+static void
+daemon_open_change_journal_authorized_cb (Daemon                *daemon,
+                                          User                  *dummy,
+                                          GDBusMethodInvocation *context,
+                                          gpointer               data)
+{
+        GUnixFDList *out_fd_list;
+        GError *error = NULL;
+        gint index;
+        gint fd;
+
+        fd = change_journal_subscribe (daemon->priv->change_journal,
+                                       g_dbus_method_invocation_get_connection (context),
+                                       g_dbus_method_invocation_get_sender (context),
+                                       &error);
+        if (fd < 0) {
+                throw_error (context, ERROR_FAILED, "%s", error->message);
+                g_error_free (error);
+                return;
+        }
+
+        out_fd_list = g_unix_fd_list_new ();
+        index = g_unix_fd_list_append (out_fd_list, fd, &error);
+        close (fd);
+
+        if (index < 0) {
+                throw_error (context, ERROR_FAILED, "%s", error->message);
+                g_error_free (error);
+        }
+        else {
+                accounts_accounts_complete_open_change_journal (ACCOUNTS_ACCOUNTS (daemon), context, out_fd_list,
+                                                                index,
+                                                                change_log_get_generation (daemon->priv->change_log));
+        }
+
+        g_object_unref (out_fd_list);
+}
+
+static gboolean
+daemon_open_change_journal (AccountsAccounts      *accounts,
+                            GDBusMethodInvocation *context,
+                            GUnixFDList           *fd_list)
+{
+        Daemon *daemon = (Daemon*)accounts;
+
+        /* Each subscriber holds a socket and buffers in the daemon */
+        daemon_local_check_auth (daemon,
+                                 NULL,
+                                 "org.freedesktop.accounts.watch-changes",
+                                 FALSE,
+                                 daemon_open_change_journal_authorized_cb,
+                                 context,
+                                 NULL,
+                                 NULL);
+
+        return TRUE;
+}
+
+static gboolean
+debug_stats_get_latencies (AccountsDebugStats    *stats,
+                           GDBusMethodInvocation *context,
+                           Daemon                *daemon)
+{
+        gint uid;
+
+        /* The timings tell what other users are doing */
+        if (!get_caller_uid (context, &uid) || uid != 0) {
+                throw_error (context, ERROR_PERMISSION_DENIED, "Only root may read the statistics");
+                return TRUE;
+        }
+
+        accounts_debug_stats_complete_get_latencies (stats, context, latency_stats_get ());
+
+        return TRUE;
+}
+
+static gboolean
+debug_stats_reset (AccountsDebugStats    *stats,
+                   GDBusMethodInvocation *context,
+                   Daemon                *daemon)
+{
+        gint uid;
+
+        if (!get_caller_uid (context, &uid) || uid != 0) {
+                throw_error (context, ERROR_PERMISSION_DENIED, "Only root may reset the statistics");
+                return TRUE;
+        }
+
+        latency_stats_reset ();
+        accounts_debug_stats_complete_reset (stats, context);
+
+        return TRUE;
+}
+
 static const gchar *
 daemon_get_daemon_version (AccountsAccounts *object)
 {
@@ -843,6 +2708,12 @@ cache_user (Daemon *daemon,
         /* Always use the canonical user name looked up */
         user_name = user_get_user_name (user);
 
+        if (daemon->priv->user_db != NULL) {
+                if (!user_db_contains (daemon->priv->user_db, user_name))
+                        user_save (user);
+                return;
+        }
+
         filename = g_build_filename (USERDIR, user_name, NULL);
         if (!g_file_test (filename, G_FILE_TEST_EXISTS)) {
                 user_save (user);
@@ -851,6 +2722,31 @@ cache_user (Daemon *daemon,
         g_free (filename);
 }
 
+static void
+remove_cached_data (Daemon      *daemon,
+                    const gchar *user_name)
+{
+        GError *error = NULL;
+        gchar *filename;
+
+        if (daemon->priv->user_db != NULL) {
+                if (!user_db_remove (daemon->priv->user_db, user_name, &error)) {
+                        g_warning ("Removing data for user %s failed: %s",
+                                   user_name, error->message);
+                        g_error_free (error);
+                }
+        }
+        else {
+                filename = g_build_filename (USERDIR, user_name, NULL);
+                g_remove (filename);
+                g_free (filename);
+        }
+
+        filename = g_build_filename (ICONDIR, user_name, NULL);
+        g_remove (filename);
+        g_free (filename);
+}
+
 typedef struct {
         gchar *user_name;
         gchar *real_name;
@@ -915,6 +2811,9 @@ daemon_create_user_authorized_cb (Daemon                *daemon,
                 return;
         }
 
+        /* The name may have been cached as not existing */
+        pwent_cache_invalidate ();
+
         user = daemon_local_find_user_by_name (daemon, cd->user_name);
         user_update_local_account_property (user, TRUE);
         user_update_system_account_property (user, FALSE);
@@ -1010,7 +2909,6 @@ daemon_uncache_user_authorized_cb (Daemon                *daemon,
                                    gpointer               data)
 {
         const gchar *user_name = data;
-        gchar       *filename;
         User        *user;
 
         sys_log (context, "uncache user '%s'", user_name);
@@ -1025,13 +2923,7 @@ daemon_uncache_user_authorized_cb (Daemon                *daemon,
         /* Always use the canonical user name looked up */
         user_name = user_get_user_name (user);
 
-        filename = g_build_filename (USERDIR, user_name, NULL);
-        g_remove (filename);
-        g_free (filename);
-
-        filename = g_build_filename (ICONDIR, user_name, NULL);
-        g_remove (filename);
-        g_free (filename);
+        remove_cached_data (daemon, user_name);
 
         accounts_accounts_complete_uncache_user (NULL, context);
 
@@ -1071,7 +2963,6 @@ daemon_delete_user_authorized_cb (Daemon                *daemon,
 {
         DeleteUserData *ud = data;
         GError *error;
-        gchar *filename;
         struct passwd *pwent;
         const gchar *argv[6];
 
@@ -1098,13 +2989,7 @@ daemon_delete_user_authorized_cb (Daemon                *daemon,
 
         }
 
-        filename = g_build_filename (USERDIR, pwent->pw_name, NULL);
-        g_remove (filename);
-        g_free (filename);
-
-        filename = g_build_filename (ICONDIR, pwent->pw_name, NULL);
-        g_remove (filename);
-        g_free (filename);
+        remove_cached_data (daemon, pwent->pw_name);
 
         argv[0] = "/usr/sbin/userdel";
         if (ud->remove_files) {
@@ -1169,6 +3054,7 @@ typedef struct {
         GDBusMethodInvocation *context;
         gpointer data;
         GDestroyNotify destroy_notify;
+        gint64 start_time;
 } CheckAuthData;
 
 static void
@@ -1197,6 +3083,9 @@ check_auth_cb (PolkitAuthority *authority,
 
         is_authorized = FALSE;
 
+        latency_stats_add (cad->context, LATENCY_PHASE_POLKIT,
+                           g_get_monotonic_time () - cad->start_time);
+
         error = NULL;
         result = polkit_authority_check_authorization_finish (authority, res, &error);
         if (error) {
@@ -1218,10 +3107,12 @@ check_auth_cb (PolkitAuthority *authority,
         }
 
         if (is_authorized) {
+                latency_stats_push_call (cad->context);
                 (* cad->authorized_cb) (cad->daemon,
                                         cad->user,
                                         cad->context,
                                         cad->data);
+                latency_stats_pop_call ();
         }
 
         check_auth_data_free (data);
@@ -1249,8 +3140,9 @@ daemon_local_check_auth (Daemon                *daemon,
         data->authorized_cb = authorized_cb;
         data->data = authorized_cb_data;
         data->destroy_notify = destroy_notify;
+        data->start_time = g_get_monotonic_time ();
 
-        subject = polkit_system_bus_name_new (g_dbus_method_invocation_get_sender (context));
+        subject = get_caller_subject (context);
 
         flags = POLKIT_CHECK_AUTHORIZATION_FLAGS_NONE;
         if (allow_interaction)
@@ -1383,7 +3275,19 @@ daemon_local_set_automatic_login (Daemon    *daemon,
 GHashTable *
 daemon_get_extension_ifaces (Daemon *daemon)
 {
-  return daemon->priv->extension_ifaces;
+        /* Only blocks if a user is exported before the read finished */
+        if (daemon->priv->extension_thread != NULL) {
+                daemon->priv->extension_ifaces = g_thread_join (daemon->priv->extension_thread);
+                daemon->priv->extension_thread = NULL;
+        }
+
+        return daemon->priv->extension_ifaces;
+}
+
+UserDb *
+daemon_get_user_db (Daemon *daemon)
+{
+        return daemon->priv->user_db;
 }
 
 static void
@@ -1444,6 +3348,8 @@ daemon_accounts_accounts_iface_init (AccountsAccountsIface *iface)
         iface->handle_find_user_by_id = daemon_find_user_by_id;
         iface->handle_find_user_by_name = daemon_find_user_by_name;
         iface->handle_list_cached_users = daemon_list_cached_users;
+        iface->handle_get_changes_since = daemon_get_changes_since;
+        iface->handle_open_change_journal = daemon_open_change_journal;
         iface->get_daemon_version = daemon_get_daemon_version;
         iface->handle_cache_user = daemon_cache_user;
         iface->handle_uncache_user = daemon_uncache_user;
@@ -28,6 +28,9 @@
 
 #include "types.h"
 #include "user.h"
+#include "user-db.h"
+#include "request-scheduler.h"
+#include "property-cache.h"
 #include "accounts-generated.h"
 
 G_BEGIN_DECLS
@@ -68,6 +71,14 @@ GQuark error_quark (void);
 
 GType   daemon_get_type              (void) G_GNUC_CONST;
 Daemon *daemon_new                   (void);
+void    daemon_save_state            (Daemon *daemon);
+void    daemon_enable_enumeration    (Daemon *daemon,
+                                      uid_t   uid_min,
+                                      uid_t   uid_max,
+                                      guint   max_users);
+gboolean daemon_listen_private       (Daemon       *daemon,
+                                      const gchar  *path,
+                                      GError      **error);
 
 /* local methods */
 
@@ -96,9 +107,26 @@ gboolean   daemon_local_set_automatic_login (Daemon         *daemon,
                                              gboolean        enabled,
                                              GError        **error);
 
+void       daemon_local_queue_shared_snapshot (Daemon       *daemon);
+GList *    daemon_local_get_peer_connections (Daemon        *daemon);
+RequestScheduler *daemon_local_get_request_scheduler (Daemon *daemon);
+PropertyCache *daemon_local_get_property_cache (Daemon *daemon);
+void       daemon_local_restore_login_history (Daemon   *daemon);
+
+void       daemon_dump_stats         (Daemon       *daemon);
+void       daemon_local_user_changed (Daemon       *daemon,
+                                      User         *user,
+                                      const gchar  *property);
+void       daemon_local_user_rekeyed (Daemon       *daemon,
+                                      User         *user,
+                                      const gchar  *old_name,
+                                      uid_t         old_uid);
+
 GHashTable * daemon_read_extension_ifaces (void);
 GHashTable * daemon_get_extension_ifaces (Daemon *daemon);
 
+UserDb *     daemon_get_user_db           (Daemon *daemon);
+
 G_END_DECLS
 
 #endif /* __DAEMON_H__ */
@@ -0,0 +1,265 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * Copyright (C) 2015 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include <glib.h>
+
+#include "extra-data.h"
+
+/* The values that vendor extensions store for a user, kept for as
+ * long as the user exists.  A GKeyFile spends a hash table, lists and
+ * comment slots on every group, which is a lot for a handful of short
+ * strings, so the values are kept in one buffer instead:
+ *
+ *   group \0 key \0 value \0 group \0 key \0 value \0 ...
+ *
+ * sorted by group and key.  The values are kept as printed in the
+ * keyfile, escapes and all.  The index of the entries is only built
+ * on the first lookup, since most users are never asked for theirs.
+ */
+
+struct ExtraData {
+        gchar   *buffer;
+        gsize    length;
+        guint    n_entries;
+        guint32 *index;         /* offsets of the entries, or NULL */
+};
+
+typedef struct {
+        const gchar *group;
+        const gchar *key;
+        gchar       *value;
+} Entry;
+
+static gint
+compare_entries (gconstpointer a,
+                 gconstpointer b)
+{
+        const Entry *entry_a = a;
+        const Entry *entry_b = b;
+        gint ret;
+
+        ret = strcmp (entry_a->group, entry_b->group);
+        if (ret == 0)
+                ret = strcmp (entry_a->key, entry_b->key);
+
+        return ret;
+}
+
+/* Returns NULL if @key_file has no values outside @skip_group */
+ExtraData *
+extra_data_new_from_key_file (GKeyFile    *key_file,
+                              const gchar *skip_group)
+{
+        ExtraData *data;
+        GArray *entries;
+        gchar **groups;
+        gchar **keys;
+        Entry *entry;
+        gsize size;
+        gchar *p;
+        guint i, j;
+
+        entries = g_array_new (FALSE, FALSE, sizeof (Entry));
+        groups = g_key_file_get_groups (key_file, NULL);
+        keys = NULL;
+        size = 0;
+
+        for (i = 0; groups[i] != NULL; i++) {
+                if (g_strcmp0 (groups[i], skip_group) == 0)
+                        continue;
+
+                keys = g_key_file_get_keys (key_file, groups[i], NULL, NULL);
+                for (j = 0; keys != NULL && keys[j] != NULL; j++) {
+                        Entry e;
+
+                        e.group = groups[i];
+                        e.key = keys[j];
+                        e.value = g_key_file_get_value (key_file, groups[i], keys[j], NULL);
+                        if (e.value == NULL) {
+                                g_free (keys[j]);
+                                continue;
+                        }
+
+                        size += strlen (e.group) + strlen (e.key) + strlen (e.value) + 3;
+                        g_array_append_val (entries, e);
+                }
+
+                /* The entries point into the keys until they are copied */
+                g_free (keys);
+        }
+
+        data = NULL;
+        if (entries->len > 0) {
+                g_array_sort (entries, compare_entries);
+
+                data = g_new0 (ExtraData, 1);
+                data->buffer = g_malloc (size);
+                data->length = size;
+                data->n_entries = entries->len;
+
+                p = data->buffer;
+                for (i = 0; i < entries->len; i++) {
+                        entry = &g_array_index (entries, Entry, i);
+                        p = g_stpcpy (p, entry->group) + 1;
+                        p = g_stpcpy (p, entry->key) + 1;
+                        p = g_stpcpy (p, entry->value) + 1;
+                }
+        }
+
+        for (i = 0; i < entries->len; i++) {
+                entry = &g_array_index (entries, Entry, i);
+                g_free ((gchar *) entry->key);
+                g_free (entry->value);
+        }
+        g_array_unref (entries);
+        g_strfreev (groups);
+
+        return data;
+}
+
+void
+extra_data_free (ExtraData *data)
+{
+        g_free (data->buffer);
+        g_free (data->index);
+        g_free (data);
+}
+
+static const gchar *
+next_string (const gchar *p)
+{
+        return p + strlen (p) + 1;
+}
+
+static void
+build_index (ExtraData *data)
+{
+        const gchar *p;
+        guint i;
+
+        data->index = g_new (guint32, data->n_entries);
+
+        p = data->buffer;
+        for (i = 0; i < data->n_entries; i++) {
+                data->index[i] = p - data->buffer;
+                p = next_string (next_string (next_string (p)));
+        }
+}
+
+/* Returns the value of @key in @group as printed in the keyfile */
+const gchar *
+extra_data_lookup (ExtraData   *data,
+                   const gchar *group,
+                   const gchar *key)
+{
+        const gchar *entry;
+        guint lo, hi, mid;
+        gint cmp;
+
+        if (data->index == NULL)
+                build_index (data);
+
+        lo = 0;
+        hi = data->n_entries;
+        while (lo < hi) {
+                mid = lo + (hi - lo) / 2;
+                entry = data->buffer + data->index[mid];
+
+                cmp = strcmp (group, entry);
+                if (cmp == 0)
+                        cmp = strcmp (key, next_string (entry));
+
+                if (cmp == 0)
+                        return next_string (next_string (entry));
+                else if (cmp < 0)
+                        hi = mid;
+                else
+                        lo = mid + 1;
+        }
+
+        return NULL;
+}
+
+void
+extra_data_add_to_key_file (ExtraData *data,
+                            GKeyFile  *key_file)
+{
+        const gchar *group;
+        const gchar *key;
+        const gchar *p;
+        guint i;
+
+        p = data->buffer;
+        for (i = 0; i < data->n_entries; i++) {
+                group = p;
+                key = next_string (group);
+                p = next_string (key);
+
+                g_key_file_set_value (key_file, group, key, p);
+                p = next_string (p);
+        }
+}
+
+/* Values are only set when a client writes an extension property, so
+ * this simply rebuilds the buffer.  Consumes @data, which may be NULL.
+ */
+ExtraData *
+extra_data_set_value (ExtraData   *data,
+                      const gchar *group,
+                      const gchar *key,
+                      const gchar *value)
+{
+        ExtraData *result;
+        GKeyFile *key_file;
+
+        key_file = g_key_file_new ();
+        if (data != NULL) {
+                extra_data_add_to_key_file (data, key_file);
+                extra_data_free (data);
+        }
+
+        g_key_file_set_value (key_file, group, key, value);
+        result = extra_data_new_from_key_file (key_file, NULL);
+        g_key_file_unref (key_file);
+
+        return result;
+}
+
+/* Drops the index, which the next lookup builds again */
+void
+extra_data_trim (ExtraData *data)
+{
+        g_clear_pointer (&data->index, g_free);
+}
+
+gsize
+extra_data_get_size (ExtraData *data)
+{
+        gsize size;
+
+        size = sizeof (ExtraData) + data->length;
+        if (data->index != NULL)
+                size += data->n_entries * sizeof (guint32);
+
+        return size;
+}
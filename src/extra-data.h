@@ -0,0 +1,47 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * Copyright (C) 2015 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __EXTRA_DATA_H__
+#define __EXTRA_DATA_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct ExtraData ExtraData;
+
+ExtraData *     extra_data_new_from_key_file    (GKeyFile     *key_file,
+                                                 const gchar  *skip_group);
+void            extra_data_free                 (ExtraData    *data);
+
+const gchar *   extra_data_lookup               (ExtraData    *data,
+                                                 const gchar  *group,
+                                                 const gchar  *key);
+ExtraData *     extra_data_set_value            (ExtraData    *data,
+                                                 const gchar  *group,
+                                                 const gchar  *key,
+                                                 const gchar  *value);
+void            extra_data_add_to_key_file      (ExtraData    *data,
+                                                 GKeyFile     *key_file);
+void            extra_data_trim                 (ExtraData    *data);
+gsize           extra_data_get_size             (ExtraData    *data);
+
+G_END_DECLS
+
+#endif /* __EXTRA_DATA_H__ */
@@ -0,0 +1,454 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * Copyright (C) 2015 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include <glib.h>
+#include <gio/gio.h>
+
+#include "latency-stats.h"
+
+/* Latency histograms of the method calls, by method and by phase, for
+ * the org.freedesktop.Accounts.Debug.Stats interface.
+ *
+ * Every call is timed by a connection filter, from when it comes in
+ * until its reply goes out, so that property access and calls that
+ * skip the request scheduler are included.  Calls to methods that do
+ * not exist are not recorded, as their names come from the caller.
+ *
+ * The phases of calls that went through latency_stats_begin_call()
+ * are added up on the invocation as they happen, and recorded when
+ * it is finalized, right after the reply was sent.
+ *
+ * Values are bucketed like in HDR histograms: exactly below
+ * SUB_BUCKETS microseconds, and in SUB_BUCKETS linear steps per power
+ * of two above that, so that every bucket is accurate to 1/16th.
+ */
+
+#define SUB_BUCKET_BITS 4
+#define SUB_BUCKETS     (1 << SUB_BUCKET_BITS)
+
+/* Values are clamped to 32 bits, a bit over an hour */
+#define N_BUCKETS       ((32 - SUB_BUCKET_BITS + 1) * SUB_BUCKETS)
+
+#define CALL_TIMER_KEY  "accounts-latency-timer"
+
+typedef struct {
+        guint64 count;
+        guint64 total;
+        guint64 max;
+        guint64 buckets[N_BUCKETS];
+} Histogram;
+
+typedef struct {
+        Histogram *phases[N_LATENCY_PHASES];
+} MethodStats;
+
+typedef struct {
+        const gchar *method;    /* interned */
+        gint64       phases[N_LATENCY_PHASES];
+        guint        seen;      /* bit for each phase in phases */
+} CallTimer;
+
+typedef struct {
+        GDBusConnection *connection;
+        guint32          serial;
+        gchar           *method;
+        gint64           start;
+} PendingCall;
+
+static const gchar * const phase_names[N_LATENCY_PHASES] = {
+        "total",
+        "queued",
+        "polkit",
+        "spawn",
+        "io"
+};
+
+static GMutex lock;
+static GHashTable *methods;     /* interned method -> MethodStats */
+static GHashTable *pending;     /* PendingCall set, by connection and serial */
+
+/* Calls being handled on the main thread, innermost first */
+static GSList *current;
+
+static void
+method_stats_free (MethodStats *stats)
+{
+        guint i;
+
+        for (i = 0; i < N_LATENCY_PHASES; i++)
+                g_free (stats->phases[i]);
+        g_free (stats);
+}
+
+static guint
+get_bucket (guint32 value)
+{
+        guint shift;
+
+        if (value < SUB_BUCKETS)
+                return value;
+
+        shift = g_bit_nth_msf (value, -1) - SUB_BUCKET_BITS;
+
+        return (shift + 1) * SUB_BUCKETS + (value >> shift) - SUB_BUCKETS;
+}
+
+/* The lowest value that goes into @bucket */
+static guint64
+get_bucket_start (guint bucket)
+{
+        guint shift;
+
+        if (bucket < SUB_BUCKETS)
+                return bucket;
+
+        shift = bucket / SUB_BUCKETS - 1;
+
+        return (guint64) (SUB_BUCKETS + bucket % SUB_BUCKETS) << shift;
+}
+
+void
+latency_stats_record (const gchar  *method,
+                      LatencyPhase  phase,
+                      gint64        usec)
+{
+        MethodStats *stats;
+        Histogram *histogram;
+        guint32 value;
+
+        value = CLAMP (usec, 0, G_MAXUINT32);
+        method = g_intern_string (method);
+
+        g_mutex_lock (&lock);
+
+        if (methods == NULL)
+                methods = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+                                                 NULL, (GDestroyNotify) method_stats_free);
+
+        stats = g_hash_table_lookup (methods, method);
+        if (stats == NULL) {
+                stats = g_new0 (MethodStats, 1);
+                g_hash_table_insert (methods, (gpointer) method, stats);
+        }
+
+        histogram = stats->phases[phase];
+        if (histogram == NULL)
+                histogram = stats->phases[phase] = g_new0 (Histogram, 1);
+
+        histogram->count++;
+        histogram->total += value;
+        histogram->max = MAX (histogram->max, value);
+        histogram->buckets[get_bucket (value)]++;
+
+        g_mutex_unlock (&lock);
+}
+
+/* The total is recorded by call_filter() */
+static void
+call_timer_finish (CallTimer *timer)
+{
+        LatencyPhase phase;
+
+        for (phase = LATENCY_PHASE_TOTAL + 1; phase < N_LATENCY_PHASES; phase++) {
+                if (timer->seen & (1 << phase))
+                        latency_stats_record (timer->method, phase, timer->phases[phase]);
+        }
+
+        g_free (timer);
+}
+
+/* Starts timing the phases of @invocation, unless that has happened
+ * already.  Only for methods that exist, since the name is interned.
+ */
+void
+latency_stats_begin_call (GDBusMethodInvocation *invocation)
+{
+        CallTimer *timer;
+        gchar *method;
+
+        if (g_object_get_data (G_OBJECT (invocation), CALL_TIMER_KEY) != NULL)
+                return;
+
+        method = g_strconcat (g_dbus_method_invocation_get_interface_name (invocation), ".",
+                              g_dbus_method_invocation_get_method_name (invocation), NULL);
+
+        timer = g_new0 (CallTimer, 1);
+        timer->method = g_intern_string (method);
+        g_free (method);
+
+        g_object_set_data_full (G_OBJECT (invocation), CALL_TIMER_KEY,
+                                timer, (GDestroyNotify) call_timer_finish);
+}
+
+void
+latency_stats_add (GDBusMethodInvocation *invocation,
+                   LatencyPhase           phase,
+                   gint64                 usec)
+{
+        CallTimer *timer;
+
+        if (invocation == NULL)
+                return;
+
+        timer = g_object_get_data (G_OBJECT (invocation), CALL_TIMER_KEY);
+        if (timer == NULL)
+                return;
+
+        timer->phases[phase] += usec;
+        timer->seen |= 1 << phase;
+}
+
+/* Makes @invocation the call that latency_stats_add_current() adds
+ * to, for code that does not get to see it, until the matching
+ * latency_stats_pop_call().  Main thread only.
+ */
+void
+latency_stats_push_call (GDBusMethodInvocation *invocation)
+{
+        current = g_slist_prepend (current, g_object_ref (invocation));
+}
+
+void
+latency_stats_pop_call (void)
+{
+        GDBusMethodInvocation *invocation;
+
+        g_return_if_fail (current != NULL);
+
+        invocation = current->data;
+        current = g_slist_delete_link (current, current);
+        g_object_unref (invocation);
+}
+
+void
+latency_stats_add_current (LatencyPhase phase,
+                           gint64       usec)
+{
+        if (current != NULL)
+                latency_stats_add (current->data, phase, usec);
+}
+
+static guint
+pending_call_hash (gconstpointer key)
+{
+        const PendingCall *call = key;
+
+        return g_direct_hash (call->connection) ^ call->serial;
+}
+
+static gboolean
+pending_call_equal (gconstpointer a,
+                    gconstpointer b)
+{
+        const PendingCall *call_a = a;
+        const PendingCall *call_b = b;
+
+        return call_a->connection == call_b->connection && call_a->serial == call_b->serial;
+}
+
+static void
+pending_call_free (PendingCall *call)
+{
+        g_free (call->method);
+        g_free (call);
+}
+
+static gboolean
+is_unknown_method_error (GDBusMessage *reply)
+{
+        const gchar *error_name;
+
+        if (g_dbus_message_get_message_type (reply) != G_DBUS_MESSAGE_TYPE_ERROR)
+                return FALSE;
+
+        error_name = g_dbus_message_get_error_name (reply);
+
+        return g_strcmp0 (error_name, "org.freedesktop.DBus.Error.UnknownMethod") == 0 ||
+               g_strcmp0 (error_name, "org.freedesktop.DBus.Error.UnknownObject") == 0 ||
+               g_strcmp0 (error_name, "org.freedesktop.DBus.Error.UnknownInterface") == 0;
+}
+
+/* Runs on the GDBus worker thread */
+static GDBusMessage *
+call_filter (GDBusConnection *connection,
+             GDBusMessage    *message,
+             gboolean         incoming,
+             gpointer         user_data)
+{
+        GDBusMessageType type;
+        PendingCall key;
+        PendingCall *call;
+        const gchar *interface_name;
+        gint64 now;
+
+        type = g_dbus_message_get_message_type (message);
+        now = g_get_monotonic_time ();
+
+        if (incoming) {
+                if (type != G_DBUS_MESSAGE_TYPE_METHOD_CALL ||
+                    (g_dbus_message_get_flags (message) & G_DBUS_MESSAGE_FLAGS_NO_REPLY_EXPECTED) != 0)
+                        return message;
+
+                interface_name = g_dbus_message_get_interface (message);
+
+                call = g_new0 (PendingCall, 1);
+                call->connection = connection;
+                call->serial = g_dbus_message_get_serial (message);
+                call->method = interface_name != NULL ?
+                               g_strconcat (interface_name, ".", g_dbus_message_get_member (message), NULL) :
+                               g_strdup (g_dbus_message_get_member (message));
+                call->start = now;
+
+                g_mutex_lock (&lock);
+                g_hash_table_add (pending, call);
+                g_mutex_unlock (&lock);
+
+                return message;
+        }
+
+        if (type != G_DBUS_MESSAGE_TYPE_METHOD_RETURN && type != G_DBUS_MESSAGE_TYPE_ERROR)
+                return message;
+
+        key.connection = connection;
+        key.serial = g_dbus_message_get_reply_serial (message);
+
+        g_mutex_lock (&lock);
+        call = g_hash_table_lookup (pending, &key);
+        if (call != NULL)
+                g_hash_table_steal (pending, call);
+        g_mutex_unlock (&lock);
+
+        if (call == NULL)
+                return message;
+
+        if (!is_unknown_method_error (message))
+                latency_stats_record (call->method, LATENCY_PHASE_TOTAL, now - call->start);
+        pending_call_free (call);
+
+        return message;
+}
+
+static gboolean
+is_on_connection (gpointer key,
+                  gpointer value,
+                  gpointer user_data)
+{
+        PendingCall *call = key;
+
+        return call->connection == user_data;
+}
+
+static void
+on_connection_closed (GDBusConnection *connection,
+                      gboolean         remote_peer_vanished,
+                      GError          *error,
+                      gpointer         user_data)
+{
+        g_mutex_lock (&lock);
+        g_hash_table_foreach_remove (pending, is_on_connection, connection);
+        g_mutex_unlock (&lock);
+}
+
+/* Times the calls on @connection.  Must come before any filter that
+ * takes calls off the connection.
+ */
+void
+latency_stats_attach (GDBusConnection *connection)
+{
+        g_mutex_lock (&lock);
+        if (pending == NULL)
+                pending = g_hash_table_new_full (pending_call_hash, pending_call_equal,
+                                                 (GDestroyNotify) pending_call_free, NULL);
+        g_mutex_unlock (&lock);
+
+        g_signal_connect (connection, "closed", G_CALLBACK (on_connection_closed), NULL);
+        g_dbus_connection_add_filter (connection, call_filter, NULL, NULL);
+}
+
+static gint
+compare_methods (gconstpointer a,
+                 gconstpointer b)
+{
+        return strcmp (a, b);
+}
+
+/* Returns the histograms as a(ssttta(tt)) */
+GVariant *
+latency_stats_get (void)
+{
+        GVariantBuilder builder;
+        GVariantBuilder buckets;
+        MethodStats *stats;
+        Histogram *histogram;
+        GList *names, *l;
+        guint phase;
+        guint i;
+
+        g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(ssttta(tt))"));
+
+        g_mutex_lock (&lock);
+
+        names = methods != NULL ? g_hash_table_get_keys (methods) : NULL;
+        names = g_list_sort (names, compare_methods);
+
+        for (l = names; l != NULL; l = l->next) {
+                stats = g_hash_table_lookup (methods, l->data);
+
+                for (phase = 0; phase < N_LATENCY_PHASES; phase++) {
+                        histogram = stats->phases[phase];
+                        if (histogram == NULL)
+                                continue;
+
+                        g_variant_builder_init (&buckets, G_VARIANT_TYPE ("a(tt)"));
+                        for (i = 0; i < N_BUCKETS; i++) {
+                                if (histogram->buckets[i] != 0)
+                                        g_variant_builder_add (&buckets, "(tt)",
+                                                               get_bucket_start (i),
+                                                               histogram->buckets[i]);
+                        }
+
+                        g_variant_builder_add (&builder, "(ssttta(tt))",
+                                               l->data,
+                                               phase_names[phase],
+                                               histogram->count,
+                                               histogram->total,
+                                               histogram->max,
+                                               &buckets);
+                }
+        }
+
+        g_mutex_unlock (&lock);
+
+        g_list_free (names);
+
+        return g_variant_builder_end (&builder);
+}
+
+void
+latency_stats_reset (void)
+{
+        g_mutex_lock (&lock);
+        if (methods != NULL)
+                g_hash_table_remove_all (methods);
+        g_mutex_unlock (&lock);
+}
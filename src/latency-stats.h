@@ -0,0 +1,57 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * Copyright (C) 2015 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __LATENCY_STATS_H__
+#define __LATENCY_STATS_H__
+
+#include <glib.h>
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+typedef enum {
+        LATENCY_PHASE_TOTAL,    /* received until replied to */
+        LATENCY_PHASE_QUEUED,   /* held back by the request scheduler */
+        LATENCY_PHASE_POLKIT,   /* waiting for the authorization check */
+        LATENCY_PHASE_SPAWN,    /* running helper programs */
+        LATENCY_PHASE_IO,       /* reading and writing user data */
+        N_LATENCY_PHASES
+} LatencyPhase;
+
+void                    latency_stats_attach            (GDBusConnection       *connection);
+
+void                    latency_stats_record            (const gchar           *method,
+                                                         LatencyPhase           phase,
+                                                         gint64                 usec);
+
+void                    latency_stats_begin_call        (GDBusMethodInvocation *invocation);
+void                    latency_stats_add               (GDBusMethodInvocation *invocation,
+                                                         LatencyPhase           phase,
+                                                         gint64                 usec);
+void                    latency_stats_push_call         (GDBusMethodInvocation *invocation);
+void                    latency_stats_pop_call          (void);
+void                    latency_stats_add_current       (LatencyPhase           phase,
+                                                         gint64                 usec);
+
+GVariant *              latency_stats_get               (void);
+void                    latency_stats_reset             (void);
+
+G_END_DECLS
+
+#endif /* __LATENCY_STATS_H__ */
@@ -51,6 +51,7 @@
 #include "act-user-manager.h"
 #include "act-user-private.h"
 #include "accounts-generated.h"
+#include "shared-snapshot.h"
 #include "ck-manager-generated.h"
 #include "ck-seat-generated.h"
 #include "ck-session-generated.h"
@@ -194,6 +195,8 @@ struct ActUserManagerPrivate
         GSList                *exclude_usernames;
         GSList                *include_usernames;
 
+        GHashTable            *shared_snapshot;
+
         guint                  load_id;
 
         gboolean               is_loaded;
@@ -1084,6 +1087,7 @@ add_new_user_for_object_path (const char     *object_path,
                               ActUserManager *manager)
 {
         ActUser *user;
+        GVariant *properties;
 
         user = g_hash_table_lookup (manager->priv->users_by_object_path, object_path);
 
@@ -1104,7 +1108,15 @@ add_new_user_for_object_path (const char     *object_path,
         g_debug ("ActUserManager: tracking new user with object path %s", object_path);
 
         user = create_new_user (manager);
-        _act_user_update_from_object_path (user, object_path);
+
+        properties = NULL;
+        if (manager->priv->shared_snapshot != NULL)
+                properties = g_hash_table_lookup (manager->priv->shared_snapshot, object_path);
+
+        if (properties != NULL)
+                _act_user_update_from_properties (user, object_path, properties);
+        else
+                _act_user_update_from_object_path (user, object_path);
 
         return user;
 }
@@ -1506,6 +1518,159 @@ set_is_loaded (ActUserManager *manager,
         }
 }
 
+/* Maps the snapshot that the accounts service publishes of its
+ * users, and returns a table of object path -> properties, along with
+ * the change log generation the snapshot is as of.  The values point
+ * into the mapping rather than being copied out of it, but each user
+ * copies its properties when it is created, and the table is dropped
+ * once the cached users are added.  What the snapshot saves is a
+ * GetAll call per user, not memory.
+ */
+static GHashTable *
+load_shared_snapshot (guint64 *out_generation)
+{
+        GMappedFile *mapped;
+        GBytes      *bytes;
+        GVariant    *snapshot;
+        GVariant    *users;
+        GVariant    *properties;
+        GVariantIter iter;
+        GHashTable  *table;
+        GError      *error = NULL;
+        char        *object_path;
+        guint32      version;
+        guint64      generation;
+
+        mapped = g_mapped_file_new (SHARED_SNAPSHOT_PATH, FALSE, &error);
+        if (mapped == NULL) {
+                g_debug ("ActUserManager: no shared user snapshot: %s", error->message);
+                g_error_free (error);
+                return NULL;
+        }
+
+        bytes = g_mapped_file_get_bytes (mapped);
+        g_mapped_file_unref (mapped);
+
+        snapshot = g_variant_new_from_bytes (G_VARIANT_TYPE (SHARED_SNAPSHOT_TYPE), bytes, FALSE);
+        g_variant_ref_sink (snapshot);
+        g_bytes_unref (bytes);
+
+        g_variant_get (snapshot, "(ut@a{oa{sv}})", &version, &generation, &users);
+        g_variant_unref (snapshot);
+
+        if (version != SHARED_SNAPSHOT_VERSION) {
+                g_debug ("ActUserManager: ignoring shared user snapshot with version %u", version);
+                g_variant_unref (users);
+                return NULL;
+        }
+
+        table = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify) g_variant_unref);
+
+        g_variant_iter_init (&iter, users);
+        while (g_variant_iter_next (&iter, "{o@a{sv}}", &object_path, &properties))
+                g_hash_table_insert (table, object_path, properties);
+        g_variant_unref (users);
+
+        g_debug ("ActUserManager: mapped shared user snapshot %" G_GUINT64_FORMAT " with %u users",
+                 generation, g_hash_table_size (table));
+
+        *out_generation = generation;
+
+        return table;
+}
+
+static void
+add_included_users (ActUserManager *manager)
+{
+        /* Add users who are specifically included */
+        if (manager->priv->include_usernames != NULL) {
+                GSList *l;
+
+                for (l = manager->priv->include_usernames; l != NULL; l = l->next) {
+                        ActUser *user;
+
+                        g_debug ("ActUserManager: Adding included user %s", (char *)l->data);
+                        /*
+                         * The call to act_user_manager_get_user will add the user if it is
+                         * valid and not already in the hash.
+                         */
+                        user = act_user_manager_get_user (manager, l->data);
+                        if (user == NULL) {
+                                g_debug ("ActUserManager: unable to lookup user '%s'", (char *)l->data);
+                        }
+                }
+        }
+}
+
+typedef struct {
+        ActUserManager *manager;
+        char          **user_paths;
+} CachedUsersData;
+
+static void
+add_cached_users (ActUserManager *manager,
+                  char          **user_paths)
+{
+        int i;
+
+        for (i = 0; user_paths[i] != NULL; i++) {
+                ActUser *user;
+
+                user = add_new_user_for_object_path (user_paths[i], manager);
+                if (!manager->priv->is_loaded) {
+                        manager->priv->new_users_inhibiting_load = g_slist_prepend (manager->priv->new_users_inhibiting_load, user);
+                }
+        }
+
+        g_clear_pointer (&manager->priv->shared_snapshot, g_hash_table_unref);
+}
+
+static void
+on_get_changes_since_finished (GObject      *object,
+                               GAsyncResult *result,
+                               gpointer      data)
+{
+        AccountsAccounts *proxy = ACCOUNTS_ACCOUNTS (object);
+        CachedUsersData  *cached_users = data;
+        ActUserManager   *manager = cached_users->manager;
+        GVariant         *changes;
+        GVariantIter      iter;
+        GError           *error = NULL;
+        const char       *object_path;
+        guint64           generation;
+        gboolean          resync;
+
+        if (!accounts_accounts_call_get_changes_since_finish (proxy, &generation, &resync, &changes, result, &error)) {
+                g_debug ("ActUserManager: GetChangesSince failed: %s", error->message);
+                g_error_free (error);
+                resync = TRUE;
+                changes = NULL;
+        }
+
+        if (resync) {
+                /* Too old, or from an earlier instance of the service */
+                g_debug ("ActUserManager: not using the shared user snapshot");
+                g_clear_pointer (&manager->priv->shared_snapshot, g_hash_table_unref);
+        } else {
+                /* Users that changed since are fetched over the bus */
+                g_variant_iter_init (&iter, changes);
+                while (g_variant_iter_next (&iter, "(u&oas)", NULL, &object_path, NULL))
+                        g_hash_table_remove (manager->priv->shared_snapshot, object_path);
+        }
+
+        if (changes != NULL)
+                g_variant_unref (changes);
+
+        add_cached_users (manager, cached_users->user_paths);
+        add_included_users (manager);
+
+        g_strfreev (cached_users->user_paths);
+        g_free (cached_users);
+
+        g_debug ("ActUserManager: unrefing manager owned by finished ListCachedUsers call");
+        g_object_unref (manager);
+}
+
 static void
 on_list_cached_users_finished (GObject      *object,
                                GAsyncResult *result,
@@ -1535,17 +1700,31 @@ on_list_cached_users_finished (GObject      *object,
          * (see on_new_user_loaded)
          */
         if (g_strv_length (user_paths) > 0) {
-                int i;
+                guint64 generation;
 
                 g_debug ("ActUserManager: ListCachedUsers finished, will set loaded property after list is fully loaded");
-                for (i = 0; user_paths[i] != NULL; i++) {
-                        ActUser *user;
 
-                        user = add_new_user_for_object_path (user_paths[i], manager);
-                        if (!manager->priv->is_loaded) {
-                                manager->priv->new_users_inhibiting_load = g_slist_prepend (manager->priv->new_users_inhibiting_load, user);
-                        }
+                /* Take the initial properties from the shared snapshot
+                 * instead of fetching them for each user, once the
+                 * service said which users changed since it was written.
+                 */
+                manager->priv->shared_snapshot = load_shared_snapshot (&generation);
+                if (manager->priv->shared_snapshot != NULL) {
+                        CachedUsersData *cached_users;
+
+                        cached_users = g_new (CachedUsersData, 1);
+                        cached_users->manager = manager;
+                        cached_users->user_paths = user_paths;
+
+                        accounts_accounts_call_get_changes_since (proxy,
+                                                                  generation,
+                                                                  NULL,
+                                                                  on_get_changes_since_finished,
+                                                                  cached_users);
+                        return;
                 }
+
+                add_cached_users (manager, user_paths);
         } else {
                 g_debug ("ActUserManager: ListCachedUsers finished with empty list, maybe setting loaded property now");
                 maybe_set_is_loaded (manager);
@@ -1553,24 +1732,7 @@ on_list_cached_users_finished (GObject      *object,
 
         g_strfreev (user_paths);
 
-        /* Add users who are specifically included */
-        if (manager->priv->include_usernames != NULL) {
-                GSList *l;
-
-                for (l = manager->priv->include_usernames; l != NULL; l = l->next) {
-                        ActUser *user;
-
-                        g_debug ("ActUserManager: Adding included user %s", (char *)l->data);
-                        /*
-                         * The call to act_user_manager_get_user will add the user if it is
-                         * valid and not already in the hash.
-                         */
-                        user = act_user_manager_get_user (manager, l->data);
-                        if (user == NULL) {
-                                g_debug ("ActUserManager: unable to lookup user '%s'", (char *)l->data);
-                        }
-                }
-        }
+        add_included_users (manager);
 
         g_debug ("ActUserManager: unrefing manager owned by finished ListCachedUsers call");
         g_object_unref (manager);
@@ -110,6 +110,7 @@ struct _ActUser {
         AccountsUser    *accounts_proxy;
         GDBusProxy      *object_proxy;
         GCancellable    *get_all_cancellable;
+        guint           loaded_id;
         char            *object_path;
 
         uid_t           uid;
@@ -596,6 +597,10 @@ act_user_finalize (GObject *object)
                 g_object_unref (user->get_all_cancellable);
         }
 
+        if (user->loaded_id != 0) {
+                g_source_remove (user->loaded_id);
+        }
+
         if (user->connection != NULL) {
                 g_object_unref (user->connection);
         }
@@ -1395,28 +1400,19 @@ _act_user_update_as_nonexistent (ActUser *user)
         set_is_loaded (user, TRUE);
 }
 
-/**
- * _act_user_update_from_object_path:
- * @user: the user object to update.
- * @object_path: the object path of the user to use.
- *
- * Updates the properties of @user from the accounts service via
- * the object path in @object_path.
- **/
-void
-_act_user_update_from_object_path (ActUser    *user,
-                                   const char *object_path)
+static gboolean
+create_proxies (ActUser    *user,
+                const char *object_path)
 {
         GError *error = NULL;
 
-        g_return_if_fail (ACT_IS_USER (user));
-        g_return_if_fail (object_path != NULL);
-        g_return_if_fail (user->object_path == NULL);
-
         user->object_path = g_strdup (object_path);
 
+        /* The properties are fetched with GetAll (or come from the
+         * shared snapshot), so don't have the proxy load them, too.
+         */
         user->accounts_proxy = accounts_user_proxy_new_sync (user->connection,
-                                                             G_DBUS_PROXY_FLAGS_NONE,
+                                                             G_DBUS_PROXY_FLAGS_DO_NOT_LOAD_PROPERTIES,
                                                              ACCOUNTS_NAME,
                                                              user->object_path,
                                                              NULL,
@@ -1424,7 +1420,7 @@ _act_user_update_from_object_path (ActUser    *user,
         if (!user->accounts_proxy) {
                 g_warning ("Couldn't create accounts proxy: %s", error->message);
                 g_error_free (error);
-                return;
+                return FALSE;
         }
         g_dbus_proxy_set_default_timeout (G_DBUS_PROXY (user->accounts_proxy), INT_MAX);
 
@@ -1441,10 +1437,87 @@ _act_user_update_from_object_path (ActUser    *user,
         if (!user->object_proxy) {
                 g_warning ("Couldn't create accounts property proxy: %s", error->message);
                 g_error_free (error);
+                return FALSE;
+        }
+
+        return TRUE;
+}
+
+/**
+ * _act_user_update_from_object_path:
+ * @user: the user object to update.
+ * @object_path: the object path of the user to use.
+ *
+ * Updates the properties of @user from the accounts service via
+ * the object path in @object_path.
+ **/
+void
+_act_user_update_from_object_path (ActUser    *user,
+                                   const char *object_path)
+{
+        g_return_if_fail (ACT_IS_USER (user));
+        g_return_if_fail (object_path != NULL);
+        g_return_if_fail (user->object_path == NULL);
+
+        if (!create_proxies (user, object_path))
                 return;
+
+        update_info (user);
+}
+
+static gboolean
+on_properties_loaded (gpointer data)
+{
+        ActUser *user = data;
+
+        user->loaded_id = 0;
+
+        if (!user->is_loaded) {
+                set_is_loaded (user, TRUE);
         }
 
-       update_info (user);
+        g_signal_emit (user, signals[CHANGED], 0);
+
+        return FALSE;
+}
+
+/**
+ * _act_user_update_from_properties:
+ * @user: the user object to update.
+ * @object_path: the object path of the user to use.
+ * @properties: the properties of the user, as returned by GetAll
+ *
+ * Like _act_user_update_from_object_path(), but takes the initial
+ * properties from @properties instead of asking the accounts service.
+ * Later changes are still picked up over the bus.
+ **/
+void
+_act_user_update_from_properties (ActUser    *user,
+                                  const char *object_path,
+                                  GVariant   *properties)
+{
+        GVariantIter iter;
+        gchar       *key;
+        GVariant    *value;
+
+        g_return_if_fail (ACT_IS_USER (user));
+        g_return_if_fail (object_path != NULL);
+        g_return_if_fail (user->object_path == NULL);
+
+        if (!create_proxies (user, object_path))
+                return;
+
+        g_variant_iter_init (&iter, properties);
+        while (g_variant_iter_next (&iter, "{sv}", &key, &value)) {
+                collect_props (key, value, user);
+                g_free (key);
+                g_variant_unref (value);
+        }
+
+        /* Callers expect the user to finish loading asynchronously,
+         * as it does when the properties come from GetAll.
+         */
+        user->loaded_id = g_idle_add (on_properties_loaded, user);
 }
 
 void
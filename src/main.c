@@ -37,7 +37,31 @@
 
 #define NAME_TO_CLAIM "org.freedesktop.Accounts"
 
+/* How often to check for unanswered calls before an idle exit, in ms */
+#define DRAIN_INTERVAL 100
+
 static GMainLoop *loop;
+static Daemon *daemon_instance;
+static guint owner_id;
+
+static gint idle_timeout;
+static gchar *private_socket;
+
+static gboolean enumerate_users;
+static gint enumerate_uid_min = MINIMUM_UID;
+static gint enumerate_uid_max = G_MAXINT32;
+static gint enumerate_max_users = 10000;
+
+/* Method calls are noted by a filter on the GDBus worker thread */
+static GMutex activity_lock;
+static gint64 last_activity;
+static guint pending_calls;
+static GHashTable *new_clients;
+
+/* Clients that have called us and are still on the bus keep the
+ * daemon from exiting, since they may rely on its signals.
+ */
+static GHashTable *clients;
 
 static gboolean
 ensure_directory (const char  *path,
@@ -54,6 +78,176 @@ ensure_directory (const char  *path,
         return TRUE;
 }
 
+static GDBusMessage *
+activity_filter (GDBusConnection *connection,
+                 GDBusMessage    *message,
+                 gboolean         incoming,
+                 gpointer         user_data)
+{
+        GDBusMessageType type;
+        const gchar *sender;
+
+        type = g_dbus_message_get_message_type (message);
+
+        /* Every reply we send answers a call we received; the daemon's
+         * own calls to other services only get replies coming in.
+         */
+        if (!incoming) {
+                if (type == G_DBUS_MESSAGE_TYPE_METHOD_RETURN ||
+                    type == G_DBUS_MESSAGE_TYPE_ERROR) {
+                        g_mutex_lock (&activity_lock);
+                        if (pending_calls > 0)
+                                pending_calls--;
+                        g_mutex_unlock (&activity_lock);
+                }
+                return message;
+        }
+
+        if (type != G_DBUS_MESSAGE_TYPE_METHOD_CALL)
+                return message;
+
+        sender = g_dbus_message_get_sender (message);
+
+        g_mutex_lock (&activity_lock);
+        last_activity = g_get_monotonic_time ();
+        if (!(g_dbus_message_get_flags (message) & G_DBUS_MESSAGE_FLAGS_NO_REPLY_EXPECTED))
+                pending_calls++;
+        if (sender != NULL)
+                g_hash_table_add (new_clients, g_strdup (sender));
+        g_mutex_unlock (&activity_lock);
+
+        return message;
+}
+
+static void
+on_client_vanished (GDBusConnection *connection,
+                    const gchar     *name,
+                    gpointer         user_data)
+{
+        g_debug ("client %s went away", name);
+        g_hash_table_remove (clients, name);
+}
+
+/* Runs until the calls that were still in flight when the name was
+ * released have been answered.
+ */
+static gboolean
+check_drained (gpointer data)
+{
+        guint pending;
+
+        g_mutex_lock (&activity_lock);
+        pending = pending_calls;
+        g_mutex_unlock (&activity_lock);
+
+        if (pending > 0) {
+                g_debug ("waiting for %u calls before exiting", pending);
+                return TRUE;
+        }
+
+        daemon_save_state (daemon_instance);
+        g_main_loop_quit (loop);
+
+        return FALSE;
+}
+
+static void
+on_name_released (GObject      *object,
+                  GAsyncResult *result,
+                  gpointer      user_data)
+{
+        GVariant *ret;
+
+        ret = g_dbus_connection_call_finish (G_DBUS_CONNECTION (object), result, NULL);
+        if (ret != NULL)
+                g_variant_unref (ret);
+
+        if (check_drained (NULL))
+                g_timeout_add (DRAIN_INTERVAL, check_drained, NULL);
+}
+
+static gboolean
+check_idle (gpointer data)
+{
+        GDBusConnection *connection = data;
+        GHashTableIter iter;
+        const gchar *name;
+        gint64 idle_since;
+        guint watch_id;
+
+        g_mutex_lock (&activity_lock);
+        idle_since = last_activity;
+        g_hash_table_iter_init (&iter, new_clients);
+        while (g_hash_table_iter_next (&iter, (gpointer *)&name, NULL)) {
+                if (g_hash_table_contains (clients, name))
+                        continue;
+
+                watch_id = g_bus_watch_name_on_connection (connection,
+                                                           name,
+                                                           G_BUS_NAME_WATCHER_FLAGS_NONE,
+                                                           NULL,
+                                                           on_client_vanished,
+                                                           NULL,
+                                                           NULL);
+                g_hash_table_insert (clients, g_strdup (name), GUINT_TO_POINTER (watch_id));
+        }
+        g_hash_table_remove_all (new_clients);
+        g_mutex_unlock (&activity_lock);
+
+        if (g_hash_table_size (clients) > 0)
+                return TRUE;
+
+        if (g_get_monotonic_time () - idle_since < (gint64) idle_timeout * G_USEC_PER_SEC)
+                return TRUE;
+
+        g_debug ("idle for %d seconds, exiting", idle_timeout);
+
+        /* Give up the name first, so that calls made from now on
+         * activate a new instance instead of getting lost.
+         */
+        g_bus_unown_name (owner_id);
+        owner_id = 0;
+
+        /* The bus delivers messages in order, so once this round trip
+         * is complete, every call sent to us before the name was
+         * released has arrived.
+         */
+        g_dbus_connection_call (connection,
+                                "org.freedesktop.DBus",
+                                "/org/freedesktop/DBus",
+                                "org.freedesktop.DBus",
+                                "GetId",
+                                NULL,
+                                NULL,
+                                G_DBUS_CALL_FLAGS_NONE,
+                                -1,
+                                NULL,
+                                on_name_released,
+                                NULL);
+
+        return FALSE;
+}
+
+static void
+unwatch_client (gpointer data)
+{
+        g_bus_unwatch_name (GPOINTER_TO_UINT (data));
+}
+
+/* The private socket goes away with the daemon and cannot activate
+ * it again, so the daemon only exits when idle without one.
+ */
+static void
+setup_idle_exit (GDBusConnection *connection)
+{
+        new_clients = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+        clients = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, unwatch_client);
+        last_activity = g_get_monotonic_time ();
+
+        g_dbus_connection_add_filter (connection, activity_filter, NULL, NULL);
+        g_timeout_add_seconds (MAX (idle_timeout / 4, 1), check_idle, connection);
+}
+
 static void
 on_bus_acquired (GDBusConnection  *connection,
                  const gchar      *name,
@@ -71,12 +265,29 @@ on_bus_acquired (GDBusConnection  *connection,
                 goto out;
         }
 
+        /* Before the daemon adds the filter of its property cache,
+         * which takes the reads it answers off the connection.
+         */
+        if (idle_timeout > 0 && private_socket == NULL)
+                setup_idle_exit (connection);
+
         daemon = daemon_new ();
         if (daemon == NULL) {
                 g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
                              "Failed to initialize daemon");
                 goto out;
         }
+        daemon_instance = daemon;
+
+        if (enumerate_users)
+                daemon_enable_enumeration (daemon,
+                                           (uid_t) enumerate_uid_min,
+                                           (uid_t) enumerate_uid_max,
+                                           (guint) enumerate_max_users);
+
+        if (private_socket != NULL &&
+            !daemon_listen_private (daemon, private_socket, error))
+                goto out;
 
         openlog ("accounts-daemon", LOG_PID, LOG_DAEMON);
         syslog (LOG_INFO, "started daemon version %s", VERSION);
@@ -143,6 +354,15 @@ on_signal_quit (gpointer data)
         return FALSE;
 }
 
+static gboolean
+on_signal_dump_stats (gpointer data)
+{
+        if (daemon_instance != NULL)
+                daemon_dump_stats (daemon_instance);
+
+        return TRUE;
+}
+
 int
 main (int argc, char *argv[])
 {
@@ -156,6 +376,12 @@ main (int argc, char *argv[])
                 { "version", 0, 0, G_OPTION_ARG_NONE, &show_version, N_("Output version information and exit"), NULL },
                 { "replace", 0, 0, G_OPTION_ARG_NONE, &replace, N_("Replace existing instance"), NULL },
                 { "debug", 0, 0, G_OPTION_ARG_NONE, &debug, N_("Enable debugging code"), NULL },
+                { "idle-timeout", 0, 0, G_OPTION_ARG_INT, &idle_timeout, N_("Exit after being idle for this many seconds"), N_("SECONDS") },
+                { "enumerate-users", 0, 0, G_OPTION_ARG_NONE, &enumerate_users, N_("Also list the users that the name service can enumerate"), NULL },
+                { "enumerate-uid-min", 0, 0, G_OPTION_ARG_INT, &enumerate_uid_min, N_("Lowest uid of enumerated users"), N_("UID") },
+                { "enumerate-uid-max", 0, 0, G_OPTION_ARG_INT, &enumerate_uid_max, N_("Highest uid of enumerated users"), N_("UID") },
+                { "enumerate-max-users", 0, 0, G_OPTION_ARG_INT, &enumerate_max_users, N_("Maximum number of enumerated users"), N_("COUNT") },
+                { "private-socket", 0, 0, G_OPTION_ARG_FILENAME, &private_socket, N_("Also accept connections from root on this socket"), N_("PATH") },
 
                 { NULL }
         };
@@ -187,6 +413,17 @@ main (int argc, char *argv[])
         }
         g_option_context_free (context);
 
+        if (enumerate_uid_min < 0 || enumerate_uid_max < 0 || enumerate_max_users < 0) {
+                g_warning ("--enumerate-uid-min, --enumerate-uid-max and --enumerate-max-users must not be negative");
+                goto out;
+        }
+
+        if (enumerate_uid_min > enumerate_uid_max) {
+                g_warning ("--enumerate-uid-min (%d) is larger than --enumerate-uid-max (%d)",
+                           enumerate_uid_min, enumerate_uid_max);
+                goto out;
+        }
+
         if (show_version) {
                 g_print ("accounts-daemon " VERSION "\n");
                 ret = 0;
@@ -201,19 +438,20 @@ main (int argc, char *argv[])
         flags = G_BUS_NAME_OWNER_FLAGS_ALLOW_REPLACEMENT;
         if (replace)
                 flags |= G_BUS_NAME_OWNER_FLAGS_REPLACE;
-        g_bus_own_name (G_BUS_TYPE_SYSTEM,
-                        NAME_TO_CLAIM,
-                        flags,
-                        on_bus_acquired,
-                        NULL,
-                        on_name_lost,
-                        NULL,
-                        NULL);
+        owner_id = g_bus_own_name (G_BUS_TYPE_SYSTEM,
+                                   NAME_TO_CLAIM,
+                                   flags,
+                                   on_bus_acquired,
+                                   NULL,
+                                   on_name_lost,
+                                   NULL,
+                                   NULL);
 
         loop = g_main_loop_new (NULL, FALSE);
 
         g_unix_signal_add (SIGINT, on_signal_quit, loop);
         g_unix_signal_add (SIGTERM, on_signal_quit, loop);
+        g_unix_signal_add (SIGUSR1, on_signal_dump_stats, NULL);
 
         g_debug ("entering main loop");
         g_main_loop_run (loop);
@@ -0,0 +1,50 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * Copyright (C) 2015 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __MEMORY_STATS_H__
+#define __MEMORY_STATS_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* What the daemon reports its memory use by; see daemon_dump_stats().
+ * The sizes only cover what the daemon allocates itself, not the
+ * bookkeeping of GLib and GDBus around it.
+ */
+typedef enum {
+        MEMORY_USER_OBJECTS,
+        MEMORY_STRINGS,
+        MEMORY_KEYFILES,
+        MEMORY_LOGIN_HISTORY,
+        MEMORY_SKELETONS,
+        MEMORY_EXTENSIONS,
+        MEMORY_PROPERTY_SNAPSHOTS,
+        MEMORY_HASH_TABLES,
+        N_MEMORY_CATEGORIES
+} MemoryCategory;
+
+typedef struct {
+        guint64 count;
+        guint64 size;
+} MemoryUsage;
+
+G_END_DECLS
+
+#endif /* __MEMORY_STATS_H__ */
@@ -0,0 +1,668 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * Copyright (C) 2015 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include <glib.h>
+#include <gio/gio.h>
+
+#include "property-cache.h"
+#include "request-scheduler.h"
+#include "latency-stats.h"
+
+/* Answers Properties.Get and GetAll for the user objects on worker
+ * threads, so that reading properties does not have to wait for the
+ * main loop while it is busy with a reload or a write.
+ *
+ * Each object has an immutable snapshot of its readable properties.
+ * It maps interface names to ready-made, serialized GetAll reply
+ * bodies, so that GetAll is answered by reference.  Snapshots are
+ * built on the main thread when an object is first read, and dropped
+ * whenever the object changes; the next read builds a new one.
+ *
+ * A dropped snapshot is marked stale under the lock.  A reply is only
+ * sent from a snapshot that is not stale, also under the lock, so a
+ * reply can never be sent after the change signal of a later value:
+ * the signal is emitted after the snapshot is dropped.  Reads that
+ * find their snapshot stale are answered on the main thread instead.
+ *
+ * Only reads of known objects and interfaces are handled here; the
+ * rest go through the main loop as usual.  Objects are known for each
+ * connection they are exported on, as user objects are only exported
+ * once a client asks for them.  Reads are throttled by the
+ * request scheduler like method calls.
+ *
+ * A property can be watched on an object, to learn when a client
+ * reads it: the next read of it calls the read func on the main
+ * thread, once.
+ */
+
+typedef struct {
+        gint        ref_count;
+        gboolean    stale;      /* under the lock */
+        GHashTable *replies;    /* interface -> (a{sv}) */
+} Snapshot;
+
+typedef struct {
+        PropertyCache   *cache;
+        GDBusConnection *connection;
+        GDBusMessage    *message;
+        Snapshot        *snapshot;      /* NULL until there is one */
+        gint64           received;
+} ReadRequest;
+
+struct PropertyCache {
+        GMutex       lock;
+        GHashTable  *objects;           /* connection -> object path set */
+        GHashTable  *interfaces;        /* interface names */
+        GHashTable  *snapshots;         /* object path -> Snapshot */
+        GHashTable  *watches;           /* object path -> "interface\nproperty" */
+        GThreadPool *pool;
+        RequestScheduler *scheduler;
+
+        GMainContext *context;
+        PropertyCacheBuildFunc build_func;
+        gpointer     build_data;
+        PropertyCacheReadFunc read_func;
+        gpointer     read_data;
+};
+
+typedef struct {
+        PropertyCache *cache;
+        gchar         *object_path;
+} WatchHit;
+
+static Snapshot *
+snapshot_ref (Snapshot *snapshot)
+{
+        g_atomic_int_inc (&snapshot->ref_count);
+        return snapshot;
+}
+
+static void
+snapshot_unref (Snapshot *snapshot)
+{
+        if (!g_atomic_int_dec_and_test (&snapshot->ref_count))
+                return;
+
+        g_hash_table_unref (snapshot->replies);
+        g_free (snapshot);
+}
+
+/* Destroy notify of the snapshot table, called with the lock held */
+static void
+snapshot_drop (Snapshot *snapshot)
+{
+        snapshot->stale = TRUE;
+        snapshot_unref (snapshot);
+}
+
+static void
+read_request_free (ReadRequest *request)
+{
+        if (request->snapshot != NULL)
+                snapshot_unref (request->snapshot);
+        g_object_unref (request->connection);
+        g_object_unref (request->message);
+        g_free (request);
+}
+
+static GDBusMessage *
+build_reply (ReadRequest *request)
+{
+        GDBusMessage *reply;
+        const gchar *interface_name;
+        const gchar *name;
+        GVariant *body;
+        GVariant *reply_body;
+        GVariant *properties;
+        GVariant *value;
+
+        body = g_dbus_message_get_body (request->message);
+        g_variant_get_child (body, 0, "&s", &interface_name);
+
+        if (request->snapshot == NULL)
+                return g_dbus_message_new_method_error (request->message,
+                                                        "org.freedesktop.DBus.Error.UnknownObject",
+                                                        "No such object path '%s'",
+                                                        g_dbus_message_get_path (request->message));
+
+        reply_body = g_hash_table_lookup (request->snapshot->replies, interface_name);
+        if (reply_body == NULL)
+                return g_dbus_message_new_method_error (request->message,
+                                                        "org.freedesktop.DBus.Error.UnknownInterface",
+                                                        "No such interface '%s'", interface_name);
+
+        if (strcmp (g_dbus_message_get_member (request->message), "GetAll") == 0) {
+                reply = g_dbus_message_new_method_reply (request->message);
+                g_dbus_message_set_body (reply, reply_body);
+                return reply;
+        }
+
+        g_variant_get_child (body, 1, "&s", &name);
+
+        properties = g_variant_get_child_value (reply_body, 0);
+        value = g_variant_lookup_value (properties, name, NULL);
+        g_variant_unref (properties);
+        if (value == NULL)
+                return g_dbus_message_new_method_error (request->message,
+                                                        "org.freedesktop.DBus.Error.InvalidArgs",
+                                                        "No such property '%s'", name);
+
+        reply = g_dbus_message_new_method_reply (request->message);
+        g_dbus_message_set_body (reply, g_variant_new ("(v)", value));
+        g_variant_unref (value);
+
+        return reply;
+}
+
+static void
+send_reply (ReadRequest  *request,
+            GDBusMessage *reply,
+            gint64        start_time)
+{
+        const gchar *method;
+
+        g_dbus_connection_send_message (request->connection, reply,
+                                        G_DBUS_SEND_MESSAGE_FLAGS_NONE, NULL, NULL);
+
+        method = strcmp (g_dbus_message_get_member (request->message), "GetAll") == 0 ?
+                 "org.freedesktop.DBus.Properties.GetAll" : "org.freedesktop.DBus.Properties.Get";
+        /* The total is recorded by the latency stats filter */
+        latency_stats_record (method, LATENCY_PHASE_QUEUED, start_time - request->received);
+}
+
+/* Answers a read whose snapshot is missing or stale, building a new
+ * one first.  Nothing else changes snapshots on the main thread, so
+ * the new one is current.
+ */
+/* Called with the lock held */
+static gboolean
+is_known_object (PropertyCache   *cache,
+                 GDBusConnection *connection,
+                 const gchar     *object_path)
+{
+        GHashTable *objects;
+
+        objects = g_hash_table_lookup (cache->objects, connection);
+
+        return objects != NULL && g_hash_table_contains (objects, object_path);
+}
+
+static gboolean
+answer_on_main (gpointer data)
+{
+        ReadRequest *request = data;
+        PropertyCache *cache = request->cache;
+        const gchar *object_path;
+        GDBusMessage *reply;
+        gint64 start_time;
+
+        start_time = g_get_monotonic_time ();
+        object_path = g_dbus_message_get_path (request->message);
+
+        g_clear_pointer (&request->snapshot, snapshot_unref);
+
+        g_mutex_lock (&cache->lock);
+        if (!g_hash_table_contains (cache->snapshots, object_path) &&
+            is_known_object (cache, request->connection, object_path)) {
+                g_mutex_unlock (&cache->lock);
+                cache->build_func (object_path, cache->build_data);
+                g_mutex_lock (&cache->lock);
+        }
+        request->snapshot = g_hash_table_lookup (cache->snapshots, object_path);
+        if (request->snapshot != NULL)
+                snapshot_ref (request->snapshot);
+        g_mutex_unlock (&cache->lock);
+
+        reply = build_reply (request);
+        send_reply (request, reply, start_time);
+        g_object_unref (reply);
+
+        return G_SOURCE_REMOVE;
+}
+
+static void
+queue_answer_on_main (ReadRequest *request)
+{
+        g_main_context_invoke_full (request->cache->context,
+                                    G_PRIORITY_DEFAULT,
+                                    answer_on_main,
+                                    request,
+                                    (GDestroyNotify) read_request_free);
+}
+
+static void
+handle_read (gpointer data,
+             gpointer user_data)
+{
+        PropertyCache *cache = user_data;
+        ReadRequest *request = data;
+        GDBusMessage *reply;
+        gint64 start_time;
+
+        start_time = g_get_monotonic_time ();
+
+        reply = build_reply (request);
+
+        g_mutex_lock (&cache->lock);
+        if (request->snapshot->stale) {
+                g_mutex_unlock (&cache->lock);
+                g_object_unref (reply);
+                queue_answer_on_main (request);
+                return;
+        }
+        send_reply (request, reply, start_time);
+        g_mutex_unlock (&cache->lock);
+
+        g_object_unref (reply);
+        read_request_free (request);
+}
+
+static gboolean
+report_watch_hit (gpointer data)
+{
+        WatchHit *hit = data;
+
+        hit->cache->read_func (hit->object_path, hit->cache->read_data);
+
+        return G_SOURCE_REMOVE;
+}
+
+static void
+watch_hit_free (WatchHit *hit)
+{
+        g_free (hit->object_path);
+        g_free (hit);
+}
+
+/* Called with the lock held */
+static void
+check_watch (PropertyCache *cache,
+             const gchar   *object_path,
+             const gchar   *interface_name,
+             const gchar   *property_name)
+{
+        const gchar *watch;
+        gsize length;
+        WatchHit *hit;
+
+        watch = g_hash_table_lookup (cache->watches, object_path);
+        if (watch == NULL)
+                return;
+
+        length = strlen (interface_name);
+        if (strncmp (watch, interface_name, length) != 0 || watch[length] != '\n')
+                return;
+        if (property_name != NULL && strcmp (watch + length + 1, property_name) != 0)
+                return;
+
+        g_hash_table_remove (cache->watches, object_path);
+
+        hit = g_new0 (WatchHit, 1);
+        hit->cache = cache;
+        hit->object_path = g_strdup (object_path);
+        g_main_context_invoke_full (cache->context,
+                                    G_PRIORITY_DEFAULT,
+                                    report_watch_hit,
+                                    hit,
+                                    (GDestroyNotify) watch_hit_free);
+}
+
+static void
+start_read (ReadRequest *request)
+{
+        if (request->snapshot != NULL)
+                g_thread_pool_push (request->cache->pool, request, NULL);
+        else
+                queue_answer_on_main (request);
+}
+
+/* Runs on the GDBus worker thread */
+static GDBusMessage *
+read_filter (GDBusConnection *connection,
+             GDBusMessage    *message,
+             gboolean         incoming,
+             gpointer         user_data)
+{
+        PropertyCache *cache = user_data;
+        ReadRequest *request;
+        Snapshot *snapshot;
+        GDBusMessage *reply;
+        GVariant *body;
+        const gchar *member;
+        const gchar *object_path;
+        const gchar *interface_name;
+        const gchar *property_name = NULL;
+
+        if (!incoming ||
+            g_dbus_message_get_message_type (message) != G_DBUS_MESSAGE_TYPE_METHOD_CALL ||
+            (g_dbus_message_get_flags (message) & G_DBUS_MESSAGE_FLAGS_NO_REPLY_EXPECTED) != 0 ||
+            g_strcmp0 (g_dbus_message_get_interface (message), "org.freedesktop.DBus.Properties") != 0)
+                return message;
+
+        member = g_dbus_message_get_member (message);
+        body = g_dbus_message_get_body (message);
+
+        if (strcmp (member, "Get") == 0) {
+                if (body == NULL || !g_variant_is_of_type (body, G_VARIANT_TYPE ("(ss)")))
+                        return message;
+        }
+        else if (strcmp (member, "GetAll") == 0) {
+                if (body == NULL || !g_variant_is_of_type (body, G_VARIANT_TYPE ("(s)")))
+                        return message;
+        }
+        else {
+                return message;
+        }
+
+        g_variant_get_child (body, 0, "&s", &interface_name);
+        if (strcmp (member, "Get") == 0)
+                g_variant_get_child (body, 1, "&s", &property_name);
+        object_path = g_dbus_message_get_path (message);
+
+        g_mutex_lock (&cache->lock);
+        if (!is_known_object (cache, connection, object_path) ||
+            !g_hash_table_contains (cache->interfaces, interface_name)) {
+                g_mutex_unlock (&cache->lock);
+                return message;
+        }
+        check_watch (cache, object_path, interface_name, property_name);
+        snapshot = g_hash_table_lookup (cache->snapshots, object_path);
+        if (snapshot != NULL)
+                snapshot_ref (snapshot);
+        g_mutex_unlock (&cache->lock);
+
+        request = g_new0 (ReadRequest, 1);
+        request->cache = cache;
+        request->connection = g_object_ref (connection);
+        request->message = message;
+        request->snapshot = snapshot;
+        request->received = g_get_monotonic_time ();
+
+        switch (request_scheduler_admit (cache->scheduler, connection,
+                                         g_dbus_message_get_sender (message),
+                                         REQUEST_PRIORITY_NORMAL,
+                                         (RequestFunc) start_read, request,
+                                         (GDestroyNotify) read_request_free)) {
+        case REQUEST_ADMITTED:
+                start_read (request);
+                break;
+        case REQUEST_QUEUED:
+                break;
+        case REQUEST_REJECTED:
+                reply = g_dbus_message_new_method_error (message,
+                                                         "org.freedesktop.DBus.Error.LimitsExceeded",
+                                                         "Too many requests");
+                g_dbus_connection_send_message (connection, reply,
+                                                G_DBUS_SEND_MESSAGE_FLAGS_NONE, NULL, NULL);
+                g_object_unref (reply);
+                read_request_free (request);
+                break;
+        }
+
+        /* Taken over by the request */
+        return NULL;
+}
+
+PropertyCache *
+property_cache_new (RequestScheduler *scheduler)
+{
+        PropertyCache *cache;
+
+        cache = g_new0 (PropertyCache, 1);
+        cache->scheduler = scheduler;
+        g_mutex_init (&cache->lock);
+        cache->objects = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+                                                NULL, (GDestroyNotify) g_hash_table_unref);
+        cache->interfaces = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+        cache->snapshots = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                  g_free, (GDestroyNotify) snapshot_drop);
+        cache->watches = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+        cache->pool = g_thread_pool_new (handle_read, cache,
+                                         g_get_num_processors (), FALSE, NULL);
+        cache->context = g_main_context_ref_thread_default ();
+
+        return cache;
+}
+
+void
+property_cache_free (PropertyCache *cache)
+{
+        /* Lets queued reads finish */
+        g_thread_pool_free (cache->pool, FALSE, TRUE);
+        g_hash_table_unref (cache->snapshots);
+        g_hash_table_unref (cache->watches);
+        g_hash_table_unref (cache->interfaces);
+        g_hash_table_unref (cache->objects);
+        g_main_context_unref (cache->context);
+        g_mutex_clear (&cache->lock);
+        g_free (cache);
+}
+
+/* Must be called for every connection the user objects are exported
+ * on; the cache has to outlive the connection.  Filters added after
+ * this one do not see the reads the cache answers, only the replies.
+ */
+void
+property_cache_attach (PropertyCache   *cache,
+                       GDBusConnection *connection)
+{
+        g_mutex_lock (&cache->lock);
+        g_hash_table_insert (cache->objects, connection,
+                             g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL));
+        g_mutex_unlock (&cache->lock);
+
+        g_dbus_connection_add_filter (connection, read_filter, cache, NULL);
+}
+
+/* Called when @connection is closed */
+void
+property_cache_detach (PropertyCache   *cache,
+                       GDBusConnection *connection)
+{
+        g_mutex_lock (&cache->lock);
+        g_hash_table_remove (cache->objects, connection);
+        g_mutex_unlock (&cache->lock);
+}
+
+/* @func is called on the thread that created the cache when a read
+ * finds no snapshot for a known object.  It is expected to call
+ * property_cache_set() before it returns.
+ */
+void
+property_cache_set_build_func (PropertyCache          *cache,
+                               PropertyCacheBuildFunc  func,
+                               gpointer                user_data)
+{
+        cache->build_func = func;
+        cache->build_data = user_data;
+}
+
+/* @func is called on the thread that created the cache when a client
+ * reads a watched property.
+ */
+void
+property_cache_set_read_func (PropertyCache         *cache,
+                              PropertyCacheReadFunc  func,
+                              gpointer               user_data)
+{
+        cache->read_func = func;
+        cache->read_data = user_data;
+}
+
+/* Lets the cache answer reads of @interface_name on known objects.
+ * Every snapshot must contain all of these interfaces.
+ */
+void
+property_cache_add_interface (PropertyCache *cache,
+                              const gchar   *interface_name)
+{
+        g_mutex_lock (&cache->lock);
+        if (!g_hash_table_contains (cache->interfaces, interface_name))
+                g_hash_table_add (cache->interfaces, g_strdup (interface_name));
+        g_mutex_unlock (&cache->lock);
+}
+
+/* Lets the cache answer reads of @object_path on @connection, once it
+ * is exported there.  No snapshot is built until the object is first
+ * read.
+ */
+void
+property_cache_add (PropertyCache   *cache,
+                    GDBusConnection *connection,
+                    const gchar     *object_path)
+{
+        GHashTable *objects;
+
+        g_mutex_lock (&cache->lock);
+        objects = g_hash_table_lookup (cache->objects, connection);
+        if (objects != NULL && !g_hash_table_contains (objects, object_path))
+                g_hash_table_add (objects, g_strdup (object_path));
+        g_mutex_unlock (&cache->lock);
+}
+
+/* Replaces the snapshot of @object_path with @properties, an
+ * a{sa{sv}} of interface name to properties.  Reads that already
+ * started with the old one are answered on the main thread instead.
+ */
+void
+property_cache_set (PropertyCache *cache,
+                    const gchar   *object_path,
+                    GVariant      *properties)
+{
+        Snapshot *snapshot;
+        GVariantIter iter;
+        GVariant *interface_properties;
+        GVariant *reply_body;
+        gchar *interface_name;
+
+        g_return_if_fail (g_variant_is_of_type (properties, G_VARIANT_TYPE ("a{sa{sv}}")));
+
+        g_variant_ref_sink (properties);
+
+        snapshot = g_new0 (Snapshot, 1);
+        snapshot->ref_count = 1;
+        snapshot->replies = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                   g_free, (GDestroyNotify) g_variant_unref);
+
+        g_variant_iter_init (&iter, properties);
+        while (g_variant_iter_next (&iter, "{s@a{sv}}", &interface_name, &interface_properties)) {
+                reply_body = g_variant_ref_sink (g_variant_new ("(@a{sv})", interface_properties));
+
+                /* Serialize now, rather than for every reply */
+                g_variant_get_data (reply_body);
+
+                g_hash_table_insert (snapshot->replies, interface_name, reply_body);
+                g_variant_unref (interface_properties);
+        }
+
+        g_variant_unref (properties);
+
+        g_mutex_lock (&cache->lock);
+        g_hash_table_replace (cache->snapshots, g_strdup (object_path), snapshot);
+        g_mutex_unlock (&cache->lock);
+}
+
+/* Drops the snapshot of @object_path, which has changed.  This must
+ * happen before the change is signalled.
+ */
+void
+property_cache_invalidate (PropertyCache *cache,
+                           const gchar   *object_path)
+{
+        g_mutex_lock (&cache->lock);
+        g_hash_table_remove (cache->snapshots, object_path);
+        g_mutex_unlock (&cache->lock);
+}
+
+/* Watches @property_name of @object_path until a client reads it,
+ * either on its own or with the rest of @interface_name.  An object
+ * has at most one watch; it stays in place when the snapshot changes.
+ */
+void
+property_cache_watch (PropertyCache *cache,
+                      const gchar   *object_path,
+                      const gchar   *interface_name,
+                      const gchar   *property_name)
+{
+        g_return_if_fail (cache->read_func != NULL);
+
+        g_mutex_lock (&cache->lock);
+        g_hash_table_replace (cache->watches,
+                              g_strdup (object_path),
+                              g_strdup_printf ("%s\n%s", interface_name, property_name));
+        g_mutex_unlock (&cache->lock);
+}
+
+/* Forgets @object_path on every connection; its reads go through the
+ * main loop again.
+ */
+void
+property_cache_remove (PropertyCache *cache,
+                       const gchar   *object_path)
+{
+        GHashTableIter iter;
+        GHashTable *objects;
+
+        g_mutex_lock (&cache->lock);
+        g_hash_table_remove (cache->snapshots, object_path);
+        g_hash_table_remove (cache->watches, object_path);
+        g_hash_table_iter_init (&iter, cache->objects);
+        while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&objects))
+                g_hash_table_remove (objects, object_path);
+        g_mutex_unlock (&cache->lock);
+}
+
+/* Drops all snapshots, e.g. to save memory; they are built again as
+ * the objects are read.
+ */
+void
+property_cache_clear (PropertyCache *cache)
+{
+        g_mutex_lock (&cache->lock);
+        g_hash_table_remove_all (cache->snapshots);
+        g_mutex_unlock (&cache->lock);
+}
+
+/* Counts the snapshots and the size of their serialized replies */
+void
+property_cache_get_stats (PropertyCache *cache,
+                          guint         *n_snapshots,
+                          guint64       *size)
+{
+        GHashTableIter iter;
+        GHashTableIter replies;
+        Snapshot *snapshot;
+        GVariant *reply_body;
+
+        *size = 0;
+
+        g_mutex_lock (&cache->lock);
+        *n_snapshots = g_hash_table_size (cache->snapshots);
+        g_hash_table_iter_init (&iter, cache->snapshots);
+        while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&snapshot)) {
+                g_hash_table_iter_init (&replies, snapshot->replies);
+                while (g_hash_table_iter_next (&replies, NULL, (gpointer *)&reply_body))
+                        *size += g_variant_get_size (reply_body);
+        }
+        g_mutex_unlock (&cache->lock);
+}
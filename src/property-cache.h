@@ -0,0 +1,75 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * Copyright (C) 2015 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __PROPERTY_CACHE_H__
+#define __PROPERTY_CACHE_H__
+
+#include <glib.h>
+#include <gio/gio.h>
+
+#include "request-scheduler.h"
+
+G_BEGIN_DECLS
+
+typedef struct PropertyCache PropertyCache;
+
+typedef void (*PropertyCacheBuildFunc) (const gchar *object_path,
+                                        gpointer     user_data);
+typedef void (*PropertyCacheReadFunc)  (const gchar *object_path,
+                                        gpointer     user_data);
+
+PropertyCache * property_cache_new              (RequestScheduler *scheduler);
+void            property_cache_free             (PropertyCache   *cache);
+
+void            property_cache_attach           (PropertyCache   *cache,
+                                                 GDBusConnection *connection);
+void            property_cache_detach           (PropertyCache   *cache,
+                                                 GDBusConnection *connection);
+void            property_cache_set_build_func   (PropertyCache          *cache,
+                                                 PropertyCacheBuildFunc  func,
+                                                 gpointer                user_data);
+void            property_cache_set_read_func    (PropertyCache          *cache,
+                                                 PropertyCacheReadFunc   func,
+                                                 gpointer                user_data);
+void            property_cache_add_interface    (PropertyCache   *cache,
+                                                 const gchar     *interface_name);
+
+void            property_cache_add              (PropertyCache   *cache,
+                                                 GDBusConnection *connection,
+                                                 const gchar     *object_path);
+void            property_cache_set              (PropertyCache   *cache,
+                                                 const gchar     *object_path,
+                                                 GVariant        *properties);
+void            property_cache_invalidate       (PropertyCache   *cache,
+                                                 const gchar     *object_path);
+void            property_cache_watch            (PropertyCache   *cache,
+                                                 const gchar     *object_path,
+                                                 const gchar     *interface_name,
+                                                 const gchar     *property_name);
+void            property_cache_remove           (PropertyCache   *cache,
+                                                 const gchar     *object_path);
+void            property_cache_clear            (PropertyCache   *cache);
+
+void            property_cache_get_stats        (PropertyCache   *cache,
+                                                 guint           *n_snapshots,
+                                                 guint64         *size);
+
+G_END_DECLS
+
+#endif /* __PROPERTY_CACHE_H__ */
@@ -0,0 +1,429 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * Copyright (C) 2015 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/* Caches NSS lookups of users.  With sssd or LDAP behind NSS every
+ * lookup can take milliseconds, and some of them are repeated a lot,
+ * e.g. FindUserByName for mistyped logins or the lookups done for
+ * each cached user on every reload.
+ *
+ * Users that were found are kept for POSITIVE_TTL, failed lookups
+ * for NEGATIVE_TTL.  The cache is shared by the worker threads that
+ * read the user sources, and is flushed when the passwd, shadow or
+ * group files change.
+ */
+
+#include "config.h"
+
+#include <glib.h>
+
+#include "pwent-cache.h"
+#include "util.h"
+
+#define POSITIVE_TTL (5 * 60 * G_USEC_PER_SEC)
+#define NEGATIVE_TTL (30 * G_USEC_PER_SEC)
+#define MAX_ENTRIES  4096
+
+/* Lookups of many users are spread over this many threads.  If none
+ * of them finishes within LOOKUP_TIMEOUT, the rest are given up on.
+ * The timeout is for the batch making no progress, not for each
+ * lookup: with all threads stuck on a dead server, queued lookups
+ * would never start, so a per-lookup timeout could not fire for them.
+ */
+#define MAX_LOOKUP_THREADS 8
+#define LOOKUP_TIMEOUT     (5 * G_USEC_PER_SEC)
+
+typedef struct {
+        gpointer       key;
+        struct passwd *pwent;   /* NULL if the user does not exist */
+        gint64         expires;
+        GList          link;
+} CacheEntry;
+
+typedef struct {
+        GHashTable *entries;
+        GQueue      lru;        /* most recently used first */
+} CacheTable;
+
+static GMutex lock;
+static CacheTable by_name;
+static CacheTable by_uid;
+static guint generation;
+static guint64 hits;
+static guint64 misses;
+
+typedef struct {
+        gint            ref_count;
+        GCond           cond;
+        struct passwd **results;
+        gboolean       *done;
+        guint           pending;
+        gboolean        abandoned;
+        gint64          last_progress;
+} LookupBatch;
+
+typedef struct {
+        LookupBatch *batch;
+        guint        index;
+        gchar       *name;
+} LookupJob;
+
+static GThreadPool *lookup_pool;
+
+static void
+cache_entry_free (CacheEntry *entry)
+{
+        g_free (entry->pwent);
+        g_free (entry);
+}
+
+static void
+ensure_tables (void)
+{
+        if (by_name.entries != NULL)
+                return;
+
+        by_name.entries = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+        by_uid.entries = g_hash_table_new (g_direct_hash, g_direct_equal);
+}
+
+static void
+cache_table_remove (CacheTable *table,
+                    CacheEntry *entry)
+{
+        g_queue_unlink (&table->lru, &entry->link);
+        g_hash_table_remove (table->entries, entry->key);
+        cache_entry_free (entry);
+}
+
+static void
+cache_table_clear (CacheTable *table)
+{
+        CacheEntry *entry;
+
+        while ((entry = g_queue_peek_tail (&table->lru)) != NULL)
+                cache_table_remove (table, entry);
+}
+
+/* Returns TRUE if @key is cached, with a copy of the entry in @pwent */
+static gboolean
+cache_table_lookup (CacheTable     *table,
+                    gconstpointer   key,
+                    struct passwd **pwent)
+{
+        CacheEntry *entry;
+
+        entry = g_hash_table_lookup (table->entries, key);
+        if (entry == NULL)
+                return FALSE;
+
+        if (entry->expires < g_get_monotonic_time ()) {
+                cache_table_remove (table, entry);
+                return FALSE;
+        }
+
+        g_queue_unlink (&table->lru, &entry->link);
+        g_queue_push_head_link (&table->lru, &entry->link);
+
+        *pwent = entry->pwent != NULL ? copy_pwent (entry->pwent) : NULL;
+
+        return TRUE;
+}
+
+static void
+cache_table_insert (CacheTable          *table,
+                    gpointer             key,
+                    const struct passwd *pwent)
+{
+        CacheEntry *entry;
+
+        entry = g_hash_table_lookup (table->entries, key);
+        if (entry != NULL)
+                cache_table_remove (table, entry);
+
+        /* Evict the least recently used entries */
+        while (g_queue_get_length (&table->lru) >= MAX_ENTRIES)
+                cache_table_remove (table, g_queue_peek_tail (&table->lru));
+
+        entry = g_new0 (CacheEntry, 1);
+        entry->key = key;
+        entry->pwent = pwent != NULL ? copy_pwent (pwent) : NULL;
+        entry->expires = g_get_monotonic_time () + (pwent != NULL ? POSITIVE_TTL : NEGATIVE_TTL);
+        entry->link.data = entry;
+
+        g_hash_table_insert (table->entries, key, entry);
+        g_queue_push_head_link (&table->lru, &entry->link);
+}
+
+static void
+add_result (const gchar         *name,
+            uid_t                uid,
+            const struct passwd *pwent,
+            guint                lookup_generation)
+{
+        /* Don't cache what was looked up before an invalidation */
+        if (lookup_generation != generation)
+                return;
+
+        if (pwent != NULL) {
+                cache_table_insert (&by_name, g_strdup (pwent->pw_name), pwent);
+                cache_table_insert (&by_uid, GUINT_TO_POINTER (pwent->pw_uid), pwent);
+        }
+
+        /* NSS may have canonicalized the name */
+        if (name != NULL && (pwent == NULL || g_strcmp0 (name, pwent->pw_name) != 0))
+                cache_table_insert (&by_name, g_strdup (name), pwent);
+        else if (name == NULL && pwent == NULL)
+                cache_table_insert (&by_uid, GUINT_TO_POINTER (uid), NULL);
+}
+
+/* Like lookup_pwent_by_name(); free the result with g_free() */
+struct passwd *
+pwent_cache_lookup_name (const gchar *name)
+{
+        struct passwd *pwent;
+        guint lookup_generation;
+
+        g_mutex_lock (&lock);
+        ensure_tables ();
+        if (cache_table_lookup (&by_name, name, &pwent)) {
+                hits++;
+                g_mutex_unlock (&lock);
+                return pwent;
+        }
+        misses++;
+        lookup_generation = generation;
+        g_mutex_unlock (&lock);
+
+        /* Not under the lock, this may be slow */
+        pwent = lookup_pwent_by_name (name);
+
+        g_mutex_lock (&lock);
+        add_result (name, 0, pwent, lookup_generation);
+        g_mutex_unlock (&lock);
+
+        return pwent;
+}
+
+/* Like lookup_pwent_by_uid(); free the result with g_free() */
+struct passwd *
+pwent_cache_lookup_uid (uid_t uid)
+{
+        struct passwd *pwent;
+        guint lookup_generation;
+
+        g_mutex_lock (&lock);
+        ensure_tables ();
+        if (cache_table_lookup (&by_uid, GUINT_TO_POINTER (uid), &pwent)) {
+                hits++;
+                g_mutex_unlock (&lock);
+                return pwent;
+        }
+        misses++;
+        lookup_generation = generation;
+        g_mutex_unlock (&lock);
+
+        pwent = lookup_pwent_by_uid (uid);
+
+        g_mutex_lock (&lock);
+        add_result (NULL, uid, pwent, lookup_generation);
+        g_mutex_unlock (&lock);
+
+        return pwent;
+}
+
+void
+pwent_cache_invalidate (void)
+{
+        g_mutex_lock (&lock);
+        ensure_tables ();
+
+        g_debug ("flushing %u cached users (%" G_GUINT64_FORMAT " hits, %" G_GUINT64_FORMAT " misses)",
+                 g_hash_table_size (by_name.entries), hits, misses);
+
+        cache_table_clear (&by_name);
+        cache_table_clear (&by_uid);
+        generation++;
+        g_mutex_unlock (&lock);
+}
+
+void
+pwent_cache_get_stats (guint64 *hits_out,
+                       guint64 *misses_out)
+{
+        g_mutex_lock (&lock);
+        *hits_out = hits;
+        *misses_out = misses;
+        g_mutex_unlock (&lock);
+}
+
+/* Returns the number of cached entries, by name and by uid */
+guint
+pwent_cache_get_size (void)
+{
+        guint size;
+
+        g_mutex_lock (&lock);
+        ensure_tables ();
+        size = g_hash_table_size (by_name.entries) + g_hash_table_size (by_uid.entries);
+        g_mutex_unlock (&lock);
+
+        return size;
+}
+
+/* Returns TRUE if @name is cached, with a copy of the entry in @pwent */
+static gboolean
+lookup_cached_name (const gchar    *name,
+                    struct passwd **pwent)
+{
+        gboolean found;
+
+        g_mutex_lock (&lock);
+        ensure_tables ();
+        found = cache_table_lookup (&by_name, name, pwent);
+        if (found)
+                hits++;
+        g_mutex_unlock (&lock);
+
+        return found;
+}
+
+/* Called with the lock held */
+static void
+lookup_batch_unref (LookupBatch *batch)
+{
+        if (--batch->ref_count > 0)
+                return;
+
+        g_cond_clear (&batch->cond);
+        g_free (batch->results);
+        g_free (batch->done);
+        g_free (batch);
+}
+
+static void
+run_lookup_job (gpointer data,
+                gpointer user_data)
+{
+        LookupJob *job = data;
+        LookupBatch *batch = job->batch;
+        struct passwd *pwent = NULL;
+
+        g_mutex_lock (&lock);
+        if (batch->abandoned) {
+                lookup_batch_unref (batch);
+                g_mutex_unlock (&lock);
+                goto out;
+        }
+        g_mutex_unlock (&lock);
+
+        /* Caches the result even if the batch gives up on it */
+        pwent = pwent_cache_lookup_name (job->name);
+
+        g_mutex_lock (&lock);
+        if (batch->abandoned) {
+                g_free (pwent);
+        }
+        else {
+                batch->results[job->index] = pwent;
+                batch->done[job->index] = TRUE;
+                batch->pending--;
+                batch->last_progress = g_get_monotonic_time ();
+                g_cond_signal (&batch->cond);
+        }
+        lookup_batch_unref (batch);
+        g_mutex_unlock (&lock);
+
+ out:
+        g_free (job->name);
+        g_free (job);
+}
+
+/* Looks up each of @names and adds the users that exist to @pwents,
+ * in order.  Names that are not cached are resolved on a bounded
+ * thread pool, so that a slow directory server costs its latency once
+ * rather than once per user.  Lookups still running after no other
+ * lookup has finished for LOOKUP_TIMEOUT are given up on; their names
+ * are added to @abandoned, if not NULL, since it is not known whether
+ * those users exist.
+ */
+void
+pwent_cache_lookup_names (GPtrArray *names,
+                          GPtrArray *pwents,
+                          GPtrArray *abandoned)
+{
+        LookupBatch *batch;
+        LookupJob *job;
+        struct passwd *pwent;
+        gint64 deadline;
+        guint i;
+
+        batch = g_new0 (LookupBatch, 1);
+        batch->ref_count = 1;
+        g_cond_init (&batch->cond);
+        batch->results = g_new0 (struct passwd *, names->len);
+        batch->done = g_new0 (gboolean, names->len);
+
+        g_mutex_lock (&lock);
+        if (lookup_pool == NULL)
+                lookup_pool = g_thread_pool_new (run_lookup_job, NULL,
+                                                 MAX_LOOKUP_THREADS, FALSE, NULL);
+        g_mutex_unlock (&lock);
+
+        for (i = 0; i < names->len; i++) {
+                if (lookup_cached_name (g_ptr_array_index (names, i), &pwent)) {
+                        batch->results[i] = pwent;
+                        batch->done[i] = TRUE;
+                        continue;
+                }
+
+                job = g_new0 (LookupJob, 1);
+                job->batch = batch;
+                job->index = i;
+                job->name = g_strdup (g_ptr_array_index (names, i));
+
+                g_mutex_lock (&lock);
+                batch->ref_count++;
+                batch->pending++;
+                g_mutex_unlock (&lock);
+
+                g_thread_pool_push (lookup_pool, job, NULL);
+        }
+
+        g_mutex_lock (&lock);
+        batch->last_progress = g_get_monotonic_time ();
+        while (batch->pending > 0) {
+                deadline = batch->last_progress + LOOKUP_TIMEOUT;
+                if (!g_cond_wait_until (&batch->cond, &lock, deadline) &&
+                    g_get_monotonic_time () >= batch->last_progress + LOOKUP_TIMEOUT) {
+                        g_warning ("Gave up on looking up %u users, the user database is not responding",
+                                   batch->pending);
+                        break;
+                }
+        }
+        batch->abandoned = TRUE;
+
+        for (i = 0; i < names->len; i++) {
+                if (batch->results[i] != NULL)
+                        g_ptr_array_add (pwents, batch->results[i]);
+                else if (!batch->done[i] && abandoned != NULL)
+                        g_ptr_array_add (abandoned, g_ptr_array_index (names, i));
+        }
+        lookup_batch_unref (batch);
+        g_mutex_unlock (&lock);
+}
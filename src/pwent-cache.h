@@ -0,0 +1,43 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * Copyright (C) 2015 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+
+#ifndef __PWENT_CACHE_H__
+#define __PWENT_CACHE_H__
+
+#include <sys/types.h>
+#include <pwd.h>
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+struct passwd * pwent_cache_lookup_name  (const gchar *name);
+struct passwd * pwent_cache_lookup_uid   (uid_t        uid);
+void            pwent_cache_lookup_names (GPtrArray   *names,
+                                          GPtrArray   *pwents,
+                                          GPtrArray   *abandoned);
+void            pwent_cache_invalidate   (void);
+void            pwent_cache_get_stats    (guint64     *hits,
+                                          guint64     *misses);
+guint           pwent_cache_get_size     (void);
+
+G_END_DECLS
+
+#endif /* __PWENT_CACHE_H__ */
@@ -0,0 +1,550 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * Copyright (C) 2015 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include <glib.h>
+#include <gio/gio.h>
+
+#include "request-scheduler.h"
+#include "latency-stats.h"
+
+/* Every sender has a bucket that fills up with tokens at BUCKET_RATE
+ * per second, to at most BUCKET_SIZE.  A method call takes the tokens
+ * of its priority class; if there are not enough, it is held back and
+ * dispatched later, interactive calls first.  A sender can have at
+ * most MAX_QUEUED calls held back; further ones are refused.
+ *
+ * Senders are thus throttled independently of each other, and the
+ * calls made at login are never stuck behind expensive ones.
+ *
+ * Property reads never reach g-authorize-method, so the connection
+ * filters that answer them call request_scheduler_admit() instead,
+ * from the GDBus worker thread; hence the lock.
+ */
+#define BUCKET_RATE 50
+#define BUCKET_SIZE 100
+#define MAX_QUEUED 256
+
+#define DISPATCH_INTERVAL 10            /* ms */
+#define SWEEP_INTERVAL 60               /* s */
+
+static const guint costs[N_REQUEST_PRIORITIES] = { 1, 1, 10 };
+
+/* Set on invocations replayed by dispatch_request(), which pass
+ * through g-authorize-method again.
+ */
+#define ADMITTED_KEY "accounts-request-admitted"
+
+typedef struct {
+        gchar  *sender;
+        gdouble tokens;
+        gint64  last_refill;
+        guint   n_queued;
+        guint   n_queued_class[N_REQUEST_PRIORITIES];
+} Bucket;
+
+/* Either a method call of @skeleton, or @func */
+typedef struct {
+        GDBusInterfaceSkeleton *skeleton;
+        GDBusMethodInvocation  *invocation;
+        RequestFunc             func;
+        gpointer                data;
+        GDestroyNotify          notify;
+        Bucket                 *bucket;
+        gint64                  queued_at;
+} Request;
+
+struct RequestScheduler {
+        GMutex       lock;
+        GMainContext *context;
+        GHashTable  *buckets;
+        GQueue       queues[N_REQUEST_PRIORITIES];
+        guint        dispatch_id;
+        guint        sweep_id;
+        RequestStats stats[N_REQUEST_PRIORITIES];
+};
+
+static RequestPriority
+get_priority (GDBusMethodInvocation *invocation)
+{
+        const gchar *interface_name;
+        const gchar *method_name;
+
+        interface_name = g_dbus_method_invocation_get_interface_name (invocation);
+        method_name = g_dbus_method_invocation_get_method_name (invocation);
+
+        if (g_strcmp0 (interface_name, "org.freedesktop.Accounts") != 0)
+                return REQUEST_PRIORITY_NORMAL;
+
+        if (strcmp (method_name, "ListCachedUsers") == 0 ||
+            strcmp (method_name, "FindUserByName") == 0 ||
+            strcmp (method_name, "FindUserById") == 0 ||
+            strcmp (method_name, "GetChangesSince") == 0)
+                return REQUEST_PRIORITY_INTERACTIVE;
+
+        if (strcmp (method_name, "CreateUser") == 0 ||
+            strcmp (method_name, "DeleteUser") == 0 ||
+            strcmp (method_name, "CacheUser") == 0 ||
+            strcmp (method_name, "UncacheUser") == 0 ||
+            strcmp (method_name, "OpenChangeJournal") == 0)
+                return REQUEST_PRIORITY_BACKGROUND;
+
+        return REQUEST_PRIORITY_NORMAL;
+}
+
+static void
+bucket_free (Bucket *bucket)
+{
+        g_free (bucket->sender);
+        g_free (bucket);
+}
+
+static void
+refill_bucket (Bucket *bucket,
+               gint64  now)
+{
+        bucket->tokens += (gdouble) (now - bucket->last_refill) * BUCKET_RATE / G_USEC_PER_SEC;
+        bucket->tokens = MIN (bucket->tokens, BUCKET_SIZE);
+        bucket->last_refill = now;
+}
+
+static guint
+add_timeout (RequestScheduler *scheduler,
+             GSource          *source,
+             GSourceFunc       func)
+{
+        guint id;
+
+        g_source_set_callback (source, func, scheduler, NULL);
+        id = g_source_attach (source, scheduler->context);
+        g_source_unref (source);
+
+        return id;
+}
+
+static void
+remove_timeout (RequestScheduler *scheduler,
+                guint             id)
+{
+        g_source_destroy (g_main_context_find_source_by_id (scheduler->context, id));
+}
+
+static gboolean
+sweep_buckets (gpointer user_data)
+{
+        RequestScheduler *scheduler = user_data;
+        GHashTableIter iter;
+        Bucket *bucket;
+        gint64 now;
+        gboolean pending;
+
+        now = g_get_monotonic_time ();
+
+        g_mutex_lock (&scheduler->lock);
+
+        /* A full bucket is the same as none */
+        g_hash_table_iter_init (&iter, scheduler->buckets);
+        while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&bucket)) {
+                refill_bucket (bucket, now);
+                if (bucket->n_queued == 0 && bucket->tokens >= BUCKET_SIZE)
+                        g_hash_table_iter_remove (&iter);
+        }
+
+        pending = g_hash_table_size (scheduler->buckets) > 0;
+        if (!pending)
+                scheduler->sweep_id = 0;
+
+        g_mutex_unlock (&scheduler->lock);
+
+        return pending;
+}
+
+/* Peer-to-peer connections have no unique name */
+static gchar *
+get_sender_key (GDBusConnection *connection,
+                const gchar     *sender)
+{
+        if (sender == NULL)
+                return g_strdup_printf ("peer-%p", connection);
+
+        return g_strdup (sender);
+}
+
+/* Called with the lock held */
+static Bucket *
+get_bucket (RequestScheduler *scheduler,
+            const gchar      *sender)
+{
+        Bucket *bucket;
+
+        bucket = g_hash_table_lookup (scheduler->buckets, sender);
+        if (bucket == NULL) {
+                bucket = g_new0 (Bucket, 1);
+                bucket->sender = g_strdup (sender);
+                bucket->tokens = BUCKET_SIZE;
+                bucket->last_refill = g_get_monotonic_time ();
+                g_hash_table_insert (scheduler->buckets, bucket->sender, bucket);
+
+                if (scheduler->sweep_id == 0)
+                        scheduler->sweep_id = add_timeout (scheduler,
+                                                           g_timeout_source_new_seconds (SWEEP_INTERVAL),
+                                                           sweep_buckets);
+        }
+
+        return bucket;
+}
+
+static void
+dispatch_request (Request *request)
+{
+        GDBusMethodInvocation *invocation = request->invocation;
+        GDBusInterfaceVTable *vtable;
+
+        if (request->func != NULL) {
+                request->func (request->data);
+                g_free (request);
+                return;
+        }
+
+        latency_stats_add (invocation, LATENCY_PHASE_QUEUED,
+                           g_get_monotonic_time () - request->queued_at);
+        latency_stats_push_call (invocation);
+
+        g_object_set_data (G_OBJECT (invocation), ADMITTED_KEY, GINT_TO_POINTER (TRUE));
+
+        /* Hand the call to the skeleton's own handler, skipping the
+         * authorization step that held it back.  The handler takes
+         * over our reference to the invocation.
+         */
+        vtable = g_dbus_interface_skeleton_get_vtable (request->skeleton);
+        vtable->method_call (g_dbus_method_invocation_get_connection (invocation),
+                             g_dbus_method_invocation_get_sender (invocation),
+                             g_dbus_method_invocation_get_object_path (invocation),
+                             g_dbus_method_invocation_get_interface_name (invocation),
+                             g_dbus_method_invocation_get_method_name (invocation),
+                             g_dbus_method_invocation_get_parameters (invocation),
+                             invocation,
+                             request->skeleton);
+
+        latency_stats_pop_call ();
+
+        g_object_unref (request->skeleton);
+        g_free (request);
+}
+
+static void
+free_request (Request *request)
+{
+        if (request->func != NULL) {
+                if (request->notify != NULL)
+                        request->notify (request->data);
+        }
+        else {
+                /* Releases our reference to the invocation */
+                g_dbus_method_invocation_return_error (request->invocation,
+                                                       G_DBUS_ERROR,
+                                                       G_DBUS_ERROR_FAILED,
+                                                       "The daemon is exiting");
+                g_object_unref (request->skeleton);
+        }
+        g_free (request);
+}
+
+static gboolean
+dispatch_queued (gpointer user_data)
+{
+        RequestScheduler *scheduler = user_data;
+        Request *request;
+        GQueue ready = G_QUEUE_INIT;
+        GList *l, *next;
+        gint64 now;
+        gboolean pending = FALSE;
+        guint i;
+
+        now = g_get_monotonic_time ();
+
+        g_mutex_lock (&scheduler->lock);
+
+        for (i = 0; i < N_REQUEST_PRIORITIES; i++) {
+                for (l = scheduler->queues[i].head; l != NULL; l = next) {
+                        request = l->data;
+                        next = l->next;
+
+                        refill_bucket (request->bucket, now);
+                        if (request->bucket->tokens < costs[i])
+                                continue;
+
+                        request->bucket->tokens -= costs[i];
+                        request->bucket->n_queued--;
+                        request->bucket->n_queued_class[i]--;
+                        g_queue_delete_link (&scheduler->queues[i], l);
+
+                        g_queue_push_tail (&ready, request);
+                }
+
+                if (!g_queue_is_empty (&scheduler->queues[i]))
+                        pending = TRUE;
+        }
+
+        if (!pending)
+                scheduler->dispatch_id = 0;
+
+        g_mutex_unlock (&scheduler->lock);
+
+        /* Without the lock, as handlers may admit requests */
+        while ((request = g_queue_pop_head (&ready)) != NULL)
+                dispatch_request (request);
+
+        return pending;
+}
+
+/* Takes a token from the bucket of @sender or, failing that, decides
+ * whether @request may be held back.  Called with the lock held.
+ */
+static RequestAdmission
+admit_request (RequestScheduler *scheduler,
+               const gchar      *sender,
+               RequestPriority   priority,
+               Request          *request)
+{
+        Bucket *bucket;
+
+        bucket = get_bucket (scheduler, sender);
+        refill_bucket (bucket, g_get_monotonic_time ());
+
+        /* Calls of one sender are not reordered within a class, but
+         * are not held back behind calls of another class either.
+         */
+        if (bucket->n_queued_class[priority] == 0 && bucket->tokens >= costs[priority]) {
+                bucket->tokens -= costs[priority];
+                scheduler->stats[priority].dispatched++;
+                return REQUEST_ADMITTED;
+        }
+
+        if (bucket->n_queued >= MAX_QUEUED) {
+                scheduler->stats[priority].rejected++;
+                return REQUEST_REJECTED;
+        }
+
+        if (bucket->n_queued == 0)
+                g_debug ("throttling requests from %s", bucket->sender);
+
+        request->bucket = bucket;
+        request->queued_at = g_get_monotonic_time ();
+        bucket->n_queued++;
+        bucket->n_queued_class[priority]++;
+        g_queue_push_tail (&scheduler->queues[priority], request);
+        scheduler->stats[priority].throttled++;
+
+        /* Only held back to keep the order, so no need to wait */
+        if (scheduler->dispatch_id == 0)
+                scheduler->dispatch_id = add_timeout (scheduler,
+                                                      bucket->tokens >= costs[priority] ?
+                                                      g_idle_source_new () :
+                                                      g_timeout_source_new (DISPATCH_INTERVAL),
+                                                      dispatch_queued);
+
+        return REQUEST_QUEUED;
+}
+
+static gboolean
+on_authorize_method (GDBusInterfaceSkeleton *skeleton,
+                     GDBusMethodInvocation  *invocation,
+                     RequestScheduler       *scheduler)
+{
+        RequestAdmission admission;
+        Request *request;
+        gchar *sender;
+
+        if (g_object_get_data (G_OBJECT (invocation), ADMITTED_KEY) != NULL)
+                return TRUE;
+
+        latency_stats_begin_call (invocation);
+
+        sender = get_sender_key (g_dbus_method_invocation_get_connection (invocation),
+                                 g_dbus_method_invocation_get_sender (invocation));
+
+        request = g_new0 (Request, 1);
+        request->skeleton = skeleton;
+        request->invocation = invocation;
+
+        g_mutex_lock (&scheduler->lock);
+        admission = admit_request (scheduler, sender, get_priority (invocation), request);
+        if (admission == REQUEST_QUEUED)
+                g_object_ref (skeleton);
+        g_mutex_unlock (&scheduler->lock);
+
+        if (admission != REQUEST_QUEUED)
+                g_free (request);
+
+        /* Returning FALSE leaves the call to us, but GDBus drops its
+         * reference to the invocation; the one taken here goes to the
+         * skeleton's handler or with the reply.
+         */
+        if (admission != REQUEST_ADMITTED)
+                g_object_ref (invocation);
+
+        if (admission == REQUEST_REJECTED)
+                g_dbus_method_invocation_return_error (invocation,
+                                                       G_DBUS_ERROR,
+                                                       G_DBUS_ERROR_LIMITS_EXCEEDED,
+                                                       "Too many requests from %s",
+                                                       sender);
+        g_free (sender);
+
+        return admission == REQUEST_ADMITTED;
+}
+
+RequestScheduler *
+request_scheduler_new (void)
+{
+        RequestScheduler *scheduler;
+        guint i;
+
+        scheduler = g_new0 (RequestScheduler, 1);
+        g_mutex_init (&scheduler->lock);
+        scheduler->context = g_main_context_ref_thread_default ();
+        scheduler->buckets = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                    NULL, (GDestroyNotify) bucket_free);
+        for (i = 0; i < N_REQUEST_PRIORITIES; i++)
+                g_queue_init (&scheduler->queues[i]);
+
+        return scheduler;
+}
+
+void
+request_scheduler_free (RequestScheduler *scheduler)
+{
+        Request *request;
+        guint i;
+
+        for (i = 0; i < N_REQUEST_PRIORITIES; i++) {
+                while ((request = g_queue_pop_head (&scheduler->queues[i])) != NULL)
+                        free_request (request);
+        }
+
+        if (scheduler->dispatch_id > 0)
+                remove_timeout (scheduler, scheduler->dispatch_id);
+        if (scheduler->sweep_id > 0)
+                remove_timeout (scheduler, scheduler->sweep_id);
+
+        g_hash_table_unref (scheduler->buckets);
+        g_main_context_unref (scheduler->context);
+        g_mutex_clear (&scheduler->lock);
+        g_free (scheduler);
+}
+
+/* Puts the method calls of @skeleton under the control of @scheduler */
+void
+request_scheduler_attach (RequestScheduler       *scheduler,
+                          GDBusInterfaceSkeleton *skeleton)
+{
+        if (g_signal_handler_find (skeleton,
+                                   G_SIGNAL_MATCH_FUNC | G_SIGNAL_MATCH_DATA,
+                                   0, 0, NULL,
+                                   on_authorize_method, scheduler) != 0)
+                return;
+
+        g_signal_connect (skeleton, "g-authorize-method",
+                          G_CALLBACK (on_authorize_method), scheduler);
+}
+
+/* Handles a call to @skeleton that did not go through its own
+ * dispatching, and so not through g-authorize-method either, like
+ * g_dbus_interface_skeleton_get_vtable() would.  Takes over
+ * @invocation.
+ */
+void
+request_scheduler_handle_call (RequestScheduler       *scheduler,
+                               GDBusInterfaceSkeleton *skeleton,
+                               GDBusMethodInvocation  *invocation)
+{
+        GDBusInterfaceVTable *vtable;
+
+        if (!on_authorize_method (skeleton, invocation, scheduler)) {
+                /* Queued or refused, with a reference of its own */
+                g_object_unref (invocation);
+                return;
+        }
+
+        vtable = g_dbus_interface_skeleton_get_vtable (skeleton);
+        vtable->method_call (g_dbus_method_invocation_get_connection (invocation),
+                             g_dbus_method_invocation_get_sender (invocation),
+                             g_dbus_method_invocation_get_object_path (invocation),
+                             g_dbus_method_invocation_get_interface_name (invocation),
+                             g_dbus_method_invocation_get_method_name (invocation),
+                             g_dbus_method_invocation_get_parameters (invocation),
+                             invocation,
+                             skeleton);
+}
+
+/* Puts a request that is not a method call of a skeleton, such as a
+ * property read, under the control of @scheduler.  May be called from
+ * any thread.
+ *
+ * If the request is held back, @func is later called with @user_data
+ * on the thread that created the scheduler, and takes it over; if the
+ * scheduler is freed first, @notify is called instead.  Otherwise,
+ * @user_data stays with the caller, which runs or refuses the request.
+ */
+RequestAdmission
+request_scheduler_admit (RequestScheduler *scheduler,
+                         GDBusConnection  *connection,
+                         const gchar      *sender,
+                         RequestPriority   priority,
+                         RequestFunc       func,
+                         gpointer          user_data,
+                         GDestroyNotify    notify)
+{
+        RequestAdmission admission;
+        Request *request;
+        gchar *key;
+
+        key = get_sender_key (connection, sender);
+
+        request = g_new0 (Request, 1);
+        request->func = func;
+        request->data = user_data;
+        request->notify = notify;
+
+        g_mutex_lock (&scheduler->lock);
+        admission = admit_request (scheduler, key, priority, request);
+        g_mutex_unlock (&scheduler->lock);
+
+        if (admission != REQUEST_QUEUED)
+                g_free (request);
+        g_free (key);
+
+        return admission;
+}
+
+void
+request_scheduler_get_stats (RequestScheduler *scheduler,
+                             RequestPriority   priority,
+                             RequestStats     *stats)
+{
+        g_return_if_fail (priority < N_REQUEST_PRIORITIES);
+
+        g_mutex_lock (&scheduler->lock);
+        *stats = scheduler->stats[priority];
+        g_mutex_unlock (&scheduler->lock);
+}
@@ -0,0 +1,73 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * Copyright (C) 2015 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __REQUEST_SCHEDULER_H__
+#define __REQUEST_SCHEDULER_H__
+
+#include <glib.h>
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+typedef struct RequestScheduler RequestScheduler;
+
+typedef enum {
+        REQUEST_PRIORITY_INTERACTIVE,   /* lookups done at login */
+        REQUEST_PRIORITY_NORMAL,
+        REQUEST_PRIORITY_BACKGROUND,    /* expensive operations */
+        N_REQUEST_PRIORITIES
+} RequestPriority;
+
+typedef struct {
+        guint64 dispatched;     /* run right away */
+        guint64 throttled;      /* held back until the sender had tokens */
+        guint64 rejected;       /* refused, too many held back already */
+} RequestStats;
+
+typedef enum {
+        REQUEST_ADMITTED,       /* go ahead */
+        REQUEST_QUEUED,         /* held back, run later */
+        REQUEST_REJECTED        /* too many held back already */
+} RequestAdmission;
+
+typedef void (*RequestFunc) (gpointer user_data);
+
+RequestScheduler * request_scheduler_new        (void);
+void               request_scheduler_free       (RequestScheduler       *scheduler);
+
+void               request_scheduler_attach     (RequestScheduler       *scheduler,
+                                                 GDBusInterfaceSkeleton *skeleton);
+void               request_scheduler_handle_call (RequestScheduler      *scheduler,
+                                                  GDBusInterfaceSkeleton *skeleton,
+                                                  GDBusMethodInvocation  *invocation);
+RequestAdmission   request_scheduler_admit      (RequestScheduler       *scheduler,
+                                                 GDBusConnection        *connection,
+                                                 const gchar            *sender,
+                                                 RequestPriority         priority,
+                                                 RequestFunc             func,
+                                                 gpointer                user_data,
+                                                 GDestroyNotify          notify);
+
+void               request_scheduler_get_stats  (RequestScheduler       *scheduler,
+                                                 RequestPriority         priority,
+                                                 RequestStats           *stats);
+
+G_END_DECLS
+
+#endif /* __REQUEST_SCHEDULER_H__ */
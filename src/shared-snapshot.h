@@ -0,0 +1,46 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * Copyright (C) 2015 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __SHARED_SNAPSHOT_H__
+#define __SHARED_SNAPSHOT_H__
+
+/* The daemon publishes the properties of all its user objects in a
+ * world-readable file, so that clients can map it instead of asking
+ * for each user over the bus.  The file is a serialized GVariant of
+ * SHARED_SNAPSHOT_TYPE:
+ *
+ *   version     SHARED_SNAPSHOT_VERSION
+ *   generation  the change log generation the users are as of
+ *   users       object path -> org.freedesktop.Accounts.User properties
+ *
+ * It is replaced atomically, so a mapping always sees a complete
+ * snapshot.  The file is only rewritten shortly after a change, and
+ * may be left over from an earlier instance of the daemon, so clients
+ * pass the generation to GetChangesSince() and fetch the users that
+ * changed since over the bus, or all of them if it asks for a resync.
+ *
+ * SHARED_SNAPSHOT_DIR is set by the build, for both the daemon and the
+ * library.
+ */
+
+#define SHARED_SNAPSHOT_PATH    SHARED_SNAPSHOT_DIR "/users.snapshot"
+#define SHARED_SNAPSHOT_VERSION 2
+#define SHARED_SNAPSHOT_TYPE    "(uta{oa{sv}})"
+
+#endif /* __SHARED_SNAPSHOT_H__ */
@@ -81,7 +81,41 @@ user_classify_is_blacklisted (const char *username)
 #define PATH_NOLOGIN "/sbin/nologin"
 #define PATH_FALSE "/bin/false"
 
+/* Bumped whenever classifications may have changed */
+static guint generation = 1;
+
 #ifdef ENABLE_USER_HEURISTICS
+#ifdef HAVE_GETUSERSHELL
+static GHashTable *valid_shells;
+
+static gboolean
+user_classify_is_valid_shell (const gchar *shell)
+{
+        char *valid_shell;
+
+        if (valid_shells == NULL) {
+                valid_shells = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+                setusershell ();
+                while ((valid_shell = getusershell ()) != NULL)
+                        g_hash_table_add (valid_shells, g_strdup (valid_shell));
+                endusershell ();
+        }
+
+        return g_hash_table_contains (valid_shells, shell);
+}
+#endif
+
+static const gchar *
+get_basename (const gchar *path)
+{
+        const gchar *p;
+
+        p = strrchr (path, '/');
+
+        return p != NULL ? p + 1 : path;
+}
+
 static gboolean
 user_classify_is_excluded_by_heuristics (const gchar *username,
                                          const gchar *shell,
@@ -90,64 +124,60 @@ user_classify_is_excluded_by_heuristics (const gchar *username,
         gboolean ret = FALSE;
 
         if (shell != NULL) {
-                char *basename, *nologin_basename, *false_basename;
+                const gchar *basename;
 
 #ifdef HAVE_GETUSERSHELL
-                char *valid_shell;
-
-                ret = TRUE;
-                setusershell ();
-                while ((valid_shell = getusershell ()) != NULL) {
-                        if (g_strcmp0 (shell, valid_shell) != 0)
-                                continue;
-                        ret = FALSE;
-                }
-                endusershell ();
+                ret = !user_classify_is_valid_shell (shell);
 #endif
 
-                basename = g_path_get_basename (shell);
-                nologin_basename = g_path_get_basename (PATH_NOLOGIN);
-                false_basename = g_path_get_basename (PATH_FALSE);
+                basename = get_basename (shell);
 
                 if (shell[0] == '\0') {
                         ret = TRUE;
-                } else if (g_strcmp0 (basename, nologin_basename) == 0) {
+                } else if (strcmp (basename, get_basename (PATH_NOLOGIN)) == 0) {
                         ret = TRUE;
-                } else if (g_strcmp0 (basename, false_basename) == 0) {
+                } else if (strcmp (basename, get_basename (PATH_FALSE)) == 0) {
                         ret = TRUE;
                 }
-
-                g_free (basename);
-                g_free (nologin_basename);
-                g_free (false_basename);
         }
 
-        if (password_hash != NULL) {
-                /* skip over the account-is-locked '!' prefix if present */
-                if (password_hash[0] == '!')
-                    password_hash++;
-
-                if (password_hash[0] != '\0') {
-                        /* modern hashes start with "$n$" */
-                        if (password_hash[0] == '$') {
-                                if (strlen (password_hash) < 4)
-                                    ret = TRUE;
-
-                        /* DES crypt is base64 encoded [./A-Za-z0-9]*
-                         */
-                        } else if (!g_ascii_isalnum (password_hash[0]) &&
-                                   password_hash[0] != '.' &&
-                                   password_hash[0] != '/') {
-                                ret = TRUE;
-                        }
-                }
-
-        }
+        if (user_classify_password_hash (password_hash) == PASSWORD_HASH_INVALID)
+                ret = TRUE;
 
         return ret;
 }
 #endif /* ENABLE_USER_HEURISTICS */
 
+/* Users are only classified again when this changes, so it has to
+ * cover everything the heuristics look at in the hash.
+ */
+PasswordHashClass
+user_classify_password_hash (const gchar *password_hash)
+{
+        if (password_hash == NULL)
+                return PASSWORD_HASH_NONE;
+
+        /* skip over the account-is-locked '!' prefix if present */
+        if (password_hash[0] == '!')
+                password_hash++;
+
+        if (password_hash[0] == '\0')
+                return PASSWORD_HASH_EMPTY;
+
+        /* modern hashes start with "$n$" */
+        if (password_hash[0] == '$')
+                return strlen (password_hash) < 4 ? PASSWORD_HASH_INVALID : PASSWORD_HASH_VALID;
+
+        /* DES crypt is base64 encoded [./A-Za-z0-9]*
+         */
+        if (!g_ascii_isalnum (password_hash[0]) &&
+            password_hash[0] != '.' &&
+            password_hash[0] != '/')
+                return PASSWORD_HASH_INVALID;
+
+        return PASSWORD_HASH_VALID;
+}
+
 gboolean
 user_classify_is_human (uid_t        uid,
                         const gchar *username,
@@ -167,3 +197,20 @@ user_classify_is_human (uid_t        uid,
 
         return uid >= MINIMUM_UID;
 }
+
+/* Forgets the parsed /etc/shells, e.g. because it was changed */
+void
+user_classify_invalidate (void)
+{
+#if defined(ENABLE_USER_HEURISTICS) && defined(HAVE_GETUSERSHELL)
+        g_clear_pointer (&valid_shells, g_hash_table_unref);
+#endif
+        generation++;
+}
+
+/* Classifications made under a different generation are stale */
+guint
+user_classify_get_generation (void)
+{
+        return generation;
+}
@@ -24,9 +24,21 @@
 #include <sys/types.h>
 #include <glib.h>
 
+/* What the heuristics look at in a password hash */
+typedef enum {
+        PASSWORD_HASH_UNKNOWN,  /* not looked at yet */
+        PASSWORD_HASH_NONE,     /* no hash available */
+        PASSWORD_HASH_EMPTY,
+        PASSWORD_HASH_VALID,
+        PASSWORD_HASH_INVALID
+} PasswordHashClass;
+
 gboolean        user_classify_is_human          (uid_t        uid,
                                                  const gchar *username,
                                                  const gchar *shell,
                                                  const gchar *password_hash);
+PasswordHashClass user_classify_password_hash   (const gchar *password_hash);
+void            user_classify_invalidate        (void);
+guint           user_classify_get_generation    (void);
 
 #endif /* __USER_CLASSIFY_H__ */
@@ -0,0 +1,239 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * Copyright (C) 2015 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/* Converts the per-user data between the one-keyfile-per-user layout
+ * in USERDIR and the single-file store in USERDB.  accounts-daemon
+ * picks the store if USERDB exists, so it must not be running while
+ * this tool is.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <locale.h>
+
+#include <glib.h>
+#include <glib/gi18n.h>
+#include <glib/gstdio.h>
+
+#include "user-db.h"
+
+static gboolean keep;
+
+static gboolean
+migrate_to_db (GError **error)
+{
+        UserDb *db;
+        GPtrArray *imported;
+        const gchar *name;
+        gchar *tmp_path;
+        gboolean ret = FALSE;
+        GDir *dir;
+        guint i;
+
+        if (g_file_test (USERDB, G_FILE_TEST_EXISTS)) {
+                g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_EXIST,
+                             "%s already exists", USERDB);
+                return FALSE;
+        }
+
+        dir = g_dir_open (USERDIR, 0, error);
+        if (dir == NULL)
+                return FALSE;
+
+        tmp_path = g_strconcat (USERDB, ".new", NULL);
+        g_unlink (tmp_path);
+
+        db = user_db_open (tmp_path, USER_DB_FLAGS_CREATE | USER_DB_FLAGS_NO_SYNC, error);
+        if (db == NULL)
+                goto out;
+
+        imported = g_ptr_array_new_with_free_func (g_free);
+
+        while ((name = g_dir_read_name (dir)) != NULL) {
+                GKeyFile *key_file;
+                gchar *filename;
+                gchar *data;
+                gsize length;
+
+                if (name[0] == '.')
+                        continue;
+
+                filename = g_build_filename (USERDIR, name, NULL);
+                if (!g_file_test (filename, G_FILE_TEST_IS_REGULAR) ||
+                    !g_file_get_contents (filename, &data, &length, NULL)) {
+                        g_free (filename);
+                        continue;
+                }
+
+                /* Only carry over data the daemon would have loaded */
+                key_file = g_key_file_new ();
+                if (!g_key_file_load_from_data (key_file, data, length, 0, NULL)) {
+                        g_printerr ("Skipping %s: not a valid keyfile\n", filename);
+                }
+                else if (!user_db_put (db, name, data, length, error)) {
+                        g_key_file_unref (key_file);
+                        g_free (data);
+                        g_free (filename);
+                        goto out_db;
+                }
+                else {
+                        g_ptr_array_add (imported, g_strdup (filename));
+                }
+
+                g_key_file_unref (key_file);
+                g_free (data);
+                g_free (filename);
+        }
+
+        if (!user_db_sync (db, error))
+                goto out_db;
+
+        if (g_rename (tmp_path, USERDB) < 0) {
+                g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+                             "Failed to rename %s to %s: %s", tmp_path, USERDB, g_strerror (errno));
+                goto out_db;
+        }
+
+        g_print ("Imported %u users into %s\n", imported->len, USERDB);
+
+        if (!keep) {
+                for (i = 0; i < imported->len; i++)
+                        g_unlink (g_ptr_array_index (imported, i));
+        }
+
+        ret = TRUE;
+
+ out_db:
+        user_db_free (db);
+        g_ptr_array_unref (imported);
+        if (!ret)
+                g_unlink (tmp_path);
+ out:
+        g_dir_close (dir);
+        g_free (tmp_path);
+
+        return ret;
+}
+
+static gboolean
+migrate_to_keyfiles (GError **error)
+{
+        UserDb *db;
+        gchar **names;
+        gboolean ret = FALSE;
+        guint i;
+
+        db = user_db_open (USERDB, USER_DB_FLAGS_NONE, error);
+        if (db == NULL)
+                return FALSE;
+
+        if (g_mkdir_with_parents (USERDIR, 0775) < 0) {
+                g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+                             "Failed to create directory %s: %s", USERDIR, g_strerror (errno));
+                goto out;
+        }
+
+        names = user_db_list_names (db);
+        for (i = 0; names[i] != NULL; i++) {
+                gchar *filename;
+                gchar *data;
+                gsize length;
+                gboolean written;
+
+                if (strchr (names[i], '/') != NULL || names[i][0] == '.') {
+                        g_printerr ("Skipping invalid user name '%s'\n", names[i]);
+                        continue;
+                }
+
+                data = user_db_get (db, names[i], &length, error);
+                if (data == NULL)
+                        break;
+
+                filename = g_build_filename (USERDIR, names[i], NULL);
+                written = g_file_set_contents (filename, data, length, error);
+                g_free (filename);
+                g_free (data);
+
+                if (!written)
+                        break;
+        }
+
+        if (names[i] == NULL) {
+                g_print ("Exported %u users to %s\n", i, USERDIR);
+                if (!keep)
+                        g_unlink (USERDB);
+                ret = TRUE;
+        }
+
+        g_strfreev (names);
+
+ out:
+        user_db_free (db);
+
+        return ret;
+}
+
+int
+main (int argc, char *argv[])
+{
+        GOptionContext *context;
+        GError *error = NULL;
+        gboolean ret;
+        static gboolean to_db;
+        static gboolean to_keyfiles;
+        static GOptionEntry entries[] = {
+                { "to-db", 0, 0, G_OPTION_ARG_NONE, &to_db, N_("Move per-user data from " USERDIR " into " USERDB), NULL },
+                { "to-keyfiles", 0, 0, G_OPTION_ARG_NONE, &to_keyfiles, N_("Move per-user data from " USERDB " back into " USERDIR), NULL },
+                { "keep", 0, 0, G_OPTION_ARG_NONE, &keep, N_("Do not remove the source data after migrating"), NULL },
+                { NULL }
+        };
+
+        setlocale (LC_ALL, "");
+
+        context = g_option_context_new ("");
+        g_option_context_set_summary (context, _("Converts the data stored by accounts-daemon between storage formats.\nThe daemon must not be running."));
+        g_option_context_add_main_entries (context, entries, NULL);
+        if (!g_option_context_parse (context, &argc, &argv, &error)) {
+                g_printerr ("%s\n", error->message);
+                g_error_free (error);
+                return EXIT_FAILURE;
+        }
+        g_option_context_free (context);
+
+        if (to_db == to_keyfiles) {
+                g_printerr ("Exactly one of --to-db and --to-keyfiles must be given\n");
+                return EXIT_FAILURE;
+        }
+
+        if (to_db)
+                ret = migrate_to_db (&error);
+        else
+                ret = migrate_to_keyfiles (&error);
+
+        if (!ret) {
+                g_printerr ("Migration failed: %s\n", error ? error->message : "unknown error");
+                g_clear_error (&error);
+                return EXIT_FAILURE;
+        }
+
+        return EXIT_SUCCESS;
+}
@@ -0,0 +1,900 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * Copyright (C) 2015 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "user-db.h"
+
+/* The database is a single append-only log holding the same data as
+ * the per-user keyfiles in USERDIR.  After a fixed magic header, every
+ * record looks like this:
+ *
+ *   guint32   payload length, little endian
+ *   guint32   FNV-1a checksum of the payload, little endian
+ *   guint8    operation, 'P' (put), 'D' (delete) or 'R' (rename)
+ *   gchar[]   user name, nul-terminated
+ *   gchar[]   previous user name, nul-terminated, rename records only
+ *   guint8[]  keyfile data, put and rename records only
+ *
+ * A rename record is a put for the new name that also deletes the
+ * old one, so that a crash cannot leave both or neither behind.
+ * Compaction writes live records back out as puts.
+ *
+ * The newest record for a name wins.  The index of live records is
+ * built by scanning the log once when it is opened; a torn record at
+ * the end (from a crash during an append) is cut off.  Superseded
+ * records are dropped by rewriting the file once they take up more
+ * space than the live ones.
+ *
+ * All public functions take the lock, so the store can be read from
+ * worker threads while the daemon writes to it.
+ */
+
+#define USER_DB_MAGIC "AcctDB\0\1"
+#define USER_DB_MAGIC_LEN 8
+#define USER_DB_RECORD_HEADER_LEN 8
+#define USER_DB_MAX_RECORD_LEN (16 * 1024 * 1024)
+#define USER_DB_COMPACT_MIN_WASTE (256 * 1024)
+
+#define USER_DB_OP_PUT 'P'
+#define USER_DB_OP_DELETE 'D'
+#define USER_DB_OP_RENAME 'R'
+
+typedef struct {
+        goffset data_offset;
+        gsize   data_length;
+        gsize   record_length;
+} UserDbEntry;
+
+struct UserDb {
+        GMutex       lock;
+
+        gchar       *path;
+        gint         fd;
+        UserDbFlags  flags;
+
+        GHashTable  *index;
+
+        goffset      size;
+        goffset      live_size;
+};
+
+static void
+set_errno_error (GError      **error,
+                 const gchar  *operation,
+                 const gchar  *path)
+{
+        gint saved_errno = errno;
+
+        g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (saved_errno),
+                     "Failed to %s %s: %s", operation, path, g_strerror (saved_errno));
+}
+
+static gboolean
+pread_all (gint          fd,
+           const gchar  *path,
+           gpointer      buffer,
+           gsize         length,
+           goffset       offset,
+           GError      **error)
+{
+        guint8 *data = buffer;
+
+        while (length > 0) {
+                gssize n_read;
+
+                n_read = pread (fd, data, length, offset);
+                if (n_read < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        set_errno_error (error, "read", path);
+                        return FALSE;
+                }
+                if (n_read == 0) {
+                        g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_IO,
+                                     "Unexpected end of file in %s", path);
+                        return FALSE;
+                }
+
+                data += n_read;
+                length -= n_read;
+                offset += n_read;
+        }
+
+        return TRUE;
+}
+
+static gboolean
+pwrite_all (gint           fd,
+            const gchar   *path,
+            gconstpointer  buffer,
+            gsize          length,
+            goffset        offset,
+            GError       **error)
+{
+        const guint8 *data = buffer;
+
+        while (length > 0) {
+                gssize written;
+
+                written = pwrite (fd, data, length, offset);
+                if (written < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        set_errno_error (error, "write", path);
+                        return FALSE;
+                }
+
+                data += written;
+                length -= written;
+                offset += written;
+        }
+
+        return TRUE;
+}
+
+static guint32
+user_db_checksum (const guint8 *data,
+                  gsize         length)
+{
+        guint32 hash = 2166136261u;
+        gsize i;
+
+        for (i = 0; i < length; i++) {
+                hash ^= data[i];
+                hash *= 16777619u;
+        }
+
+        return hash;
+}
+
+static void
+user_db_index_insert (UserDb      *db,
+                      gchar       *name,
+                      UserDbEntry *entry)
+{
+        UserDbEntry *old_entry;
+
+        old_entry = g_hash_table_lookup (db->index, name);
+        if (old_entry != NULL)
+                db->live_size -= old_entry->record_length;
+
+        db->live_size += entry->record_length;
+        g_hash_table_replace (db->index, name, entry);
+}
+
+static void
+user_db_index_remove (UserDb      *db,
+                      const gchar *name)
+{
+        UserDbEntry *entry;
+
+        entry = g_hash_table_lookup (db->index, name);
+        if (entry == NULL)
+                return;
+
+        db->live_size -= entry->record_length;
+        g_hash_table_remove (db->index, name);
+}
+
+static gboolean
+user_db_load_index (UserDb  *db,
+                    GError **error)
+{
+        GMappedFile *mapped;
+        const guint8 *contents;
+        gsize size;
+        goffset offset;
+
+        mapped = g_mapped_file_new_from_fd (db->fd, FALSE, error);
+        if (mapped == NULL)
+                return FALSE;
+
+        contents = (const guint8 *) g_mapped_file_get_contents (mapped);
+        size = g_mapped_file_get_length (mapped);
+
+        if (size < USER_DB_MAGIC_LEN || memcmp (contents, USER_DB_MAGIC, USER_DB_MAGIC_LEN) != 0) {
+                g_mapped_file_unref (mapped);
+                g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                             "%s is not a user database", db->path);
+                return FALSE;
+        }
+
+        offset = USER_DB_MAGIC_LEN;
+        while (offset + USER_DB_RECORD_HEADER_LEN <= size) {
+                const guint8 *payload;
+                const gchar *name;
+                gsize name_length;
+                guint32 length;
+                guint32 checksum;
+
+                memcpy (&length, contents + offset, sizeof (length));
+                memcpy (&checksum, contents + offset + 4, sizeof (checksum));
+                length = GUINT32_FROM_LE (length);
+                checksum = GUINT32_FROM_LE (checksum);
+
+                if (length < 2 || length > USER_DB_MAX_RECORD_LEN ||
+                    offset + USER_DB_RECORD_HEADER_LEN + length > size)
+                        break;
+
+                payload = contents + offset + USER_DB_RECORD_HEADER_LEN;
+                if (user_db_checksum (payload, length) != checksum)
+                        break;
+
+                name = (const gchar *) payload + 1;
+                name_length = strnlen (name, length - 1);
+                if (name_length == 0 || name_length == length - 1)
+                        break;
+
+                if (payload[0] == USER_DB_OP_PUT || payload[0] == USER_DB_OP_RENAME) {
+                        UserDbEntry *entry;
+                        const gchar *old_name = NULL;
+                        gsize header_length;
+
+                        header_length = 1 + name_length + 1;
+                        if (payload[0] == USER_DB_OP_RENAME) {
+                                gsize old_length;
+
+                                old_name = name + name_length + 1;
+                                old_length = strnlen (old_name, length - header_length);
+                                if (old_length == 0 || old_length == length - header_length)
+                                        break;
+                                header_length += old_length + 1;
+                        }
+
+                        if (old_name != NULL)
+                                user_db_index_remove (db, old_name);
+
+                        entry = g_new (UserDbEntry, 1);
+                        entry->data_offset = offset + USER_DB_RECORD_HEADER_LEN + header_length;
+                        entry->data_length = length - header_length;
+                        entry->record_length = USER_DB_RECORD_HEADER_LEN + length;
+                        user_db_index_insert (db, g_strndup (name, name_length), entry);
+                }
+                else if (payload[0] == USER_DB_OP_DELETE) {
+                        user_db_index_remove (db, name);
+                }
+                else {
+                        break;
+                }
+
+                offset += USER_DB_RECORD_HEADER_LEN + length;
+        }
+
+        g_mapped_file_unref (mapped);
+
+        if ((gsize) offset < size) {
+                g_warning ("Discarding %" G_GSIZE_FORMAT " bytes of damaged data at the end of %s",
+                           (gsize) (size - offset), db->path);
+                if (ftruncate (db->fd, offset) < 0) {
+                        set_errno_error (error, "truncate", db->path);
+                        return FALSE;
+                }
+        }
+
+        db->size = offset;
+
+        return TRUE;
+}
+
+UserDb *
+user_db_open (const gchar  *path,
+              UserDbFlags   flags,
+              GError      **error)
+{
+        UserDb *db;
+        struct stat st;
+        gint open_flags;
+        gint fd;
+
+        open_flags = O_RDWR | O_CLOEXEC;
+        if (flags & USER_DB_FLAGS_CREATE)
+                open_flags |= O_CREAT;
+
+        fd = g_open (path, open_flags, 0600);
+        if (fd < 0) {
+                set_errno_error (error, "open", path);
+                return NULL;
+        }
+
+        db = g_new0 (UserDb, 1);
+        g_mutex_init (&db->lock);
+        db->path = g_strdup (path);
+        db->fd = fd;
+        db->flags = flags;
+        db->index = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+
+        if (fstat (fd, &st) < 0) {
+                set_errno_error (error, "stat", path);
+                goto error;
+        }
+
+        if (st.st_size == 0) {
+                if (!pwrite_all (fd, path, USER_DB_MAGIC, USER_DB_MAGIC_LEN, 0, error))
+                        goto error;
+                db->size = USER_DB_MAGIC_LEN;
+        }
+        else if (!user_db_load_index (db, error)) {
+                goto error;
+        }
+
+        return db;
+
+ error:
+        user_db_free (db);
+        return NULL;
+}
+
+void
+user_db_free (UserDb *db)
+{
+        close (db->fd);
+        g_hash_table_unref (db->index);
+        g_free (db->path);
+        g_mutex_clear (&db->lock);
+        g_free (db);
+}
+
+static gchar *
+user_db_get_unlocked (UserDb       *db,
+                      const gchar  *name,
+                      gsize        *length,
+                      GError      **error)
+{
+        UserDbEntry *entry;
+        gchar *data;
+
+        entry = g_hash_table_lookup (db->index, name);
+        if (entry == NULL) {
+                g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_NOENT,
+                             "No data for user %s in %s", name, db->path);
+                return NULL;
+        }
+
+        data = g_malloc (entry->data_length + 1);
+        if (!pread_all (db->fd, db->path, data, entry->data_length, entry->data_offset, error)) {
+                g_free (data);
+                return NULL;
+        }
+        data[entry->data_length] = '\0';
+
+        if (length != NULL)
+                *length = entry->data_length;
+
+        return data;
+}
+
+/* @old_name is only given for rename records */
+static GByteArray *
+user_db_build_record (UserDb       *db,
+                      guint8        operation,
+                      const gchar  *name,
+                      const gchar  *old_name,
+                      const gchar  *data,
+                      gsize         length,
+                      GError      **error)
+{
+        GByteArray *record;
+        gsize name_length;
+        gsize old_length;
+        gsize payload_length;
+        guint32 value;
+
+        name_length = strlen (name);
+        old_length = old_name != NULL ? strlen (old_name) + 1 : 0;
+        payload_length = 1 + name_length + 1 + old_length + length;
+        if (name_length == 0 || old_length == 1 || payload_length > USER_DB_MAX_RECORD_LEN) {
+                g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                             "Invalid record for user '%s' in %s", name, db->path);
+                return NULL;
+        }
+
+        record = g_byte_array_sized_new (USER_DB_RECORD_HEADER_LEN + payload_length);
+        g_byte_array_set_size (record, USER_DB_RECORD_HEADER_LEN);
+        g_byte_array_append (record, &operation, 1);
+        g_byte_array_append (record, (const guint8 *) name, name_length + 1);
+        if (old_length > 0)
+                g_byte_array_append (record, (const guint8 *) old_name, old_length);
+        if (length > 0)
+                g_byte_array_append (record, (const guint8 *) data, length);
+
+        value = GUINT32_TO_LE ((guint32) payload_length);
+        memcpy (record->data, &value, sizeof (value));
+        value = GUINT32_TO_LE (user_db_checksum (record->data + USER_DB_RECORD_HEADER_LEN, payload_length));
+        memcpy (record->data + 4, &value, sizeof (value));
+
+        return record;
+}
+
+static gboolean
+user_db_append (UserDb       *db,
+                guint8        operation,
+                const gchar  *name,
+                const gchar  *old_name,
+                const gchar  *data,
+                gsize         length,
+                UserDbEntry **out_entry,
+                GError      **error)
+{
+        GByteArray *record;
+
+        record = user_db_build_record (db, operation, name, old_name, data, length, error);
+        if (record == NULL)
+                return FALSE;
+
+        if (!pwrite_all (db->fd, db->path, record->data, record->len, db->size, error)) {
+                /* Don't leave a partial record behind for the next append */
+                if (ftruncate (db->fd, db->size) < 0)
+                        g_warning ("Failed to truncate %s: %s", db->path, g_strerror (errno));
+                g_byte_array_unref (record);
+                return FALSE;
+        }
+
+        if (out_entry != NULL) {
+                UserDbEntry *entry;
+
+                entry = g_new (UserDbEntry, 1);
+                entry->data_offset = db->size + record->len - length;
+                entry->data_length = length;
+                entry->record_length = record->len;
+                *out_entry = entry;
+        }
+
+        db->size += record->len;
+        g_byte_array_unref (record);
+
+        return TRUE;
+}
+
+static gboolean
+user_db_sync_unlocked (UserDb  *db,
+                       GError **error)
+{
+        if (fsync (db->fd) < 0) {
+                set_errno_error (error, "sync", db->path);
+                return FALSE;
+        }
+
+        return TRUE;
+}
+
+/* Makes a rename of a file in the directory of @path durable */
+static gboolean
+user_db_sync_dir (const gchar  *path,
+                  GError      **error)
+{
+        gchar *dir;
+        gint fd;
+        gboolean ret = TRUE;
+
+        dir = g_path_get_dirname (path);
+
+        fd = g_open (dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC, 0);
+        if (fd < 0 || fsync (fd) < 0) {
+                set_errno_error (error, "sync", dir);
+                ret = FALSE;
+        }
+
+        if (fd >= 0)
+                close (fd);
+        g_free (dir);
+
+        return ret;
+}
+
+static gboolean
+user_db_compact_unlocked (UserDb  *db,
+                          GError **error)
+{
+        GHashTableIter iter;
+        UserDbEntry *entry;
+        GByteArray *record;
+        const gchar *name;
+        gchar *buffer = NULL;
+        gchar *tmp_path;
+        goffset offset;
+        gboolean ret = FALSE;
+        gint fd;
+
+        tmp_path = g_strconcat (db->path, ".compact", NULL);
+
+        fd = g_open (tmp_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        if (fd < 0) {
+                set_errno_error (error, "create", tmp_path);
+                goto out;
+        }
+
+        if (!pwrite_all (fd, tmp_path, USER_DB_MAGIC, USER_DB_MAGIC_LEN, 0, error))
+                goto out;
+
+        /* Write the live records out again as puts; the index is only
+         * updated once the new file has replaced the old one.
+         */
+        offset = USER_DB_MAGIC_LEN;
+        g_hash_table_iter_init (&iter, db->index);
+        while (g_hash_table_iter_next (&iter, (gpointer *) &name, (gpointer *) &entry)) {
+                buffer = g_realloc (buffer, entry->data_length);
+                if (!pread_all (db->fd, db->path, buffer, entry->data_length, entry->data_offset, error))
+                        goto out;
+
+                record = user_db_build_record (db, USER_DB_OP_PUT, name, NULL,
+                                               buffer, entry->data_length, error);
+                if (record == NULL)
+                        goto out;
+                if (!pwrite_all (fd, tmp_path, record->data, record->len, offset, error)) {
+                        g_byte_array_unref (record);
+                        goto out;
+                }
+
+                offset += record->len;
+                g_byte_array_unref (record);
+        }
+
+        if (fsync (fd) < 0) {
+                set_errno_error (error, "sync", tmp_path);
+                goto out;
+        }
+
+        if (g_rename (tmp_path, db->path) < 0) {
+                set_errno_error (error, "replace", db->path);
+                goto out;
+        }
+
+        close (db->fd);
+        db->fd = fd;
+        fd = -1;
+
+        /* The table was not modified, so it iterates in the same order */
+        offset = USER_DB_MAGIC_LEN;
+        g_hash_table_iter_init (&iter, db->index);
+        while (g_hash_table_iter_next (&iter, (gpointer *) &name, (gpointer *) &entry)) {
+                entry->record_length = USER_DB_RECORD_HEADER_LEN + 1 + strlen (name) + 1 + entry->data_length;
+                entry->data_offset = offset + entry->record_length - entry->data_length;
+                offset += entry->record_length;
+        }
+
+        g_debug ("compacted %s from %" G_GINT64_FORMAT " to %" G_GINT64_FORMAT " bytes",
+                 db->path, (gint64) db->size, (gint64) offset);
+
+        db->size = offset;
+        db->live_size = offset - USER_DB_MAGIC_LEN;
+
+        /* The old and the new file hold the same data, so the store
+         * is consistent whether or not the rename survives a crash.
+         */
+        ret = user_db_sync_dir (db->path, error);
+
+ out:
+        if (fd >= 0) {
+                close (fd);
+                g_unlink (tmp_path);
+        }
+        g_free (buffer);
+        g_free (tmp_path);
+
+        return ret;
+}
+
+static gboolean
+user_db_maybe_compact_unlocked (UserDb  *db,
+                                GError **error)
+{
+        goffset waste;
+
+        waste = db->size - USER_DB_MAGIC_LEN - db->live_size;
+        if (waste < USER_DB_COMPACT_MIN_WASTE || waste < db->live_size)
+                return TRUE;
+
+        return user_db_compact_unlocked (db, error);
+}
+
+/* Makes the record appended at @offset durable.  If that fails the
+ * record is cut off again, so the file never holds a record the index
+ * doesn't know about.
+ */
+static gboolean
+user_db_commit (UserDb   *db,
+                goffset   offset,
+                GError  **error)
+{
+        if (db->flags & USER_DB_FLAGS_NO_SYNC)
+                return TRUE;
+
+        if (!user_db_sync_unlocked (db, error)) {
+                if (ftruncate (db->fd, offset) < 0)
+                        g_warning ("Failed to truncate %s: %s", db->path, g_strerror (errno));
+                db->size = offset;
+                return FALSE;
+        }
+
+        return TRUE;
+}
+
+/* Called once a write is durable, so it must not fail the write;
+ * if compacting fails, the next write tries again.
+ */
+static void
+user_db_compact_after_write (UserDb *db)
+{
+        GError *error = NULL;
+
+        if (!user_db_maybe_compact_unlocked (db, &error)) {
+                g_warning ("Failed to compact %s: %s", db->path, error->message);
+                g_error_free (error);
+        }
+}
+
+static gboolean
+user_db_put_unlocked (UserDb       *db,
+                      const gchar  *name,
+                      const gchar  *data,
+                      gsize         length,
+                      GError      **error)
+{
+        UserDbEntry *entry;
+        goffset offset;
+
+        offset = db->size;
+        if (!user_db_append (db, USER_DB_OP_PUT, name, NULL, data, length, &entry, error))
+                return FALSE;
+
+        /* Readers must not see the new data before it is on disk */
+        if (!user_db_commit (db, offset, error)) {
+                g_free (entry);
+                return FALSE;
+        }
+
+        user_db_index_insert (db, g_strdup (name), entry);
+
+        user_db_compact_after_write (db);
+
+        return TRUE;
+}
+
+static gboolean
+user_db_remove_unlocked (UserDb       *db,
+                         const gchar  *name,
+                         GError      **error)
+{
+        goffset offset;
+
+        if (!g_hash_table_contains (db->index, name))
+                return TRUE;
+
+        offset = db->size;
+        if (!user_db_append (db, USER_DB_OP_DELETE, name, NULL, NULL, 0, NULL, error))
+                return FALSE;
+
+        if (!user_db_commit (db, offset, error))
+                return FALSE;
+
+        user_db_index_remove (db, name);
+
+        user_db_compact_after_write (db);
+
+        return TRUE;
+}
+
+static gboolean
+user_db_rename_unlocked (UserDb       *db,
+                         const gchar  *old_name,
+                         const gchar  *new_name,
+                         GError      **error)
+{
+        UserDbEntry *entry;
+        goffset offset;
+        gchar *data;
+        gsize length;
+        gboolean ret;
+
+        if (!g_hash_table_contains (db->index, old_name))
+                return TRUE;
+
+        data = user_db_get_unlocked (db, old_name, &length, error);
+        if (data == NULL)
+                return FALSE;
+
+        offset = db->size;
+        ret = user_db_append (db, USER_DB_OP_RENAME, new_name, old_name, data, length, &entry, error);
+        g_free (data);
+        if (!ret)
+                return FALSE;
+
+        if (!user_db_commit (db, offset, error)) {
+                g_free (entry);
+                return FALSE;
+        }
+
+        user_db_index_remove (db, old_name);
+        user_db_index_insert (db, g_strdup (new_name), entry);
+
+        user_db_compact_after_write (db);
+
+        return TRUE;
+}
+
+gchar **
+user_db_list_names (UserDb *db)
+{
+        GHashTableIter iter;
+        GPtrArray *names;
+        gpointer name;
+
+        g_mutex_lock (&db->lock);
+
+        names = g_ptr_array_sized_new (g_hash_table_size (db->index) + 1);
+
+        g_hash_table_iter_init (&iter, db->index);
+        while (g_hash_table_iter_next (&iter, &name, NULL))
+                g_ptr_array_add (names, g_strdup (name));
+        g_ptr_array_add (names, NULL);
+
+        g_mutex_unlock (&db->lock);
+
+        return (gchar **) g_ptr_array_free (names, FALSE);
+}
+
+gboolean
+user_db_contains (UserDb      *db,
+                  const gchar *name)
+{
+        gboolean ret;
+
+        g_mutex_lock (&db->lock);
+        ret = g_hash_table_contains (db->index, name);
+        g_mutex_unlock (&db->lock);
+
+        return ret;
+}
+
+gchar *
+user_db_get (UserDb       *db,
+             const gchar  *name,
+             gsize        *length,
+             GError      **error)
+{
+        gchar *data;
+
+        g_mutex_lock (&db->lock);
+        data = user_db_get_unlocked (db, name, length, error);
+        g_mutex_unlock (&db->lock);
+
+        return data;
+}
+
+GKeyFile *
+user_db_get_key_file (UserDb      *db,
+                      const gchar *name)
+{
+        GKeyFile *key_file;
+        GError *error = NULL;
+        gchar *data;
+        gsize length;
+
+        data = user_db_get (db, name, &length, NULL);
+        if (data == NULL)
+                return NULL;
+
+        key_file = g_key_file_new ();
+        if (!g_key_file_load_from_data (key_file, data, length, 0, &error)) {
+                g_warning ("Failed to parse data for user %s in %s: %s",
+                           name, db->path, error->message);
+                g_error_free (error);
+                g_key_file_unref (key_file);
+                key_file = NULL;
+        }
+
+        g_free (data);
+
+        return key_file;
+}
+
+gboolean
+user_db_put (UserDb       *db,
+             const gchar  *name,
+             const gchar  *data,
+             gsize         length,
+             GError      **error)
+{
+        gboolean ret;
+
+        g_mutex_lock (&db->lock);
+        ret = user_db_put_unlocked (db, name, data, length, error);
+        g_mutex_unlock (&db->lock);
+
+        return ret;
+}
+
+gboolean
+user_db_remove (UserDb       *db,
+                const gchar  *name,
+                GError      **error)
+{
+        gboolean ret;
+
+        g_mutex_lock (&db->lock);
+        ret = user_db_remove_unlocked (db, name, error);
+        g_mutex_unlock (&db->lock);
+
+        return ret;
+}
+
+gboolean
+user_db_rename (UserDb       *db,
+                const gchar  *old_name,
+                const gchar  *new_name,
+                GError      **error)
+{
+        gboolean ret;
+
+        g_mutex_lock (&db->lock);
+        ret = user_db_rename_unlocked (db, old_name, new_name, error);
+        g_mutex_unlock (&db->lock);
+
+        return ret;
+}
+
+gboolean
+user_db_sync (UserDb  *db,
+              GError **error)
+{
+        gboolean ret;
+
+        g_mutex_lock (&db->lock);
+        ret = user_db_sync_unlocked (db, error);
+        g_mutex_unlock (&db->lock);
+
+        return ret;
+}
+
+gboolean
+user_db_compact (UserDb  *db,
+                 GError **error)
+{
+        gboolean ret;
+
+        g_mutex_lock (&db->lock);
+        ret = user_db_compact_unlocked (db, error);
+        g_mutex_unlock (&db->lock);
+
+        return ret;
+}
+
+gboolean
+user_db_maybe_compact (UserDb  *db,
+                       GError **error)
+{
+        gboolean ret;
+
+        g_mutex_lock (&db->lock);
+        ret = user_db_maybe_compact_unlocked (db, error);
+        g_mutex_unlock (&db->lock);
+
+        return ret;
+}
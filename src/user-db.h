@@ -0,0 +1,72 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * Copyright (C) 2015 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __USER_DB_H__
+#define __USER_DB_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct UserDb UserDb;
+
+typedef enum {
+        USER_DB_FLAGS_NONE    = 0,
+        USER_DB_FLAGS_CREATE  = 1 << 0,
+        USER_DB_FLAGS_NO_SYNC = 1 << 1
+} UserDbFlags;
+
+UserDb *        user_db_open            (const gchar  *path,
+                                         UserDbFlags   flags,
+                                         GError      **error);
+void            user_db_free            (UserDb       *db);
+
+gchar **        user_db_list_names      (UserDb       *db);
+gboolean        user_db_contains        (UserDb       *db,
+                                         const gchar  *name);
+gchar *         user_db_get             (UserDb       *db,
+                                         const gchar  *name,
+                                         gsize        *length,
+                                         GError      **error);
+GKeyFile *      user_db_get_key_file    (UserDb       *db,
+                                         const gchar  *name);
+
+gboolean        user_db_put             (UserDb       *db,
+                                         const gchar  *name,
+                                         const gchar  *data,
+                                         gsize         length,
+                                         GError      **error);
+gboolean        user_db_remove          (UserDb       *db,
+                                         const gchar  *name,
+                                         GError      **error);
+gboolean        user_db_rename          (UserDb       *db,
+                                         const gchar  *old_name,
+                                         const gchar  *new_name,
+                                         GError      **error);
+
+gboolean        user_db_sync            (UserDb       *db,
+                                         GError      **error);
+gboolean        user_db_compact         (UserDb       *db,
+                                         GError      **error);
+gboolean        user_db_maybe_compact   (UserDb       *db,
+                                         GError      **error);
+
+G_END_DECLS
+
+#endif /* __USER_DB_H__ */
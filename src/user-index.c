@@ -0,0 +1,249 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * Copyright (C) 2015 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "config.h"
+
+#include <glib.h>
+#include <glib-object.h>
+
+#include "user.h"
+#include "user-index.h"
+
+/* The table of users known to the daemon, reachable by name, uid and
+ * object path.  The name table owns a reference to each user; the
+ * others borrow it, and their keys point into the user.
+ *
+ * Users that share the uid of the one in by_uid, and with it the
+ * object path, wait in uid_aliases in the order they were added, so
+ * that the next one can take over when it goes away.
+ */
+struct UserIndex {
+        GHashTable *by_name;
+        GHashTable *by_uid;
+        GHashTable *by_object_path;
+        GHashTable *uid_aliases;
+        guint64     generation;
+};
+
+/* Shared by all indices, so that a generation identifies both the
+ * index and the set of users in it.
+ */
+static guint64 last_generation;
+
+UserIndex *
+user_index_new (void)
+{
+        UserIndex *index;
+
+        index = g_new0 (UserIndex, 1);
+        index->by_name = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_object_unref);
+        index->by_uid = g_hash_table_new (g_direct_hash, g_direct_equal);
+        index->by_object_path = g_hash_table_new (g_str_hash, g_str_equal);
+        index->uid_aliases = g_hash_table_new (g_direct_hash, g_direct_equal);
+        index->generation = ++last_generation;
+
+        return index;
+}
+
+void
+user_index_free (UserIndex *index)
+{
+        GHashTableIter iter;
+        GSList *aliases;
+
+        g_hash_table_iter_init (&iter, index->uid_aliases);
+        while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &aliases))
+                g_slist_free (aliases);
+        g_hash_table_destroy (index->uid_aliases);
+
+        g_hash_table_destroy (index->by_object_path);
+        g_hash_table_destroy (index->by_uid);
+        g_hash_table_destroy (index->by_name);
+        g_free (index);
+}
+
+static void
+index_uid (UserIndex *index,
+           User      *user)
+{
+        gpointer uid;
+        GSList *aliases;
+
+        /* Like getpwuid(), the first of several names for a uid wins */
+        uid = GUINT_TO_POINTER (user_get_uid (user));
+        if (!g_hash_table_contains (index->by_uid, uid)) {
+                g_hash_table_insert (index->by_uid, uid, user);
+                g_hash_table_insert (index->by_object_path,
+                                     (gpointer) user_get_object_path (user),
+                                     user);
+                return;
+        }
+
+        aliases = g_hash_table_lookup (index->uid_aliases, uid);
+        g_hash_table_insert (index->uid_aliases, uid, g_slist_append (aliases, user));
+}
+
+/* Takes @user out of the tables for @old_uid, handing them to the next
+ * user with that uid.  Returns whether it was in them.
+ */
+static gboolean
+unindex_uid (UserIndex *index,
+             User      *user,
+             uid_t      old_uid)
+{
+        gpointer uid;
+        GSList *aliases;
+        GSList *link;
+        User *next;
+
+        uid = GUINT_TO_POINTER (old_uid);
+        aliases = g_hash_table_lookup (index->uid_aliases, uid);
+
+        if (g_hash_table_lookup (index->by_uid, uid) == user) {
+                g_hash_table_remove (index->by_uid, uid);
+                g_hash_table_remove (index->by_object_path, user_get_object_path (user));
+
+                if (aliases != NULL) {
+                        next = aliases->data;
+                        aliases = g_slist_delete_link (aliases, aliases);
+
+                        g_hash_table_insert (index->by_uid, uid, next);
+                        g_hash_table_insert (index->by_object_path,
+                                             (gpointer) user_get_object_path (next),
+                                             next);
+                }
+        }
+        else {
+                link = g_slist_find (aliases, user);
+                if (link == NULL)
+                        return FALSE;
+                aliases = g_slist_delete_link (aliases, link);
+        }
+
+        if (aliases != NULL)
+                g_hash_table_insert (index->uid_aliases, uid, aliases);
+        else
+                g_hash_table_remove (index->uid_aliases, uid);
+
+        return TRUE;
+}
+
+void
+user_index_add (UserIndex *index,
+                User      *user)
+{
+        User *old_user;
+
+        old_user = g_hash_table_lookup (index->by_name, user_get_user_name (user));
+        if (old_user == user)
+                return;
+        if (old_user != NULL)
+                user_index_remove (index, old_user);
+
+        g_hash_table_insert (index->by_name,
+                             g_strdup (user_get_user_name (user)),
+                             g_object_ref (user));
+        index->generation = ++last_generation;
+
+        index_uid (index, user);
+}
+
+void
+user_index_remove (UserIndex *index,
+                   User      *user)
+{
+        unindex_uid (index, user, user_get_uid (user));
+
+        /* Drops the reference, so this goes last */
+        if (g_hash_table_lookup (index->by_name, user_get_user_name (user)) == user) {
+                g_hash_table_remove (index->by_name, user_get_user_name (user));
+                index->generation = ++last_generation;
+        }
+}
+
+/* Moves @user to its current name and uid after they changed from
+ * @old_name and @old_uid.  Nothing happens if the user was not in the
+ * index under its old keys.
+ */
+void
+user_index_rekey (UserIndex   *index,
+                  User        *user,
+                  const gchar *old_name,
+                  uid_t        old_uid)
+{
+        gboolean found = FALSE;
+
+        g_object_ref (user);
+
+        if (old_name != NULL &&
+            g_hash_table_lookup (index->by_name, old_name) == user) {
+                g_hash_table_remove (index->by_name, old_name);
+                found = TRUE;
+        }
+
+        if (unindex_uid (index, user, old_uid))
+                found = TRUE;
+
+        if (found)
+                user_index_add (index, user);
+
+        g_object_unref (user);
+}
+
+/* Changes whenever a user is added or removed */
+guint64
+user_index_get_generation (UserIndex *index)
+{
+        return index->generation;
+}
+
+guint
+user_index_size (UserIndex *index)
+{
+        return g_hash_table_size (index->by_name);
+}
+
+User *
+user_index_lookup_name (UserIndex   *index,
+                        const gchar *name)
+{
+        return g_hash_table_lookup (index->by_name, name);
+}
+
+User *
+user_index_lookup_uid (UserIndex *index,
+                       uid_t      uid)
+{
+        return g_hash_table_lookup (index->by_uid, GUINT_TO_POINTER (uid));
+}
+
+User *
+user_index_lookup_object_path (UserIndex   *index,
+                               const gchar *object_path)
+{
+        return g_hash_table_lookup (index->by_object_path, object_path);
+}
+
+/* Iterates over name -> User */
+void
+user_index_iter_init (UserIndex      *index,
+                      GHashTableIter *iter)
+{
+        g_hash_table_iter_init (iter, index->by_name);
+}
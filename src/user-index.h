@@ -0,0 +1,59 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * Copyright (C) 2015 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __USER_INDEX_H__
+#define __USER_INDEX_H__
+
+#include <sys/types.h>
+
+#include <glib.h>
+
+#include "types.h"
+
+G_BEGIN_DECLS
+
+typedef struct UserIndex UserIndex;
+
+UserIndex *     user_index_new                  (void);
+void            user_index_free                 (UserIndex      *index);
+
+void            user_index_add                  (UserIndex      *index,
+                                                 User           *user);
+void            user_index_remove               (UserIndex      *index,
+                                                 User           *user);
+void            user_index_rekey                (UserIndex      *index,
+                                                 User           *user,
+                                                 const gchar    *old_name,
+                                                 uid_t           old_uid);
+
+guint           user_index_size                 (UserIndex      *index);
+guint64         user_index_get_generation       (UserIndex      *index);
+User *          user_index_lookup_name          (UserIndex      *index,
+                                                 const gchar    *name);
+User *          user_index_lookup_uid           (UserIndex      *index,
+                                                 uid_t           uid);
+User *          user_index_lookup_object_path   (UserIndex      *index,
+                                                 const gchar    *object_path);
+
+void            user_index_iter_init            (UserIndex      *index,
+                                                 GHashTableIter *iter);
+
+G_END_DECLS
+
+#endif /* __USER_INDEX_H__ */
@@ -25,6 +25,7 @@
 #include "config.h"
 
 #include <stdlib.h>
+#include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
@@ -45,6 +46,9 @@
 #include "user-classify.h"
 #include "daemon.h"
 #include "user.h"
+#include "user-db.h"
+#include "extra-data.h"
+#include "latency-stats.h"
 #include "accounts-user-generated.h"
 #include "util.h"
 
@@ -80,7 +84,10 @@ struct User {
 
         Daemon       *daemon;
 
-        GKeyFile     *keyfile;
+        /* The keyfile without the User group, which is mirrored in
+         * the fields below; NULL for most users.
+         */
+        ExtraData    *extra_data;
 
         uid_t         uid;
         gid_t         gid;
@@ -89,15 +96,18 @@ struct User {
         AccountType   account_type;
         PasswordMode  password_mode;
         gchar        *password_hint;
-        gchar        *home_dir;
-        gchar        *shell;
+        const gchar  *home_parent;      /* shared */
+        gchar        *home_base;
+        gchar        *home_dir;         /* built when asked for */
+        const gchar  *shell;            /* interned, from passwd only */
         gchar        *email;
-        gchar        *language;
-        gchar        *x_session;
-        gchar        *location;
+        const gchar  *language;         /* shared */
+        const gchar  *x_session;        /* shared */
+        const gchar  *location;         /* shared */
         guint64       login_frequency;
         gint64        login_time;
         GVariant     *login_history;
+        gboolean      login_history_trimmed;
         gchar        *icon_file;
         gchar        *default_icon_file;
         gboolean      locked;
@@ -105,8 +115,19 @@ struct User {
         gboolean      system_account;
         gboolean      local_account;
 
+        /* Classification, redone only when its inputs change */
+        guint         classify_generation;
+        PasswordHashClass classify_password;
+        gboolean      is_human;
+        gboolean      is_human_with_password;
+
         guint        *extension_ids;
         guint         n_extension_ids;
+
+        /* Changes seen since the main loop was last idle */
+        guint         change_idle_id;
+        gboolean      change_named;
+        gboolean      change_unnamed;
 };
 
 typedef struct UserClass
@@ -153,6 +174,80 @@ account_type_from_pwent (struct passwd *pwent)
         return ACCOUNT_TYPE_STANDARD;
 }
 
+/* Replaces the shared string in @field by one equal to @value.
+ * Shared strings are equal only if they are the same.
+ */
+static gboolean
+set_shared_string (const gchar **field,
+                   const gchar  *value)
+{
+        const gchar *shared;
+
+        shared = shared_string_ref (value);
+        if (shared == *field) {
+                shared_string_unref (shared);
+                return FALSE;
+        }
+
+        shared_string_unref (*field);
+        *field = shared;
+
+        return TRUE;
+}
+
+/* Home directories are kept as the directory they are in, which few
+ * users differ in and which is shared, and the rest of the path.
+ */
+static gboolean
+set_home_dir (User        *user,
+              const gchar *home_dir)
+{
+        const gchar *base;
+        const gchar *parent;
+        gchar *prefix;
+
+        base = strrchr (home_dir, '/');
+        if (base == NULL)
+                base = home_dir;
+
+        prefix = g_strndup (home_dir, base - home_dir);
+        parent = shared_string_ref (prefix);
+        g_free (prefix);
+
+        if (parent == user->home_parent && g_strcmp0 (user->home_base, base) == 0) {
+                shared_string_unref (parent);
+                return FALSE;
+        }
+
+        shared_string_unref (user->home_parent);
+        user->home_parent = parent;
+        g_free (user->home_base);
+        user->home_base = g_strdup (base);
+
+        g_clear_pointer (&user->home_dir, g_free);
+        g_clear_pointer (&user->default_icon_file, g_free);
+
+        return TRUE;
+}
+
+static const gchar *
+get_home_dir (User *user)
+{
+        if (user->home_dir == NULL && user->home_base != NULL)
+                user->home_dir = g_strconcat (user->home_parent, user->home_base, NULL);
+
+        return user->home_dir;
+}
+
+static const gchar *
+get_default_icon_file (User *user)
+{
+        if (user->default_icon_file == NULL && user->home_base != NULL)
+                user->default_icon_file = g_build_filename (get_home_dir (user), ".face", NULL);
+
+        return user->default_icon_file;
+}
+
 void
 user_update_from_pwent (User          *user,
                         struct passwd *pwent)
@@ -161,8 +256,12 @@ user_update_from_pwent (User          *user,
         struct spwd *spent;
 #endif
         gchar *real_name;
+        gchar *old_name;
+        uid_t old_uid;
         gboolean changed;
+        gboolean reclassify;
         const gchar *passwd;
+        const gchar *shell;
         gboolean locked;
         PasswordMode mode;
         AccountType account_type;
@@ -170,6 +269,9 @@ user_update_from_pwent (User          *user,
         g_object_freeze_notify (G_OBJECT (user));
 
         changed = FALSE;
+        reclassify = FALSE;
+        old_name = NULL;
+        old_uid = user->uid;
 
         if (pwent->pw_gecos && pwent->pw_gecos[0] != '\0') {
                 gchar *first_comma = NULL;
@@ -218,6 +320,7 @@ user_update_from_pwent (User          *user,
         if (pwent->pw_uid != user->uid) {
                 user->uid = pwent->pw_uid;
                 changed = TRUE;
+                reclassify = TRUE;
                 g_object_notify (G_OBJECT (user), "uid");
         }
 
@@ -233,27 +336,25 @@ user_update_from_pwent (User          *user,
 
         /* Username */
         if (g_strcmp0 (user->user_name, pwent->pw_name) != 0) {
-                g_free (user->user_name);
+                old_name = user->user_name;
                 user->user_name = g_strdup (pwent->pw_name);
                 changed = TRUE;
+                reclassify = TRUE;
                 g_object_notify (G_OBJECT (user), "user-name");
         }
 
         /* Home Directory */
-        if (g_strcmp0 (user->home_dir, pwent->pw_dir) != 0) {
-                g_free (user->home_dir);
-                user->home_dir = g_strdup (pwent->pw_dir);
-                g_free (user->default_icon_file);
-                user->default_icon_file = g_build_filename (user->home_dir, ".face", NULL);
+        if (set_home_dir (user, pwent->pw_dir)) {
                 changed = TRUE;
                 g_object_notify (G_OBJECT (user), "home-directory");
         }
 
-        /* Shell */
-        if (g_strcmp0 (user->shell, pwent->pw_shell) != 0) {
-                g_free (user->shell);
-                user->shell = g_strdup (pwent->pw_shell);
+        /* Shell; there are only a few distinct ones */
+        shell = g_intern_string (pwent->pw_shell);
+        if (user->shell != shell) {
+                user->shell = shell;
                 changed = TRUE;
+                reclassify = TRUE;
                 g_object_notify (G_OBJECT (user), "shell");
         }
 
@@ -298,7 +399,20 @@ user_update_from_pwent (User          *user,
                 g_object_notify (G_OBJECT (user), "password-mode");
         }
 
-        user->system_account = !user_classify_is_human (user->uid, user->user_name, pwent->pw_shell, passwd);
+        if (reclassify ||
+            user->classify_generation != user_classify_get_generation () ||
+            user->classify_password != user_classify_password_hash (passwd)) {
+                user->is_human = user_classify_is_human (user->uid, user->user_name, user->shell, NULL);
+                user->is_human_with_password = user_classify_is_human (user->uid, user->user_name, user->shell, passwd);
+                user->classify_password = user_classify_password_hash (passwd);
+                user->classify_generation = user_classify_get_generation ();
+        }
+
+        user->system_account = !user->is_human_with_password;
+
+        if (old_name != NULL || old_uid != user->uid)
+                daemon_local_user_rekeyed (user->daemon, user, old_name, old_uid);
+        g_free (old_name);
 
         g_object_thaw_notify (G_OBJECT (user));
 
@@ -317,16 +431,16 @@ user_update_from_keyfile (User     *user,
         s = g_key_file_get_string (keyfile, "User", "Language", NULL);
         if (s != NULL) {
                 /* TODO: validate / normalize */
-                g_free (user->language);
-                user->language = s;
-                g_object_notify (G_OBJECT (user), "language");
+                if (set_shared_string (&user->language, s))
+                        g_object_notify (G_OBJECT (user), "language");
+                g_free (s);
         }
 
         s = g_key_file_get_string (keyfile, "User", "XSession", NULL);
         if (s != NULL) {
-                g_free (user->x_session);
-                user->x_session = s;
-                g_object_notify (G_OBJECT (user), "xsession");
+                if (set_shared_string (&user->x_session, s))
+                        g_object_notify (G_OBJECT (user), "xsession");
+                g_free (s);
         }
 
         s = g_key_file_get_string (keyfile, "User", "Email", NULL);
@@ -338,9 +452,9 @@ user_update_from_keyfile (User     *user,
 
         s = g_key_file_get_string (keyfile, "User", "Location", NULL);
         if (s != NULL) {
-                g_free (user->location);
-                user->location = s;
-                g_object_notify (G_OBJECT (user), "location");
+                if (set_shared_string (&user->location, s))
+                        g_object_notify (G_OBJECT (user), "location");
+                g_free (s);
         }
 
         s = g_key_file_get_string (keyfile, "User", "PasswordHint", NULL);
@@ -367,8 +481,8 @@ user_update_from_keyfile (User     *user,
             }
         }
 
-        g_clear_pointer (&user->keyfile, g_key_file_unref);
-        user->keyfile = g_key_file_ref (keyfile);
+        g_clear_pointer (&user->extra_data, extra_data_free);
+        user->extra_data = extra_data_new_from_key_file (keyfile, "User");
 
         g_object_thaw_notify (G_OBJECT (user));
 }
@@ -383,6 +497,46 @@ user_update_local_account_property (User          *user,
         g_object_notify (G_OBJECT (user), "local-account");
 }
 
+/* Every reload reads wtmp again, and most users have not logged in
+ * since the last one, so only what differs is notified.
+ */
+void
+user_update_login_accounting (User     *user,
+                              guint64   frequency,
+                              gint64    time,
+                              GVariant *history)
+{
+        gboolean changed = FALSE;
+
+        g_object_freeze_notify (G_OBJECT (user));
+
+        if (user->login_frequency != frequency) {
+                user->login_frequency = frequency;
+                changed = TRUE;
+                g_object_notify (G_OBJECT (user), "login-frequency");
+        }
+
+        if (user->login_time != time) {
+                user->login_time = time;
+                changed = TRUE;
+                g_object_notify (G_OBJECT (user), "login-time");
+        }
+
+        if (user->login_history == NULL || !g_variant_equal (user->login_history, history)) {
+                if (user->login_history)
+                        g_variant_unref (user->login_history);
+                user->login_history = g_variant_ref (history);
+                changed = TRUE;
+                g_object_notify (G_OBJECT (user), "login-history");
+        }
+        user->login_history_trimmed = FALSE;
+
+        g_object_thaw_notify (G_OBJECT (user));
+
+        if (changed)
+                accounts_user_emit_changed (ACCOUNTS_USER (user));
+}
+
 void
 user_update_system_account_property (User          *user,
                                      gboolean       system)
@@ -420,23 +574,50 @@ user_save_to_keyfile (User     *user,
         g_key_file_set_boolean (keyfile, "User", "SystemAccount", user->system_account);
 }
 
+/* Puts the keyfile back together, for writing it out */
+static GKeyFile *
+build_keyfile (User *user)
+{
+        GKeyFile *keyfile;
+
+        keyfile = g_key_file_new ();
+        if (user->extra_data != NULL)
+                extra_data_add_to_key_file (user->extra_data, keyfile);
+        user_save_to_keyfile (user, keyfile);
+
+        return keyfile;
+}
+
 static void
 save_extra_data (User *user)
 {
+        UserDb *db;
         gchar *filename;
+        GKeyFile *keyfile;
         gchar *data;
+        gsize length;
         GError *error;
+        gint64 start_time;
+
+        start_time = g_get_monotonic_time ();
 
-        user_save_to_keyfile (user, user->keyfile);
+        keyfile = build_keyfile (user);
 
         error = NULL;
-        data = g_key_file_to_data (user->keyfile, NULL, &error);
+        data = g_key_file_to_data (keyfile, &length, &error);
+        g_key_file_unref (keyfile);
         if (error == NULL) {
-                filename = g_build_filename (USERDIR,
-                                             user->user_name,
-                                             NULL);
-                g_file_set_contents (filename, data, -1, &error);
-                g_free (filename);
+                db = daemon_get_user_db (user->daemon);
+                if (db != NULL) {
+                        user_db_put (db, user->user_name, data, length, &error);
+                }
+                else {
+                        filename = g_build_filename (USERDIR,
+                                                     user->user_name,
+                                                     NULL);
+                        g_file_set_contents (filename, data, length, &error);
+                        g_free (filename);
+                }
                 g_free (data);
         }
         if (error) {
@@ -444,14 +625,29 @@ save_extra_data (User *user)
                            user->user_name, error->message);
                 g_error_free (error);
         }
+
+        latency_stats_add_current (LATENCY_PHASE_IO, g_get_monotonic_time () - start_time);
 }
 
 static void
-move_extra_data (const gchar *old_name,
+move_extra_data (User        *user,
+                 const gchar *old_name,
                  const gchar *new_name)
 {
+        UserDb *db;
         gchar *old_filename;
         gchar *new_filename;
+        GError *error = NULL;
+
+        db = daemon_get_user_db (user->daemon);
+        if (db != NULL) {
+                if (!user_db_rename (db, old_name, new_name, &error)) {
+                        g_warning ("Moving data for user %s failed: %s",
+                                   old_name, error->message);
+                        g_error_free (error);
+                }
+                return;
+        }
 
         old_filename = g_build_filename (USERDIR,
                                          old_name, NULL);
@@ -471,14 +667,15 @@ user_extension_get_value (User                    *user,
 {
         const GVariantType *type = G_VARIANT_TYPE (property->signature);
         GVariant *value;
-        gchar *printed;
+        const gchar *printed;
         gint i;
 
         /* First, try to get the value from the keyfile */
-        printed = g_key_file_get_value (user->keyfile, interface->name, property->name, NULL);
+        printed = NULL;
+        if (user->extra_data != NULL)
+                printed = extra_data_lookup (user->extra_data, interface->name, property->name);
         if (printed) {
                 value = g_variant_parse (type, printed, NULL, NULL, NULL);
-                g_free (printed);
 
                 if (value != NULL)
                         return value;
@@ -559,7 +756,7 @@ user_extension_set_property (User                  *user,
         const GDBusPropertyInfo *property = g_dbus_method_invocation_get_property_info (invocation);
         GVariant *value;
         gchar *printed;
-        gchar *prev;
+        const gchar *prev;
 
         g_variant_get_child (g_dbus_method_invocation_get_parameters (invocation), 2, "v", &value);
 
@@ -569,10 +766,12 @@ user_extension_set_property (User                  *user,
         printed = g_variant_print (value, FALSE);
 
         /* May as well try to avoid the thrashing... */
-        prev = g_key_file_get_value (user->keyfile, interface->name, property->name, NULL);
+        prev = NULL;
+        if (user->extra_data != NULL)
+                prev = extra_data_lookup (user->extra_data, interface->name, property->name);
 
         if (!prev || !g_str_equal (printed, prev)) {
-                g_key_file_set_value (user->keyfile, interface->name, property->name, printed);
+                user->extra_data = extra_data_set_value (user->extra_data, interface->name, property->name, printed);
 
                 /* Emit a change signal.  Use invalidation
                  * because the data may not be world-readable.
@@ -591,7 +790,6 @@ user_extension_set_property (User                  *user,
 
         g_variant_unref (value);
         g_free (printed);
-        g_free (prev);
 
         g_dbus_method_invocation_return_value (invocation, g_variant_new ("()"));
 }
@@ -618,22 +816,22 @@ user_extension_authentication_done (Daemon                *daemon,
 }
 
 static void
-user_extension_method_call (GDBusConnection       *connection,
-                            const gchar           *sender,
-                            const gchar           *object_path,
-                            const gchar           *interface_name,
-                            const gchar           *method_name,
-                            GVariant              *parameters,
-                            GDBusMethodInvocation *invocation,
-                            gpointer               user_data)
+user_extension_dispatch (User                  *user,
+                         GDBusMethodInvocation *invocation)
 {
-        User *user = user_data;
+        const gchar *interface_name;
+        const gchar *method_name;
+        GVariant *parameters;
         GDBusInterfaceInfo *iface_info;
         const gchar *annotation_name;
         const gchar *action_id;
         gint uid;
         gint i;
 
+        interface_name = g_dbus_method_invocation_get_interface_name (invocation);
+        method_name = g_dbus_method_invocation_get_method_name (invocation);
+        parameters = g_dbus_method_invocation_get_parameters (invocation);
+
         /* We don't allow method calls on extension interfaces, so we
          * should only ever see property calls here.
          */
@@ -686,14 +884,81 @@ user_extension_method_call (GDBusConnection       *connection,
         }
 }
 
+typedef struct {
+        User                  *user;
+        GDBusMethodInvocation *invocation;
+} ExtensionCall;
+
+static void
+extension_call_free (ExtensionCall *call)
+{
+        g_dbus_method_invocation_return_error (call->invocation,
+                                               G_DBUS_ERROR,
+                                               G_DBUS_ERROR_FAILED,
+                                               "The daemon is exiting");
+        g_object_unref (call->user);
+        g_free (call);
+}
+
+static void
+extension_call_run (ExtensionCall *call)
+{
+        user_extension_dispatch (call->user, call->invocation);
+        g_object_unref (call->user);
+        g_free (call);
+}
+
+/* Extension properties are not handled by a skeleton, so they are put
+ * under the control of the request scheduler here.
+ */
+static void
+user_extension_method_call (GDBusConnection       *connection,
+                            const gchar           *sender,
+                            const gchar           *object_path,
+                            const gchar           *interface_name,
+                            const gchar           *method_name,
+                            GVariant              *parameters,
+                            GDBusMethodInvocation *invocation,
+                            gpointer               user_data)
+{
+        User *user = user_data;
+        ExtensionCall *call;
+
+        call = g_new0 (ExtensionCall, 1);
+        call->user = g_object_ref (user);
+        call->invocation = invocation;
+
+        switch (request_scheduler_admit (daemon_local_get_request_scheduler (user->daemon),
+                                         connection, sender,
+                                         REQUEST_PRIORITY_NORMAL,
+                                         (RequestFunc) extension_call_run, call,
+                                         (GDestroyNotify) extension_call_free)) {
+        case REQUEST_ADMITTED:
+                extension_call_run (call);
+                break;
+        case REQUEST_QUEUED:
+                break;
+        case REQUEST_REJECTED:
+                g_dbus_method_invocation_return_error (invocation,
+                                                       G_DBUS_ERROR,
+                                                       G_DBUS_ERROR_LIMITS_EXCEEDED,
+                                                       "Too many requests from %s",
+                                                       sender != NULL ? sender : "peer");
+                g_object_unref (call->user);
+                g_free (call);
+                break;
+        }
+}
+
+static const GDBusInterfaceVTable extension_vtable = {
+        user_extension_method_call,
+        NULL /* get_property */,
+        NULL /* set_property */
+};
+
 static void
 user_register_extensions (User *user)
 {
-        static const GDBusInterfaceVTable vtable = {
-                user_extension_method_call,
-                NULL /* get_property */,
-                NULL /* set_property */
-        };
         GHashTable *extensions;
         GHashTableIter iter;
         gpointer iface;
@@ -714,7 +979,278 @@ user_register_extensions (User *user)
         while (g_hash_table_iter_next (&iter, NULL, &iface))
                 user->extension_ids[i++] = g_dbus_connection_register_object (user->system_bus_connection,
                                                                               user->object_path, iface,
-                                                                              &vtable, user, NULL, NULL);
+                                                                              &extension_vtable, user, NULL, NULL);
+}
+
+/* Extension interfaces whose properties may only be read after a
+ * polkit check are left to the main loop.
+ */
+static gboolean
+extension_reads_need_auth (GDBusInterfaceInfo *interface)
+{
+        gint i;
+
+        for (i = 0; interface->annotations && interface->annotations[i]; i++) {
+                if ((g_str_equal (interface->annotations[i]->key, "org.freedesktop.Accounts.Authentication.ReadOwn") ||
+                     g_str_equal (interface->annotations[i]->key, "org.freedesktop.Accounts.Authentication.ReadAny")) &&
+                    interface->annotations[i]->value[0] != '\0')
+                        return TRUE;
+        }
+
+        return FALSE;
+}
+
+/* Called when the object is first read after a change */
+void
+user_build_property_cache (User *user)
+{
+        GVariantBuilder builder;
+        GVariantBuilder properties;
+        GHashTableIter iter;
+        GDBusInterfaceInfo *interface;
+        GVariant *value;
+        gint i;
+
+        g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{sa{sv}}"));
+        g_variant_builder_add (&builder, "{s@a{sv}}",
+                               "org.freedesktop.Accounts.User",
+                               g_dbus_interface_skeleton_get_properties (G_DBUS_INTERFACE_SKELETON (user)));
+
+        g_hash_table_iter_init (&iter, daemon_get_extension_ifaces (user->daemon));
+        while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&interface)) {
+                if (extension_reads_need_auth (interface))
+                        continue;
+
+                g_variant_builder_init (&properties, G_VARIANT_TYPE_VARDICT);
+                for (i = 0; interface->properties && interface->properties[i]; i++) {
+                        value = user_extension_get_value (user, interface, interface->properties[i]);
+                        if (value != NULL) {
+                                g_variant_builder_add (&properties, "{sv}", interface->properties[i]->name, value);
+                                g_variant_unref (value);
+                        }
+                }
+                g_variant_builder_add (&builder, "{sa{sv}}", interface->name, &properties);
+        }
+
+        property_cache_set (daemon_local_get_property_cache (user->daemon),
+                            user->object_path,
+                            g_variant_builder_end (&builder));
+}
+
+/* Must happen before the change is signalled, so that no read is
+ * answered with older values after the signal.
+ */
+static void
+invalidate_property_cache (User *user)
+{
+        property_cache_invalidate (daemon_local_get_property_cache (user->daemon),
+                                   user->object_path);
+}
+
+static void
+add_property_cache_interfaces (User *user)
+{
+        PropertyCache *cache;
+        GHashTableIter iter;
+        GDBusInterfaceInfo *interface;
+
+        cache = daemon_local_get_property_cache (user->daemon);
+
+        property_cache_add_interface (cache, "org.freedesktop.Accounts.User");
+        g_hash_table_iter_init (&iter, daemon_get_extension_ifaces (user->daemon));
+        while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&interface)) {
+                if (!extension_reads_need_auth (interface))
+                        property_cache_add_interface (cache, interface->name);
+        }
+}
+
+/* How many of the latest logins are kept when memory is low */
+#define LOGIN_HISTORY_MIN_DEPTH 3
+
+/* Drops what the user can do without until it is next needed and,
+ * with @trim_history, all but the latest logins.  Returns TRUE if
+ * part of the login history went; a client reading it then has
+ * daemon_local_restore_login_history() called.
+ */
+gboolean
+user_release_memory (User     *user,
+                     gboolean  trim_history)
+{
+        GVariantBuilder builder;
+        GVariant *history;
+        GVariant *login;
+        gsize n_logins;
+        gsize i;
+
+        if (user->extra_data != NULL)
+                extra_data_trim (user->extra_data);
+
+        if (!trim_history || user->login_history == NULL)
+                return FALSE;
+
+        n_logins = g_variant_n_children (user->login_history);
+        if (n_logins <= LOGIN_HISTORY_MIN_DEPTH)
+                return FALSE;
+
+        /* The latest logins come last */
+        g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(xxa{sv})"));
+        for (i = n_logins - LOGIN_HISTORY_MIN_DEPTH; i < n_logins; i++) {
+                login = g_variant_get_child_value (user->login_history, i);
+                g_variant_builder_add_value (&builder, login);
+                g_variant_unref (login);
+        }
+        history = g_variant_ref_sink (g_variant_builder_end (&builder));
+
+        /* Serializing lets go of the old history the logins point into */
+        g_variant_get_data (history);
+
+        g_variant_unref (user->login_history);
+        user->login_history = history;
+        user->login_history_trimmed = TRUE;
+
+        property_cache_watch (daemon_local_get_property_cache (user->daemon),
+                              user->object_path,
+                              "org.freedesktop.Accounts.User",
+                              "LoginHistory");
+
+        return TRUE;
+}
+
+/* Adds what @user holds to @usage, indexed by MemoryCategory.
+ * Interned strings are shared between users and not counted.
+ */
+void
+user_add_memory_usage (User        *user,
+                       MemoryUsage *usage)
+{
+        const gchar *strings[] = {
+                user->object_path, user->user_name, user->real_name,
+                user->password_hint, user->home_base, user->home_dir, user->email,
+                user->icon_file, user->default_icon_file
+        };
+        GDBusInterfaceInfo *info;
+        guint n_properties;
+        guint i;
+
+        usage[MEMORY_USER_OBJECTS].count++;
+        usage[MEMORY_USER_OBJECTS].size += sizeof (User);
+
+        for (i = 0; i < G_N_ELEMENTS (strings); i++) {
+                if (strings[i] != NULL) {
+                        usage[MEMORY_STRINGS].count++;
+                        usage[MEMORY_STRINGS].size += strlen (strings[i]) + 1;
+                }
+        }
+
+        if (user->extra_data != NULL) {
+                usage[MEMORY_KEYFILES].count++;
+                usage[MEMORY_KEYFILES].size += extra_data_get_size (user->extra_data);
+        }
+
+        if (user->login_history != NULL) {
+                usage[MEMORY_LOGIN_HISTORY].count += g_variant_n_children (user->login_history);
+                usage[MEMORY_LOGIN_HISTORY].size += g_variant_get_size (user->login_history);
+        }
+
+        /* An exported skeleton keeps a value for each property */
+        if (g_dbus_interface_skeleton_get_object_path (G_DBUS_INTERFACE_SKELETON (user)) != NULL) {
+                info = g_dbus_interface_skeleton_get_info (G_DBUS_INTERFACE_SKELETON (user));
+                for (n_properties = 0; info->properties && info->properties[n_properties]; n_properties++)
+                        ;
+                usage[MEMORY_SKELETONS].count++;
+                usage[MEMORY_SKELETONS].size += n_properties * sizeof (GValue);
+        }
+
+        for (i = 0; i < user->n_extension_ids; i++) {
+                if (user->extension_ids[i] != 0) {
+                        usage[MEMORY_EXTENSIONS].count++;
+                        usage[MEMORY_EXTENSIONS].size += sizeof (guint);
+                }
+        }
+}
+
+static gboolean
+record_unnamed_change (User *user)
+{
+        user->change_idle_id = 0;
+
+        if (user->change_unnamed)
+                daemon_local_user_changed (user->daemon, user, NULL);
+
+        user->change_named = FALSE;
+        user->change_unnamed = FALSE;
+
+        return FALSE;
+}
+
+static void
+queue_record_change (User *user)
+{
+        if (user->change_idle_id == 0)
+                user->change_idle_id = g_idle_add ((GSourceFunc) record_unnamed_change, user);
+}
+
+/* Most changes are recorded by name in on_user_notify(), either before
+ * the Changed signal or, with notifications frozen, right after it.
+ * Only a change that no notification named by the time the main loop
+ * is idle is recorded as one of any property.
+ */
+static void
+on_user_changed (User *user)
+{
+        invalidate_property_cache (user);
+
+        if (!user->change_named)
+                user->change_unnamed = TRUE;
+        queue_record_change (user);
+
+        /* Clients follow users nobody has called yet, e.g. the ones
+         * they took from the shared snapshot.  Exported users signal
+         * through their skeleton.
+         */
+        if (!g_dbus_interface_skeleton_has_connection (G_DBUS_INTERFACE_SKELETON (user),
+                                                       user->system_bus_connection))
+                g_dbus_connection_emit_signal (user->system_bus_connection,
+                                               NULL,
+                                               user->object_path,
+                                               "org.freedesktop.Accounts.User",
+                                               "Changed",
+                                               NULL,
+                                               NULL);
+}
+
+/* Turns GObject property names like "real-name" into the D-Bus ones */
+static void
+on_user_notify (User       *user,
+                GParamSpec *pspec)
+{
+        GDBusPropertyInfo *info;
+        const gchar *p;
+        gchar name[64];
+        gboolean upper = TRUE;
+        gsize i = 0;
+
+        for (p = g_param_spec_get_name (pspec); *p != '\0' && i < sizeof (name) - 1; p++) {
+                if (*p == '-' || *p == '_') {
+                        upper = TRUE;
+                        continue;
+                }
+                name[i++] = upper ? g_ascii_toupper (*p) : *p;
+                upper = FALSE;
+        }
+        name[i] = '\0';
+
+        info = g_dbus_interface_info_lookup_property (g_dbus_interface_skeleton_get_info (G_DBUS_INTERFACE_SKELETON (user)),
+                                                      name);
+        invalidate_property_cache (user);
+
+        if (info != NULL) {
+                daemon_local_user_changed (user->daemon, user, info->name);
+
+                user->change_named = TRUE;
+                user->change_unnamed = FALSE;
+                queue_record_change (user);
+        }
 }
 
 static gchar *
@@ -728,6 +1264,11 @@ compute_object_path (User *user)
         return object_path;
 }
 
+/* Users are not exported when they are registered, but on each
+ * connection when a client first asks for them there; see the user
+ * subtree in daemon.c.  Most users are never asked for, and so never
+ * cost a skeleton export or extension interface registrations.
+ */
 void
 user_register (User *user)
 {
@@ -742,20 +1283,130 @@ user_register (User *user)
                 return;
         }
 
-        user->object_path = compute_object_path (user);
+        request_scheduler_attach (daemon_local_get_request_scheduler (user->daemon),
+                                  G_DBUS_INTERFACE_SKELETON (user));
+
+        g_signal_connect (user, "changed", G_CALLBACK (on_user_changed), NULL);
+        g_signal_connect (user, "notify", G_CALLBACK (on_user_notify), NULL);
+        add_property_cache_interfaces (user);
+        daemon_local_queue_shared_snapshot (user->daemon);
+}
+
+/* Exports @user on @connection, unless it is already.  Peers get the
+ * user interface; extension interfaces are only offered on the bus.
+ */
+void
+user_export (User            *user,
+             GDBusConnection *connection)
+{
+        GError *error = NULL;
+
+        if (g_dbus_interface_skeleton_has_connection (G_DBUS_INTERFACE_SKELETON (user), connection))
+                return;
 
         if (!g_dbus_interface_skeleton_export (G_DBUS_INTERFACE_SKELETON (user),
-                                               user->system_bus_connection,
+                                               connection,
                                                user->object_path,
                                                &error)) {
-                if (error != NULL) {
-                        g_critical ("error exporting user object: %s", error->message);
-                        g_error_free (error);
-                }
+                g_warning ("error exporting user object: %s", error->message);
+                g_error_free (error);
                 return;
         }
 
-        user_register_extensions (user);
+        if (connection == user->system_bus_connection)
+                user_register_extensions (user);
+
+        property_cache_add (daemon_local_get_property_cache (user->daemon),
+                            connection,
+                            user->object_path);
+}
+
+/* Called when @connection, a peer connection, was closed */
+void
+user_unexport (User            *user,
+               GDBusConnection *connection)
+{
+        if (g_dbus_interface_skeleton_has_connection (G_DBUS_INTERFACE_SKELETON (user), connection))
+                g_dbus_interface_skeleton_unexport_from_connection (G_DBUS_INTERFACE_SKELETON (user),
+                                                                    connection);
+}
+
+/* The interfaces @user has on @connection, for introspecting it
+ * before it is exported.
+ */
+GDBusInterfaceInfo **
+user_get_interface_infos (User            *user,
+                          GDBusConnection *connection)
+{
+        GPtrArray *infos;
+        GHashTableIter iter;
+        GDBusInterfaceInfo *info;
+
+        infos = g_ptr_array_new ();
+        g_ptr_array_add (infos, g_dbus_interface_info_ref (g_dbus_interface_skeleton_get_info (G_DBUS_INTERFACE_SKELETON (user))));
+
+        if (connection == user->system_bus_connection) {
+                g_hash_table_iter_init (&iter, daemon_get_extension_ifaces (user->daemon));
+                while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&info))
+                        g_ptr_array_add (infos, g_dbus_interface_info_ref (info));
+        }
+
+        g_ptr_array_add (infos, NULL);
+
+        return (GDBusInterfaceInfo **) g_ptr_array_free (infos, FALSE);
+}
+
+/* Method calls that export @user arrive here instead of through the
+ * skeleton's own dispatching, so they are handed to the request
+ * scheduler from here.
+ */
+static void
+user_first_method_call (GDBusConnection       *connection,
+                        const gchar           *sender,
+                        const gchar           *object_path,
+                        const gchar           *interface_name,
+                        const gchar           *method_name,
+                        GVariant              *parameters,
+                        GDBusMethodInvocation *invocation,
+                        gpointer               user_data)
+{
+        User *user = user_data;
+
+        request_scheduler_handle_call (daemon_local_get_request_scheduler (user->daemon),
+                                       G_DBUS_INTERFACE_SKELETON (user),
+                                       invocation);
+}
+
+/* The vtable for the call on @interface_name that made @connection
+ * export @user, or NULL if there is no such interface.
+ */
+const GDBusInterfaceVTable *
+user_get_interface_vtable (User             *user,
+                           GDBusConnection  *connection,
+                           const gchar      *interface_name,
+                           gpointer         *out_user_data)
+{
+        static GDBusInterfaceVTable vtable;
+
+        if (interface_name == NULL)
+                return NULL;
+
+        *out_user_data = user;
+
+        if (strcmp (interface_name, "org.freedesktop.Accounts.User") == 0) {
+                /* Properties are read straight from the skeleton */
+                if (vtable.method_call == NULL) {
+                        vtable = *g_dbus_interface_skeleton_get_vtable (G_DBUS_INTERFACE_SKELETON (user));
+                        vtable.method_call = user_first_method_call;
+                }
+                return &vtable;
+        }
+
+        if (connection == user->system_bus_connection &&
+            g_hash_table_contains (daemon_get_extension_ifaces (user->daemon), interface_name))
+                return &extension_vtable;
+
+        return NULL;
 }
 
 void
@@ -767,7 +1418,22 @@ user_save (User *user)
 void
 user_unregister (User *user)
 {
-        g_dbus_interface_skeleton_unexport (G_DBUS_INTERFACE_SKELETON (user));
+        /* Most users were never exported */
+        if (g_dbus_interface_skeleton_get_connection (G_DBUS_INTERFACE_SKELETON (user)) != NULL)
+                g_dbus_interface_skeleton_unexport (G_DBUS_INTERFACE_SKELETON (user));
+
+        g_signal_handlers_disconnect_by_func (user, on_user_changed, NULL);
+        g_signal_handlers_disconnect_by_func (user, on_user_notify, NULL);
+
+        if (user->change_idle_id != 0) {
+                g_source_remove (user->change_idle_id);
+                user->change_idle_id = 0;
+        }
+        user->change_named = FALSE;
+        user->change_unnamed = FALSE;
+        property_cache_remove (daemon_local_get_property_cache (user->daemon),
+                               user->object_path);
+        daemon_local_queue_shared_snapshot (user->daemon);
 
         if (user->extension_ids) {
                 guint i;
@@ -791,6 +1457,20 @@ user_changed (User *user)
         accounts_user_emit_changed (ACCOUNTS_USER (user));
 }
 
+/* Whether the user is one that ListCachedUsers returns */
+gboolean
+user_is_human (User *user)
+{
+        /* Users that were not loaded from a passwd entry yet, or
+         * that are stale after /etc/shells changed.  The next reload
+         * takes care of the latter.
+         */
+        if (user->classify_generation != user_classify_get_generation ())
+                return user_classify_is_human (user->uid, user->user_name, user->shell, NULL);
+
+        return user->is_human;
+}
+
 User *
 user_new (Daemon *daemon,
           uid_t   uid)
@@ -800,6 +1480,101 @@ user_new (Daemon *daemon,
         user = g_object_new (TYPE_USER, NULL);
         user->daemon = daemon;
         user->uid = uid;
+        user->object_path = compute_object_path (user);
+
+        return user;
+}
+
+GVariant *
+user_to_snapshot (User *user)
+{
+        GVariantBuilder builder;
+        GKeyFile *keyfile;
+        gchar *data;
+
+        g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{sv}"));
+
+        g_variant_builder_add (&builder, "{sv}", "uid", g_variant_new_uint64 (user->uid));
+        g_variant_builder_add (&builder, "{sv}", "gid", g_variant_new_uint64 (user->gid));
+        g_variant_builder_add (&builder, "{sv}", "user-name", g_variant_new_string (user->user_name));
+        if (user->real_name)
+                g_variant_builder_add (&builder, "{sv}", "real-name", g_variant_new_string (user->real_name));
+        if (user->home_base)
+                g_variant_builder_add (&builder, "{sv}", "home-dir",
+                                       g_variant_new_take_string (g_strconcat (user->home_parent, user->home_base, NULL)));
+        if (user->shell)
+                g_variant_builder_add (&builder, "{sv}", "shell", g_variant_new_string (user->shell));
+        g_variant_builder_add (&builder, "{sv}", "account-type", g_variant_new_int32 (user->account_type));
+        g_variant_builder_add (&builder, "{sv}", "password-mode", g_variant_new_int32 (user->password_mode));
+        g_variant_builder_add (&builder, "{sv}", "locked", g_variant_new_boolean (user->locked));
+        g_variant_builder_add (&builder, "{sv}", "system-account", g_variant_new_boolean (user->system_account));
+        g_variant_builder_add (&builder, "{sv}", "local-account", g_variant_new_boolean (user->local_account));
+        g_variant_builder_add (&builder, "{sv}", "login-frequency", g_variant_new_uint64 (user->login_frequency));
+        g_variant_builder_add (&builder, "{sv}", "login-time", g_variant_new_int64 (user->login_time));
+        if (user->login_history)
+                g_variant_builder_add (&builder, "{sv}", "login-history", user->login_history);
+
+        /* Everything else, including vendor extensions, lives in the keyfile */
+        keyfile = build_keyfile (user);
+        data = g_key_file_to_data (keyfile, NULL, NULL);
+        g_key_file_unref (keyfile);
+        g_variant_builder_add (&builder, "{sv}", "keyfile", g_variant_new_take_string (data));
+
+        return g_variant_builder_end (&builder);
+}
+
+User *
+user_new_from_snapshot (Daemon   *daemon,
+                        GVariant *snapshot)
+{
+        User *user;
+        GKeyFile *keyfile;
+        const gchar *data;
+        guint64 uid;
+        guint64 gid;
+        gint32 value;
+
+        if (!g_variant_lookup (snapshot, "uid", "t", &uid))
+                return NULL;
+
+        user = user_new (daemon, (uid_t) uid);
+
+        if (!g_variant_lookup (snapshot, "user-name", "s", &user->user_name)) {
+                g_object_unref (user);
+                return NULL;
+        }
+
+        if (g_variant_lookup (snapshot, "gid", "t", &gid))
+                user->gid = (gid_t) gid;
+        g_variant_lookup (snapshot, "real-name", "s", &user->real_name);
+        if (g_variant_lookup (snapshot, "shell", "&s", &data))
+                user->shell = g_intern_string (data);
+        if (g_variant_lookup (snapshot, "home-dir", "&s", &data))
+                set_home_dir (user, data);
+        if (g_variant_lookup (snapshot, "account-type", "i", &value))
+                user->account_type = CLAMP (value, 0, ACCOUNT_TYPE_LAST);
+        if (g_variant_lookup (snapshot, "password-mode", "i", &value))
+                user->password_mode = CLAMP (value, 0, PASSWORD_MODE_LAST);
+        g_variant_lookup (snapshot, "locked", "b", &user->locked);
+        g_variant_lookup (snapshot, "system-account", "b", &user->system_account);
+        g_variant_lookup (snapshot, "local-account", "b", &user->local_account);
+        g_variant_lookup (snapshot, "login-frequency", "t", &user->login_frequency);
+        g_variant_lookup (snapshot, "login-time", "x", &user->login_time);
+        g_variant_lookup (snapshot, "login-history", "@a(xxa{sv})", &user->login_history);
+
+        /* The password hash is not saved, so the next reload has to
+         * classify the user again.
+         */
+        user->is_human = user_classify_is_human (user->uid, user->user_name, user->shell, NULL);
+        user->is_human_with_password = !user->system_account;
+        user->classify_generation = user_classify_get_generation ();
+
+        if (g_variant_lookup (snapshot, "keyfile", "&s", &data)) {
+                keyfile = g_key_file_new ();
+                if (g_key_file_load_from_data (keyfile, data, -1, 0, NULL))
+                        user_update_from_keyfile (user, keyfile);
+                g_key_file_unref (keyfile);
+        }
 
         return user;
 }
@@ -965,7 +1740,7 @@ user_change_user_name_authorized_cb (Daemon                *daemon,
                 g_free (user->user_name);
                 user->user_name = g_strdup (name);
 
-                move_extra_data (old_name, name);
+                move_extra_data (user, old_name, name);
 
                 accounts_user_emit_changed (ACCOUNTS_USER (user));
 
@@ -1059,10 +1834,7 @@ user_change_language_authorized_cb (Daemon                *daemon,
 {
         gchar *language = data;
 
-        if (g_strcmp0 (user->language, language) != 0) {
-                g_free (user->language);
-                user->language = g_strdup (language);
-
+        if (set_shared_string (&user->language, language)) {
                 save_extra_data (user);
 
                 accounts_user_emit_changed (ACCOUNTS_USER (user));
@@ -1115,10 +1887,7 @@ user_change_x_session_authorized_cb (Daemon                *daemon,
 {
         gchar *x_session = data;
 
-        if (g_strcmp0 (user->x_session, x_session) != 0) {
-                g_free (user->x_session);
-                user->x_session = g_strdup (x_session);
-
+        if (set_shared_string (&user->x_session, x_session)) {
                 save_extra_data (user);
 
                 accounts_user_emit_changed (ACCOUNTS_USER (user));
@@ -1169,10 +1938,7 @@ user_change_location_authorized_cb (Daemon                *daemon,
 {
         gchar *location = data;
 
-        if (g_strcmp0 (user->location, location) != 0) {
-                g_free (user->location);
-                user->location = g_strdup (location);
-
+        if (set_shared_string (&user->location, location)) {
                 save_extra_data (user);
 
                 accounts_user_emit_changed (ACCOUNTS_USER (user));
@@ -1225,7 +1991,7 @@ user_change_home_dir_authorized_cb (Daemon                *daemon,
         GError *error;
         const gchar *argv[7];
 
-        if (g_strcmp0 (user->home_dir, home_dir) != 0) {
+        if (g_strcmp0 (get_home_dir (user), home_dir) != 0) {
                 sys_log (context,
                          "change home directory of user '%s' (%d) to '%s'",
                          user->user_name, user->uid, home_dir);
@@ -1245,10 +2011,7 @@ user_change_home_dir_authorized_cb (Daemon                *daemon,
                         return;
                 }
 
-                g_free (user->home_dir);
-                user->home_dir = g_strdup (home_dir);
-                g_free (user->default_icon_file);
-                user->default_icon_file = g_build_filename (user->home_dir, ".face", NULL);
+                set_home_dir (user, home_dir);
 
                 accounts_user_emit_changed (ACCOUNTS_USER (user));
 
@@ -1284,6 +2047,7 @@ user_change_shell_authorized_cb (Daemon                *daemon,
 
 {
         gchar *shell = data;
+        struct passwd *pwent;
         GError *error;
         const gchar *argv[6];
 
@@ -1306,12 +2070,17 @@ user_change_shell_authorized_cb (Daemon                *daemon,
                         return;
                 }
 
-                g_free (user->shell);
-                user->shell = g_strdup (shell);
+                /* Only shells from the passwd file are interned, so
+                 * callers cannot grow the never-freed string storage.
+                 */
+                pwent = getpwnam (user->user_name);
+                if (pwent != NULL && g_strcmp0 (user->shell, pwent->pw_shell) != 0) {
+                        user->shell = g_intern_string (pwent->pw_shell);
 
-                accounts_user_emit_changed (ACCOUNTS_USER (user));
+                        accounts_user_emit_changed (ACCOUNTS_USER (user));
 
-                g_object_notify (G_OBJECT (user), "shell");
+                        g_object_notify (G_OBJECT (user), "shell");
+                }
         }
 
         accounts_user_complete_set_shell (ACCOUNTS_USER (user), context);
@@ -2056,7 +2825,7 @@ user_real_get_account_type (AccountsUser *user)
 static const gchar *
 user_real_get_home_directory (AccountsUser *user)
 {
-        return USER (user)->home_dir;
+        return get_home_dir (USER (user));
 }
 
 static const gchar *
@@ -2113,7 +2882,7 @@ user_real_get_icon_file (AccountsUser *user)
         if (USER (user)->icon_file)
                 return USER (user)->icon_file;
         else
-                return USER (user)->default_icon_file;
+                return get_default_icon_file (USER (user));
 }
 
 static gboolean
@@ -2153,19 +2922,23 @@ user_finalize (GObject *object)
 
         user = USER (object);
 
-        g_clear_pointer (&user->keyfile, g_key_file_unref);
+        if (user->change_idle_id != 0)
+                g_source_remove (user->change_idle_id);
+
+        g_clear_pointer (&user->extra_data, extra_data_free);
 
         g_free (user->object_path);
         g_free (user->user_name);
         g_free (user->real_name);
+        shared_string_unref (user->home_parent);
+        g_free (user->home_base);
         g_free (user->home_dir);
-        g_free (user->shell);
         g_free (user->icon_file);
         g_free (user->default_icon_file);
         g_free (user->email);
-        g_free (user->language);
-        g_free (user->x_session);
-        g_free (user->location);
+        shared_string_unref (user->language);
+        shared_string_unref (user->x_session);
+        shared_string_unref (user->location);
         g_free (user->password_hint);
 
 	if (user->login_history)
@@ -2188,10 +2961,10 @@ user_set_property (GObject      *object,
                 user->account_type = g_value_get_int (value);
                 break;
         case PROP_LANGUAGE:
-                user->language = g_value_dup_string (value);
+                set_shared_string (&user->language, g_value_get_string (value));
                 break;
         case PROP_X_SESSION:
-                user->x_session = g_value_dup_string (value);
+                set_shared_string (&user->x_session, g_value_get_string (value));
                 break;
         case PROP_EMAIL:
                 user->email = g_value_dup_string (value);
@@ -2206,6 +2979,7 @@ user_set_property (GObject      *object,
                 if (user->login_history)
                         g_variant_unref (user->login_history);
                 user->login_history = g_variant_ref (g_value_get_variant (value));
+                user->login_history_trimmed = FALSE;
                 break;
         case PROP_AUTOMATIC_LOGIN:
                 user->automatic_login = g_value_get_boolean (value);
@@ -2247,7 +3021,7 @@ user_get_property (GObject    *object,
                 g_value_set_string (value, user->password_hint);
                 break;
         case PROP_HOME_DIR:
-                g_value_set_string (value, user->home_dir);
+                g_value_set_string (value, get_home_dir (user));
                 break;
         case PROP_SHELL:
                 g_value_set_string (value, user->shell);
@@ -2268,10 +3042,7 @@ user_get_property (GObject    *object,
                 if (user->icon_file)
                         g_value_set_string (value, user->icon_file);
                 else {
-                        gchar *icon_file;
-
-                        icon_file = g_build_filename (user->home_dir, ".face", NULL);
-                        g_value_take_string (value, icon_file);
+                        g_value_set_string (value, get_default_icon_file (user));
                 }
                 break;
         case PROP_LOGIN_FREQUENCY:
@@ -2362,6 +3133,8 @@ user_init (User *user)
         user->user_name = NULL;
         user->real_name = NULL;
         user->account_type = ACCOUNT_TYPE_STANDARD;
+        user->home_parent = NULL;
+        user->home_base = NULL;
         user->home_dir = NULL;
         user->shell = NULL;
         user->icon_file = NULL;
@@ -2376,5 +3149,5 @@ user_init (User *user)
         user->automatic_login = FALSE;
         user->system_account = FALSE;
         user->login_history = NULL;
-        user->keyfile = g_key_file_new ();
+        user->extra_data = NULL;
 }
@@ -27,6 +27,7 @@
 #include <gio/gio.h>
 
 #include "types.h"
+#include "memory-stats.h"
 
 G_BEGIN_DECLS
 
@@ -61,19 +62,47 @@ void           user_update_local_account_property (User          *user,
                                                    gboolean       local);
 void           user_update_system_account_property (User          *user,
                                                     gboolean       system);
+void           user_update_login_accounting (User          *user,
+                                             guint64        frequency,
+                                             gint64         time,
+                                             GVariant      *history);
 
 void           user_register                (User          *user);
 void           user_unregister              (User          *user);
+void           user_export                  (User            *user,
+                                             GDBusConnection *connection);
+void           user_unexport                (User            *user,
+                                             GDBusConnection *connection);
+GDBusInterfaceInfo **
+               user_get_interface_infos     (User            *user,
+                                             GDBusConnection *connection);
+const GDBusInterfaceVTable *
+               user_get_interface_vtable    (User            *user,
+                                             GDBusConnection *connection,
+                                             const gchar     *interface_name,
+                                             gpointer        *out_user_data);
+
 void           user_changed                 (User          *user);
 
 void           user_save                    (User          *user);
 
+void           user_build_property_cache    (User          *user);
+gboolean       user_release_memory          (User          *user,
+                                             gboolean       trim_history);
+void           user_add_memory_usage        (User          *user,
+                                             MemoryUsage   *usage);
+
+GVariant *     user_to_snapshot             (User          *user);
+User *         user_new_from_snapshot       (Daemon        *daemon,
+                                             GVariant      *snapshot);
+
 const gchar *  user_get_user_name           (User          *user);
 gboolean       user_get_system_account      (User          *user);
 gboolean       user_get_local_account       (User          *user);
 const gchar *  user_get_object_path         (User          *user);
 uid_t          user_get_uid                 (User          *user);
 const gchar *  user_get_shell               (User          *user);
+gboolean       user_is_human                (User          *user);
 
 G_END_DECLS
 
@@ -27,12 +27,16 @@
 #include <sys/wait.h>
 #include <fcntl.h>
 #include <grp.h>
+#include <pwd.h>
+#include <errno.h>
+#include <unistd.h>
 
 #include <syslog.h>
 
 #include <polkit/polkit.h>
 
 #include "util.h"
+#include "latency-stats.h"
 
 static gchar *
 get_cmdline_of_pid (GPid pid)
@@ -74,14 +78,36 @@ get_cmdline_of_pid (GPid pid)
   return ret;
 }
 
+/* Calls made on a connection to the private socket have no sender;
+ * the peer is then identified by the credentials it connected with.
+ */
+static GCredentials *
+get_peer_credentials (GDBusMethodInvocation *context)
+{
+        if (g_dbus_method_invocation_get_sender (context) != NULL)
+                return NULL;
+
+        return g_dbus_connection_get_peer_credentials (g_dbus_method_invocation_get_connection (context));
+}
+
 static gboolean
 get_caller_pid (GDBusMethodInvocation *context,
                 GPid                  *pid)
 {
         GVariant      *reply;
         GError        *error;
+        GCredentials  *credentials;
         guint32        pid_as_int;
 
+        if (g_dbus_method_invocation_get_sender (context) == NULL) {
+                credentials = get_peer_credentials (context);
+                if (credentials == NULL)
+                        return FALSE;
+
+                *pid = g_credentials_get_unix_pid (credentials, NULL);
+                return *pid > 0;
+        }
+
         error = NULL;
         reply = g_dbus_connection_call_sync (g_dbus_method_invocation_get_connection (context),
                                              "org.freedesktop.DBus",
@@ -113,6 +139,20 @@ get_caller_pid (GDBusMethodInvocation *context,
         return TRUE;
 }
 
+PolkitSubject *
+get_caller_subject (GDBusMethodInvocation *context)
+{
+        GCredentials *credentials;
+
+        credentials = get_peer_credentials (context);
+        if (credentials == NULL)
+                return polkit_system_bus_name_new (g_dbus_method_invocation_get_sender (context));
+
+        return polkit_unix_process_new_for_owner (g_credentials_get_unix_pid (credentials, NULL),
+                                                  0,
+                                                  g_credentials_get_unix_user (credentials, NULL));
+}
+
 void
 sys_log (GDBusMethodInvocation *context,
          const gchar           *format,
@@ -133,7 +173,7 @@ sys_log (GDBusMethodInvocation *context,
                 gint uid = -1;
                 gchar *tmp;
 
-                subject = polkit_system_bus_name_new (g_dbus_method_invocation_get_sender (context));
+                subject = get_caller_subject (context);
                 id = polkit_subject_to_string (subject);
 
                 if (get_caller_pid (context, &pid)) {
@@ -246,10 +286,16 @@ spawn_with_login_uid (GDBusMethodInvocation  *context,
         gboolean ret = FALSE;
         gchar loginuid[20];
         gint status;
+        gint64 start_time;
+        gboolean spawned;
 
         get_caller_loginuid (context, loginuid, G_N_ELEMENTS (loginuid));
 
-        if (!g_spawn_sync (NULL, (gchar**)argv, NULL, 0, setup_loginuid, loginuid, NULL, NULL, &status, error))
+        start_time = g_get_monotonic_time ();
+        spawned = g_spawn_sync (NULL, (gchar**)argv, NULL, 0, setup_loginuid, loginuid, NULL, NULL, &status, error);
+        latency_stats_add (context, LATENCY_PHASE_SPAWN, g_get_monotonic_time () - start_time);
+
+        if (!spawned)
                 goto out;
         if (!compat_check_exit_status (status, error))
                 goto out;
@@ -259,6 +305,129 @@ spawn_with_login_uid (GDBusMethodInvocation  *context,
         return ret;
 }
 
+static gsize
+get_pwent_size (const struct passwd *pwent)
+{
+        const gchar *fields[] = { pwent->pw_name, pwent->pw_passwd, pwent->pw_gecos, pwent->pw_dir, pwent->pw_shell };
+        gsize size;
+        gint i;
+
+        size = sizeof (struct passwd);
+        for (i = 0; i < G_N_ELEMENTS (fields); i++) {
+                if (fields[i] != NULL)
+                        size += strlen (fields[i]) + 1;
+        }
+
+        return size;
+}
+
+/* Packs @pwent into @copy, which must be get_pwent_size() bytes */
+static struct passwd *
+pack_pwent (const struct passwd *pwent,
+            struct passwd       *copy)
+{
+        const gchar *fields[5];
+        gchar **copies[5];
+        gsize size;
+        gchar *p;
+        gint i;
+
+        fields[0] = pwent->pw_name;
+        fields[1] = pwent->pw_passwd;
+        fields[2] = pwent->pw_gecos;
+        fields[3] = pwent->pw_dir;
+        fields[4] = pwent->pw_shell;
+
+        memset (copy, 0, sizeof (struct passwd));
+        copy->pw_uid = pwent->pw_uid;
+        copy->pw_gid = pwent->pw_gid;
+
+        copies[0] = &copy->pw_name;
+        copies[1] = &copy->pw_passwd;
+        copies[2] = &copy->pw_gecos;
+        copies[3] = &copy->pw_dir;
+        copies[4] = &copy->pw_shell;
+
+        p = (gchar *) (copy + 1);
+        for (i = 0; i < G_N_ELEMENTS (fields); i++) {
+                if (fields[i] != NULL) {
+                        size = strlen (fields[i]) + 1;
+                        memcpy (p, fields[i], size);
+                        *copies[i] = p;
+                        p += size;
+                }
+        }
+
+        return copy;
+}
+
+/* Copies a passwd entry into a single allocation that can be freed
+ * with g_free(), so that it outlives the static or caller-supplied
+ * buffer of the lookup that produced it.
+ */
+struct passwd *
+copy_pwent (const struct passwd *pwent)
+{
+        return pack_pwent (pwent, g_malloc (get_pwent_size (pwent)));
+}
+
+/* Like copy_pwent(), but the copy is owned by @arena */
+struct passwd *
+copy_pwent_to_arena (const struct passwd *pwent,
+                     Arena               *arena)
+{
+        return pack_pwent (pwent, arena_alloc (arena, get_pwent_size (pwent)));
+}
+
+/* Thread-safe getpwnam() or getpwuid(), depending on whether @name
+ * is given; free the result with g_free()
+ */
+static struct passwd *
+lookup_pwent (const gchar *name,
+              uid_t        uid)
+{
+        struct passwd pwd;
+        struct passwd *result = NULL;
+        struct passwd *copy = NULL;
+        gchar *buffer = NULL;
+        glong size;
+        gint ret;
+
+        size = sysconf (_SC_GETPW_R_SIZE_MAX);
+        if (size <= 0)
+                size = 16384;
+
+        for (;;) {
+                buffer = g_realloc (buffer, size);
+                if (name != NULL)
+                        ret = getpwnam_r (name, &pwd, buffer, size, &result);
+                else
+                        ret = getpwuid_r (uid, &pwd, buffer, size, &result);
+                if (ret != ERANGE)
+                        break;
+                size *= 2;
+        }
+
+        if (ret == 0 && result != NULL)
+                copy = copy_pwent (result);
+
+        g_free (buffer);
+
+        return copy;
+}
+
+struct passwd *
+lookup_pwent_by_name (const gchar *name)
+{
+        return lookup_pwent (name, 0);
+}
+
+struct passwd *
+lookup_pwent_by_uid (uid_t uid)
+{
+        return lookup_pwent (NULL, uid);
+}
+
 gint
 get_user_groups (const gchar  *user,
                  gid_t         group,
@@ -284,6 +453,16 @@ get_caller_uid (GDBusMethodInvocation *context,
 {
         GVariant      *reply;
         GError        *error;
+        GCredentials  *credentials;
+
+        if (g_dbus_method_invocation_get_sender (context) == NULL) {
+                credentials = get_peer_credentials (context);
+                if (credentials == NULL)
+                        return FALSE;
+
+                *uid = g_credentials_get_unix_user (credentials, NULL);
+                return *uid != -1;
+        }
 
         error = NULL;
         reply = g_dbus_connection_call_sync (g_dbus_method_invocation_get_connection (context),
@@ -313,3 +492,58 @@ get_caller_uid (GDBusMethodInvocation *context,
 
         return TRUE;
 }
+
+/* Strings that many users share, such as languages, sessions and the
+ * directories homes are in, are kept once, with a count of the users
+ * holding them.  Unlike g_intern_string(), they go away again once no
+ * user has them, so that values clients set do not pile up.
+ */
+static GHashTable *shared_strings;
+G_LOCK_DEFINE_STATIC (shared_strings);
+
+const gchar *
+shared_string_ref (const gchar *str)
+{
+        gpointer key;
+        guint *count;
+
+        if (str == NULL)
+                return NULL;
+
+        G_LOCK (shared_strings);
+
+        if (shared_strings == NULL)
+                shared_strings = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+
+        if (g_hash_table_lookup_extended (shared_strings, str, &key, (gpointer *)&count))
+                (*count)++;
+        else {
+                key = g_strdup (str);
+                count = g_new (guint, 1);
+                *count = 1;
+                g_hash_table_insert (shared_strings, key, count);
+        }
+
+        G_UNLOCK (shared_strings);
+
+        return key;
+}
+
+void
+shared_string_unref (const gchar *str)
+{
+        guint *count;
+
+        if (str == NULL)
+                return;
+
+        G_LOCK (shared_strings);
+
+        count = g_hash_table_lookup (shared_strings, str);
+        if (count == NULL)
+                g_warning ("unknown shared string '%s'", str);
+        else if (--(*count) == 0)
+                g_hash_table_remove (shared_strings, str);
+
+        G_UNLOCK (shared_strings);
+}
@@ -22,7 +22,11 @@
 #ifndef __UTIL_H__
 #define __UTIL_H__
 
+#include <pwd.h>
 #include <glib.h>
+#include <polkit/polkit.h>
+
+#include "arena.h"
 
 G_BEGIN_DECLS
 
@@ -31,6 +35,7 @@ void sys_log (GDBusMethodInvocation *context,
                                      ...);
 
 gboolean get_caller_uid (GDBusMethodInvocation *context, gint *uid);
+PolkitSubject *get_caller_subject (GDBusMethodInvocation *context);
 
 gboolean spawn_with_login_uid (GDBusMethodInvocation  *context,
                                const gchar            *argv[],
@@ -40,6 +45,15 @@ gint get_user_groups (const gchar  *username,
                       gid_t         group,
                       gid_t       **groups);
 
+struct passwd *copy_pwent           (const struct passwd *pwent);
+struct passwd *copy_pwent_to_arena  (const struct passwd *pwent,
+                                     Arena               *arena);
+struct passwd *lookup_pwent_by_name (const gchar         *name);
+struct passwd *lookup_pwent_by_uid  (uid_t                uid);
+
+const gchar *shared_string_ref   (const gchar *str);
+void         shared_string_unref (const gchar *str);
+
 G_END_DECLS
 
 #endif /* __UTIL_H__ */
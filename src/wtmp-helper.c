@@ -29,30 +29,22 @@
 
 #include <utmpx.h>
 
+typedef struct UserPreviousLogin UserPreviousLogin;
+
+struct UserPreviousLogin {
+        UserPreviousLogin *next;
+        const gchar       *id;  /* interned, there are few distinct lines */
+        gint64             login_time;
+        gint64             logout_time;
+};
+
 typedef struct {
         guint64 frequency;
         gint64 time;
-        GList *previous_logins;
+        UserPreviousLogin *first_login;  /* oldest first */
+        UserPreviousLogin *last_login;
 } UserAccounting;
 
-typedef struct {
-        gchar  *id;
-        gint64  login_time;
-        gint64  logout_time;
-} UserPreviousLogin;
-
-typedef struct {
-        GHashTable *login_hash;
-        GHashTable *logout_hash;
-} WTmpGeneratorState;
-
-static void
-user_previous_login_free (UserPreviousLogin *previous_login)
-{
-        g_free (previous_login->id);
-        g_free (previous_login);
-}
-
 static gboolean
 wtmp_helper_start (void)
 {
@@ -73,37 +65,57 @@ wtmp_helper_start (void)
                 return TRUE;
 }
 
-struct passwd *
-wtmp_helper_entry_generator (GHashTable *users,
-                             gpointer   *state)
+static WTmpHelperAccounting *
+accounting_to_helper (UserAccounting *accounting)
 {
-        GHashTable *login_hash, *logout_hash;
+        WTmpHelperAccounting *result;
+        GVariantBuilder *builder, *builder2;
+        UserPreviousLogin *previous_login;
+
+        result = g_new0 (WTmpHelperAccounting, 1);
+        result->frequency = accounting->frequency;
+        result->time = accounting->time;
+
+        builder = g_variant_builder_new (G_VARIANT_TYPE ("a(xxa{sv})"));
+        for (previous_login = accounting->first_login; previous_login != NULL; previous_login = previous_login->next) {
+                builder2 = g_variant_builder_new (G_VARIANT_TYPE ("a{sv}"));
+                g_variant_builder_add (builder2, "{sv}", "type", g_variant_new_string (previous_login->id));
+                g_variant_builder_add (builder, "(xxa{sv})", previous_login->login_time, previous_login->logout_time, builder2);
+                g_variant_builder_unref (builder2);
+        }
+        result->history = g_variant_ref_sink (g_variant_new ("a(xxa{sv})", builder));
+        g_variant_builder_unref (builder);
+
+        /* Turns the tree of values into one flat buffer, which is
+         * what users hold on to for as long as they live.
+         */
+        g_variant_get_data (result->history);
+
+        return result;
+}
+
+/* Reads the login accounting for all users from wtmp.  Only uses
+ * plain data, so it may run on a worker thread.  The keys of the
+ * returned table and the intermediate records are allocated from
+ * @arena, which must outlive the table.
+ */
+GHashTable *
+wtmp_helper_read_accounting (Arena *arena)
+{
+        GHashTable *login_hash, *logout_hash, *result;
         struct utmpx *wtmp_entry;
         GHashTableIter iter;
         gpointer key, value;
-        struct passwd *pwent;
-        User *user;
-        WTmpGeneratorState *state_data;
-        GVariantBuilder *builder, *builder2;
-        GList *l;
 
-        if (*state == NULL) {
-                /* First iteration */
+        result = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, (GDestroyNotify) wtmp_helper_accounting_free);
 
-                if (!wtmp_helper_start ()) {
-                        return NULL;
-                }
-
-                *state = g_new (WTmpGeneratorState, 1);
-                state_data = *state;
-                state_data->login_hash = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
-                state_data->logout_hash = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+        if (!wtmp_helper_start ()) {
+                return result;
         }
 
-        /* Every iteration */
-        state_data = *state;
-        login_hash = state_data->login_hash;
-        logout_hash = state_data->logout_hash;
+        login_hash = g_hash_table_new (g_str_hash, g_str_equal);
+        logout_hash = g_hash_table_new (g_str_hash, g_str_equal);
+
         while ((wtmp_entry = getutxent ())) {
                 UserAccounting    *accounting;
                 UserPreviousLogin *previous_login;
@@ -137,19 +149,15 @@ wtmp_helper_entry_generator (GHashTable *users,
                         continue;
                 }
 
-                pwent = getpwnam (wtmp_entry->ut_user);
-                if (pwent == NULL) {
-                        continue;
-                }
-
                 if (!g_hash_table_lookup_extended (login_hash,
                                                    wtmp_entry->ut_user,
                                                    &key, &value)) {
-                        accounting = g_new (UserAccounting, 1);
+                        accounting = arena_alloc (arena, sizeof (UserAccounting));
                         accounting->frequency = 0;
-                        accounting->previous_logins = NULL;
+                        accounting->first_login = NULL;
+                        accounting->last_login = NULL;
 
-                        g_hash_table_insert (login_hash, g_strdup (wtmp_entry->ut_user), accounting);
+                        g_hash_table_insert (login_hash, arena_strndup (arena, wtmp_entry->ut_user, sizeof (wtmp_entry->ut_user)), accounting);
                 } else {
                         accounting = value;
                 }
@@ -158,55 +166,33 @@ wtmp_helper_entry_generator (GHashTable *users,
                 accounting->time = wtmp_entry->ut_tv.tv_sec;
 
                 /* Add zero logout time to change it later on logout record */
-                previous_login = g_new (UserPreviousLogin, 1);
-                previous_login->id = g_strdup (wtmp_entry->ut_line);
+                previous_login = arena_alloc (arena, sizeof (UserPreviousLogin));
+                previous_login->next = NULL;
+                previous_login->id = g_intern_string (wtmp_entry->ut_line);
                 previous_login->login_time = wtmp_entry->ut_tv.tv_sec;
                 previous_login->logout_time = 0;
-                accounting->previous_logins = g_list_prepend (accounting->previous_logins, previous_login);
+                if (accounting->last_login != NULL)
+                        accounting->last_login->next = previous_login;
+                else
+                        accounting->first_login = previous_login;
+                accounting->last_login = previous_login;
 
-                g_hash_table_insert (logout_hash, g_strdup (wtmp_entry->ut_line), previous_login);
-
-                return pwent;
+                g_hash_table_insert (logout_hash, (gpointer) previous_login->id, previous_login);
         }
 
-        /* Last iteration */
         endutxent ();
 
         g_hash_table_iter_init (&iter, login_hash);
         while (g_hash_table_iter_next (&iter, &key, &value)) {
-                UserAccounting    *accounting = (UserAccounting *) value;
-                UserPreviousLogin *previous_login;
+                UserAccounting *accounting = (UserAccounting *) value;
 
-                user = g_hash_table_lookup (users, key);
-                if (user == NULL) {
-                        g_list_free_full (accounting->previous_logins, (GDestroyNotify) user_previous_login_free);
-                        continue;
-                }
-
-                g_object_set (user, "login-frequency", accounting->frequency, NULL);
-                g_object_set (user, "login-time", accounting->time, NULL);
-
-                builder = g_variant_builder_new (G_VARIANT_TYPE ("a(xxa{sv})"));
-                for (l = g_list_last (accounting->previous_logins); l != NULL; l = l->prev) {
-                        previous_login = l->data;
-
-                        builder2 = g_variant_builder_new (G_VARIANT_TYPE ("a{sv}"));
-                        g_variant_builder_add (builder2, "{sv}", "type", g_variant_new_string (previous_login->id));
-                        g_variant_builder_add (builder, "(xxa{sv})", previous_login->login_time, previous_login->logout_time, builder2);
-                        g_variant_builder_unref (builder2);
-                }
-                g_object_set (user, "login-history", g_variant_new ("a(xxa{sv})", builder), NULL);
-                g_variant_builder_unref (builder);
-                g_list_free_full (accounting->previous_logins, (GDestroyNotify) user_previous_login_free);
-
-                user_changed (user);
+                g_hash_table_insert (result, key, accounting_to_helper (accounting));
         }
 
         g_hash_table_unref (login_hash);
         g_hash_table_unref (logout_hash);
-        g_free (state_data);
-        *state = NULL;
-        return NULL;
+
+        return result;
 }
 
 const gchar *
@@ -223,11 +209,10 @@ wtmp_helper_get_path_for_monitor (void)
 
 #else /* HAVE_UTMPX_H */
 
-struct passwd *
-wtmp_helper_entry_generator (GHashTable *users,
-                             gpointer   *state)
+GHashTable *
+wtmp_helper_read_accounting (Arena *arena)
 {
-        return NULL;
+        return g_hash_table_new_full (g_str_hash, g_str_equal, NULL, (GDestroyNotify) wtmp_helper_accounting_free);
 }
 
 const gchar *
@@ -237,3 +222,20 @@ wtmp_helper_get_path_for_monitor (void)
 }
 
 #endif /* HAVE_UTMPX_H */
+
+void
+wtmp_helper_accounting_free (WTmpHelperAccounting *accounting)
+{
+        g_variant_unref (accounting->history);
+        g_free (accounting);
+}
+
+void
+wtmp_helper_update_user (User                       *user,
+                         const WTmpHelperAccounting *accounting)
+{
+        user_update_login_accounting (user,
+                                      accounting->frequency,
+                                      accounting->time,
+                                      accounting->history);
+}
@@ -24,8 +24,19 @@
 #include <glib.h>
 #include <pwd.h>
 
+#include "types.h"
+#include "arena.h"
+
+typedef struct {
+        guint64   frequency;
+        gint64    time;
+        GVariant *history;
+} WTmpHelperAccounting;
+
 const gchar *           wtmp_helper_get_path_for_monitor                (void);
-struct passwd *         wtmp_helper_entry_generator                     (GHashTable *users,
-                                                                         gpointer   *state);
+GHashTable *            wtmp_helper_read_accounting                     (Arena                      *arena);
+void                    wtmp_helper_accounting_free                     (WTmpHelperAccounting       *accounting);
+void                    wtmp_helper_update_user                         (User                       *user,
+                                                                         const WTmpHelperAccounting *accounting);
 
 #endif /* __WTMP_HELPER_H__ */